@@ -0,0 +1,98 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+/** Bloom filter module.
+ *
+ * Provides blocked bloom filters: sets of keys that may answer "maybe" for a
+ * key that was never added, but never answer "no" for one that was. All the
+ * bits of a key are set in a single block the size of a cache line, so a query
+ * touches one cache line, whatever the false positive rate.
+ *
+ * Keys are hashed the same way maps hash them, and a hash computed for a map
+ * (see 'map_hash') can be used for a filter as well.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "map.h"
+
+/* The number of 64-bit words in a block. */
+#define BLOOM_BLOCK_WORDS 8
+
+struct bloom
+{
+	/* 'num_blocks' blocks of BLOOM_BLOCK_WORDS words, aligned to 64 bytes. */
+	uint64_t *blocks;
+	size_t num_blocks;
+	/* The number of bits set per key. */
+	unsigned int num_bits;
+
+	/* The number of keys the filter was sized for, and the number of keys
+	 * added to it (including repeated ones). */
+	size_t capacity, count;
+
+	/* If this is NULL, then 'fixed_key_size' will be used instead. */
+	key_size_fn key_size;
+	size_t fixed_key_size;
+	hash_fn hash;
+	uint64_t seed;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a filter sized for 'capacity' keys with the rate of false positives
+ * not exceeding 'fp_rate' (between 0 and 1, exclusive) by much while it holds
+ * no more than that. Keys are hashed by 'hash_wy' with a random seed.
+ * Return NULL if 'fp_rate' is out of range (with errno set to EINVAL), or if
+ * there's not enough memory. */
+struct bloom *
+bloom_create(size_t capacity, double fp_rate, key_size_fn key_size);
+
+/* Create a filter with fixed size of keys. */
+struct bloom *
+bloom_create_fs(size_t capacity, double fp_rate, size_t key_size);
+
+/* ---------- destruction ---------- */
+
+void
+bloom_destroy(struct bloom *);
+
+/* ---------- manipulation ---------- */
+
+void
+bloom_add(struct bloom *, void *key);
+
+/* Same, but with a hash of the key computed already, by 'bloom_hash' or by
+ * 'map_hash' of any map. The filter mixes its own seed in. Use the same hash
+ * function for adding and for querying. */
+void
+bloom_add_hashed(struct bloom *, size_t hash);
+
+/* Remove all keys. */
+void
+bloom_clear(struct bloom *);
+
+/* ---------- information retrieval ---------- */
+
+/* Return 0 if 'key' has never been added, a non-zero value if it might have
+ * been. */
+int
+bloom_contains(struct bloom *, void *key);
+
+int
+bloom_contains_hashed(struct bloom *, size_t hash);
+
+/* Return the hash of 'key' as used by the filter. */
+size_t
+bloom_hash(struct bloom *, void *key);
+
+inline size_t
+bloom_count(struct bloom *bloom)
+{
+	return bloom->count;
+}
+
+#endif /* BLOOM_H */
@@ -0,0 +1,115 @@
+#ifndef CKMAP_H
+#define CKMAP_H
+
+/** Cuckoo map module.
+ *
+ * Provides maps based on cuckoo hashing: every key may only be in one of two
+ * buckets of a few slots each, chosen by its hash, so a lookup reads at most
+ * two buckets (plus a small stash, which is almost always empty), however full
+ * the map is and whatever keys it holds. An insertion into two full buckets
+ * kicks a pair out into its other bucket, which may kick out another one, and
+ * so on, up to a bound, after which the pair left over goes to the stash.
+ *
+ * Lookups take bounded time at the cost of insertions, which take longer than
+ * those of ordinary maps on average, and much longer when the map grows.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+#define CKMAP_BUCKET_SLOTS 4
+
+/* Slots hold the hash of their key with the lowest bit set, or 0 if they are
+ * empty. Hashes are compared before keys. */
+struct ckmap_bucket
+{
+	uint64_t tags[CKMAP_BUCKET_SLOTS];
+	struct map_pair pairs[CKMAP_BUCKET_SLOTS];
+};
+
+struct ckmap
+{
+	/* A power of two of buckets, and the stash for pairs that didn't fit
+	 * into either of theirs. */
+	struct ckmap_bucket *buckets;
+	size_t num_buckets;
+	struct ckmap_bucket stash;
+	unsigned int stash_size;
+
+	size_t size;
+
+	/* Picks the pairs to kick out. */
+	uint64_t rng;
+
+	/* If this is NULL, then 'fixed_key_size' will be used instead. */
+	key_size_fn key_size;
+	size_t fixed_key_size;
+	hash_fn hash;
+	uint64_t seed;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a map with room for 'num_pairs' pairs. Keys are hashed by 'hash_wy'
+ * with a random seed.
+ * Return NULL if there's not enough memory. */
+struct ckmap *
+ckmap_create(size_t num_pairs, key_size_fn key_size);
+
+/* Create a map with fixed size of keys. */
+struct ckmap *
+ckmap_create_fs(size_t num_pairs, size_t key_size);
+
+/* ---------- destruction ---------- */
+
+void
+ckmap_destroy(struct ckmap *);
+
+/* 'pair_destroyer' will be called on every pair in the mapping, same as with
+ * 'map_destroy_ex'. */
+void
+ckmap_destroy_ex(struct ckmap *, void (*pair_destroyer)(void *pair));
+
+/* ---------- manipulation ---------- */
+
+/* Same as 'map_insert': if 'eq' is NULL, the key is not looked for first. The
+ * map grows when it's 90% full, or when an insertion would need the stash
+ * and it's full.
+ * Return MAPE_OK, MAPE_EXIST, or MAPE_NOMEM if there's not enough memory to
+ * grow the map (or if too many keys have the same hash for any size to fit
+ * them). */
+enum map_err
+ckmap_insert(struct ckmap *, void *key, void *value, key_eq_fn eq);
+
+enum map_err
+ckmap_insert_ex(struct ckmap *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+/* Remove the pair with a key equal to 'key', copying it into 'out'.
+ * Return 'out', or NULL if the key is not in the map. */
+struct map_pair *
+ckmap_remove(struct ckmap *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+ckmap_remove_ex(struct ckmap *, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out);
+
+/* ---------- information retrieval ---------- */
+
+/* The returned pair lives in the map and is valid until the next insertion or
+ * removal, as with open addressing maps. */
+struct map_pair *
+ckmap_lookup(struct ckmap *, void *key, key_eq_fn eq);
+
+struct map_pair *
+ckmap_lookup_ex(struct ckmap *, void *key, key_eq_ex_fn eq, void *eq_arg);
+
+inline size_t
+ckmap_size(struct ckmap *map)
+{
+	return map->size;
+}
+
+#endif /* CKMAP_H */
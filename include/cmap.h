@@ -0,0 +1,109 @@
+#ifndef CMAP_H
+#define CMAP_H
+
+/** Concurrent map module.
+ *
+ * Provides a map that can be used from several threads at once. Keys are
+ * spread over a number of shards, each of them an ordinary map protected by
+ * its own reader-writer lock, so threads working with keys from different
+ * shards never wait for each other, and readers of the same shard don't wait
+ * for each other either.
+ *
+ * Since another thread may remove a pair at any moment, lookups copy the pair
+ * they've found instead of returning a pointer into the map.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+/* Shards are aligned to cache lines so that locking one of them doesn't slow
+ * down threads using its neighbours. */
+struct cmap_shard
+{
+	_Alignas(64) pthread_rwlock_t lock;
+	struct map *map;
+};
+
+struct cmap
+{
+	struct cmap_shard *shards;
+	/* A power of two. Shards are chosen by the top bits of a key's hash, all
+	 * shards use the same hash function and seed. */
+	size_t num_shards;
+	unsigned int shard_shift;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a concurrent map with at least 'num_shards' shards (rounded up to a
+ * power of two), each with 'num_buckets' buckets initially. 'key_size' and
+ * 'flags' are the same as for 'map_create', except that MAPF_INCREMENTAL,
+ * MAPF_INLINE and MAPF_MULTI are not supported and are ignored. */
+struct cmap *
+cmap_create(size_t num_shards, size_t num_buckets, key_size_fn key_size, int flags);
+
+/* Create a concurrent map with fixed size of keys. */
+struct cmap *
+cmap_create_fs(size_t num_shards, size_t num_buckets, size_t key_size, int flags);
+
+/* ---------- destruction ---------- */
+
+/* These are not thread-safe: no other thread may be using the map. */
+
+void
+cmap_destroy(struct cmap *);
+
+/* 'pair_destroyer' will be called on every pair in the mapping, same as with
+ * 'map_destroy_ex'. */
+void
+cmap_destroy_ex(struct cmap *, void (*pair_destroyer)(void *pair));
+
+/* ---------- manipulation ---------- */
+
+/* Same as 'map_insert'. */
+enum map_err
+cmap_insert(struct cmap *, void *key, void *value, key_eq_fn eq);
+
+enum map_err
+cmap_insert_ex(struct cmap *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+/* Atomically look up 'key' and insert it with 'value' if it's not there.
+ * Either way, copy the pair now associated with the key into 'out' (if it's
+ * not NULL).
+ * Return MAPE_OK if the pair was inserted, MAPE_EXIST if the key was already in
+ * the map, MAPE_NOMEM if there's not enough memory to insert it. */
+enum map_err
+cmap_get_or_insert(struct cmap *, void *key, void *value, key_eq_fn eq,
+		struct map_pair *out);
+
+enum map_err
+cmap_get_or_insert_ex(struct cmap *, void *key, void *value, key_eq_ex_fn eq,
+		void *arg, struct map_pair *out);
+
+/* Same as 'map_remove'. The caller owns the returned pair. */
+struct map_pair *
+cmap_remove(struct cmap *, void *key, key_eq_fn eq);
+
+struct map_pair *
+cmap_remove_ex(struct cmap *, void *key, key_eq_ex_fn eq, void *arg);
+
+/* ---------- information retrieval ---------- */
+
+/* Copy the pair with a key equal to 'key' into 'out'.
+ * Return 'out', or NULL if the key is not found in the map. */
+struct map_pair *
+cmap_lookup(struct cmap *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+cmap_lookup_ex(struct cmap *, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out);
+
+/* The sum of sizes of all shards. With concurrent modifications it's only a
+ * snapshot, and not necessarily a consistent one. */
+size_t
+cmap_size(struct cmap *);
+
+#endif /* CMAP_H */
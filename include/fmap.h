@@ -0,0 +1,82 @@
+#ifndef FMAP_H
+#define FMAP_H
+
+/** Frozen map module.
+ *
+ * Provides read-only maps built from the contents of ordinary maps. A frozen
+ * map uses a minimal perfect hash function computed for its keys, so every key
+ * has a slot of its own, there are no collisions and no empty slots, and a
+ * lookup reads exactly one slot (plus one small displacement value) and calls
+ * the comparison function at most once.
+ *
+ * Building a frozen map takes about as long as inserting its keys into
+ * a map, so it pays off for tables that are built once and looked up a lot.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+struct fmap_slot
+{
+	struct map_pair pair;
+	uint64_t hash;
+};
+
+struct fmap
+{
+	/* 'size' slots, one per key. */
+	struct fmap_slot *slots;
+	size_t size;
+
+	/* The hash of a key picks one of 'num_buckets' buckets, and the
+	 * displacement of that bucket picks the slot. */
+	uint32_t *displacements;
+	size_t num_buckets;
+
+	/* If this is NULL, then 'fixed_key_size' will be used instead. */
+	key_size_fn key_size;
+	size_t fixed_key_size;
+	hash_fn hash;
+	uint64_t seed;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a frozen map holding the same pairs as 'map'. The two maps are
+ * independent afterwards, but they point to the same keys and values (so a map
+ * with MAPF_INLINE must outlive the frozen map).
+ * Return NULL if there's not enough memory (with errno set to ENOMEM), or if
+ * the keys can't be told apart by their hashes: the map holds equal keys, or
+ * keys whose hashes collided with every seed tried (errno is EINVAL then). */
+struct fmap *
+fmap_create(struct map *map);
+
+/* ---------- destruction ---------- */
+
+void
+fmap_destroy(struct fmap *);
+
+/* 'pair_destroyer' will be called on every pair in the mapping, same as with
+ * 'map_destroy_ex'. */
+void
+fmap_destroy_ex(struct fmap *, void (*pair_destroyer)(void *pair));
+
+/* ---------- information retrieval ---------- */
+
+/* The returned pair lives in the frozen map and is valid until it's destroyed. */
+struct map_pair *
+fmap_lookup(struct fmap *, void *key, key_eq_fn eq);
+
+struct map_pair *
+fmap_lookup_ex(struct fmap *, void *key, key_eq_ex_fn eq, void *eq_arg);
+
+inline size_t
+fmap_size(struct fmap *fmap)
+{
+	return fmap->size;
+}
+
+#endif /* FMAP_H */
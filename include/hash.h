@@ -0,0 +1,63 @@
+#ifndef HASH_H
+#define HASH_H
+
+/** Hash function module.
+ *
+ * Provides general purpose (non-cryptographic) hash functions for arbitrary
+ * blocks of memory, used by maps and anything else that needs to hash keys.
+ *
+ * All functions take a seed, which should be chosen at random for tables that
+ * may be fed keys by an adversary, so that they can't precompute colliding
+ * keys. Results do not depend on the platform's endianness or instruction set.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef uint64_t (*hash_fn)(void *data, size_t size, uint64_t seed);
+
+/* ---------- hash functions ---------- */
+
+/* FNV-1, one byte at a time. Slow, but simple. */
+extern uint64_t
+hash_fnv(void *data, size_t size, uint64_t seed);
+
+/* A variant of Wang Yi's wyhash, reading 8 bytes at a time and hashing longer
+ * keys in three independent lanes. This is the default hash function of maps. */
+extern uint64_t
+hash_wy(void *data, size_t size, uint64_t seed);
+
+/* Mix a single 64-bit word. Cheaper than hashing it as 8 bytes of memory. */
+inline uint64_t
+hash_word(uint64_t word, uint64_t seed)
+{
+	word ^= seed;
+	word = (word ^ (word >> 30)) * 0xbf58476d1ce4e5b9ull;
+	word = (word ^ (word >> 27)) * 0x94d049bb133111ebull;
+	return word ^ (word >> 31);
+}
+
+/* ---------- seeds ---------- */
+
+/* Return a new random seed. Every call returns a different one. Thread-safe. */
+extern uint64_t
+hash_random_seed(void);
+
+/* ---------- sharding ---------- */
+
+/* Round 'num_shards' up to a power of two, store it in 'num' and return the
+ * shift to pass to 'hash_shard'. Shards are chosen by the top bits of a hash,
+ * which tables within the shards don't use to choose buckets. */
+extern unsigned int
+hash_shard_shift(size_t num_shards, size_t *num);
+
+/* Return the index of the shard of 'hash', out of 'num_shards' as returned by
+ * 'hash_shard_shift'. */
+inline size_t
+hash_shard(size_t hash, unsigned int shift, size_t num_shards)
+{
+	return (hash >> shift) & (num_shards - 1);
+}
+
+#endif /* HASH_H */
@@ -10,11 +10,21 @@
  * have to resort to some nontrivial data juggling to figure out the size of 
  * your object. And size is vital, as it's used in the hashing algorithm. 
  *
+ * Two storage engines are available, selected by flags at creation time:
+ * chained maps keep a list of pairs per bucket, open addressing maps (with
+ * MAPF_OPEN) keep the pairs themselves in one flat array of slots with a byte
+ * of metadata per slot, probed a group of slots at a time. Open addressing
+ * maps with MAPF_ROBIN_HOOD probe linearly instead, keeping pairs ordered by
+ * the distance from their home slots, which keeps probe lengths short and
+ * even. Open addressing maps with MAPF_INLINE store small fixed size keys and
+ * values in the slots themselves rather than pointers to them.
+ *
  */
 
 #include <stdlib.h>
 
 #include "array.h"
+#include "hash.h"
 
 typedef size_t (*key_size_fn)(void *);
 /* These two should return a non-zero value if the objects compare equal, 0
@@ -22,20 +32,147 @@ typedef size_t (*key_size_fn)(void *);
 typedef int (*key_eq_fn)(void *, void *);
 typedef int (*key_eq_ex_fn)(void *data1, void *data2, void *external_arg);
 
+struct map_pair
+{
+	void *key, *value;
+};
+
+/* The values of a key in a map with MAPF_MULTI, in the order they were
+ * appended. The value of every pair of such a map points to one of these. */
+struct map_values
+{
+	size_t size, capacity;
+	void *values[];
+};
+
+/* A chunk of pool-allocated pairs, see MAPF_POOL. */
+struct map_chunk;
+
+/* See MAPF_BLOOM. */
+struct bloom;
+
+struct list_elem;
+
+/* Iterates over the pairs of a map in no particular order. An iterator is
+ * invalidated by any modification of its map, and, for maps being rehashed
+ * incrementally, by lookups as well. */
+struct map_iter
+{
+	struct map *map;
+	/* Chained maps: the buckets being walked (new ones first, then what's
+	 * left of the old ones during a rehash), the next bucket and the next
+	 * element of the current one. Open addressing maps: the next slot. */
+	struct array *buckets;
+	size_t ix;
+	struct list_elem *elem;
+};
+
 struct map
 {
+	/* Chained maps only: an array of 'struct list', one per bucket. The lists
+	 * are stored in the array itself, so empty buckets allocate nothing. */
 	struct array *buckets;
 
+	/* Chained maps only: while a rehash is in progress, the buckets being
+	 * migrated from and the first of them not migrated yet. NULL otherwise. */
+	struct array *old_buckets;
+	size_t rehash_ix;
+
+	/* Chained maps with MAPF_POOL only: the chunks pairs and their list
+	 * elements are allocated from, and a list of the unused ones. */
+	struct map_chunk *chunks;
+	struct list *free_entries;
+
+	/* Open addressing maps only: 'num_slots' control bytes (plus a few cloned
+	 * ones at the end), as many slots and as many full hashes of their keys,
+	 * kept apart from the slots so that lookups don't have to load them. */
+	unsigned char *ctrl;
+	struct map_pair *slots;
+	size_t *hashes;
+	size_t num_slots, num_deleted;
+
+	/* Maps with MAPF_INLINE only: the slots hold the keys themselves, followed
+	 * by their values at 'value_offset', 'slot_size' bytes in all. 'slots'
+	 * then holds a pair pointing into each of them for lookups to return,
+	 * and there are no hashes. 'removed' holds a copy of the slot removed
+	 * last. */
+	unsigned char *inline_slots;
+	size_t value_size, value_offset, slot_size;
+	unsigned char *removed;
+
+	/* Maps with MAPF_BLOOM only: a filter holding the hashes of all keys
+	 * inserted since it was last rebuilt, NULL otherwise. */
+	struct bloom *filter;
+
+	/* The number of pairs in the map and the number of non-empty buckets
+	 * (full slots for open addressing maps), kept up to date by every
+	 * operation. */
+	size_t size, num_occupied;
+
 	/* If this is NULL, then 'fixed_key_size' will be used instead. */
 	key_size_fn key_size;
 	size_t fixed_key_size;
 
-	int allow_autoexpand;
+	/* The seed is random for every map. It may only be changed while the map
+	 * is empty. */
+	hash_fn hash;
+	uint64_t seed;
+
+	/* A bitwise OR of 'enum map_flag' values. */
+	int flags;
+
+	/* The map expands once its load factor (see 'map_load_factor') reaches
+	 * 'max_load_factor', multiplying its number of buckets by
+	 * 'growth_factor'. See 'map_set_max_load_factor'. */
+	double max_load_factor, growth_factor;
 };
 
-struct map_pair
+enum map_flag
 {
-	void *key, *value;
+	/* Expand the map automatically when its load factor becomes too high. */
+	MAPF_AUTOEXPAND = 1 << 0,
+	/* Use open addressing instead of chaining. */
+	MAPF_OPEN = 1 << 1,
+	/* Chained maps only: spread the work of expanding the map over the
+	 * following operations instead of doing it all at once. */
+	MAPF_INCREMENTAL = 1 << 2,
+	/* Chained maps only: use a power of two number of buckets, indexed by the
+	 * top bits of the (Fibonacci-mixed) hash rather than by division. */
+	MAPF_POW2 = 1 << 3,
+	/* Chained maps only: allocate pairs together with their list elements
+	 * from large chunks owned by the map, reusing the ones freed by
+	 * removals, and release all of them at once when the map is destroyed. */
+	MAPF_POOL = 1 << 4,
+	/* Use open addressing with linear probing and Robin Hood displacement:
+	 * a pair being inserted takes the slot of any pair closer to its own
+	 * home slot, removals shift the following pairs back instead of leaving
+	 * tombstones, and lookups stop as soon as they pass where the key would
+	 * be. The table also grows when a probe gets longer than a bound, unless
+	 * it's mostly empty (then the hash function is at fault, and growing
+	 * wouldn't help). Implies MAPF_OPEN. */
+	MAPF_ROBIN_HOOD = 1 << 5,
+	/* Open addressing maps with fixed size keys only: copy every key and its
+	 * value (see 'map_create_inline') into the map's slots, and compare keys
+	 * bytewise, ignoring the comparison functions passed (passing NULL still
+	 * skips the check for existing keys on insertion). Implies MAPF_OPEN,
+	 * and can't be combined with MAPF_ROBIN_HOOD. */
+	MAPF_INLINE = 1 << 6,
+	/* Keep a blocked bloom filter of the hashes of the keys in the map (see
+	 * <misc/bloom.h>), and consult it before probing: most lookups and
+	 * removals of missing keys then touch a single cache line, and
+	 * insertions of new keys skip the check for an existing one. Removed
+	 * keys stay in the filter until it's rebuilt, which happens when it's
+	 * full, twice as large as the map. */
+	MAPF_BLOOM = 1 << 7,
+	/* Shrink the map automatically when removals leave it mostly empty (see
+	 * 'map_shrink_to_fit'), leaving room for twice the pairs it holds. With
+	 * MAPF_POOL, this moves the pairs left. */
+	MAPF_AUTOSHRINK = 1 << 8,
+	/* Group all values of a key under a single pair, whose value points to a
+	 * 'struct map_values' owned by the map. Pairs are added by 'map_append'
+	 * only: 'map_insert' and 'map_upsert' return MAPE_INVALID. Ignored by
+	 * maps with MAPF_INLINE. */
+	MAPF_MULTI = 1 << 9,
 };
 
 enum map_err
@@ -43,17 +180,73 @@ enum map_err
 	MAPE_OK,
 	MAPE_NOMEM,
 	MAPE_EXIST,
+	/* The operation can't be done on a map with these flags. */
+	MAPE_INVALID,
+};
+
+/* The number of entries in the histogram of 'struct map_stats'. */
+#define MAP_STATS_HISTOGRAM 16
+
+/* The shape of a map, see 'map_stats'. The probe length of a pair is the
+ * number of pairs (or slots) a lookup of its key examines before it. */
+struct map_stats
+{
+	size_t size, num_buckets, num_occupied;
+	double load_factor;
+
+	size_t max_probe;
+	double mean_probe;
+	/* The number of pairs with every probe length, the last entry counts the
+	 * pairs with longer probes as well. */
+	size_t histogram[MAP_STATS_HISTOGRAM];
 };
 
 /* ---------- creation ---------- */
 
-/* The number of buckets will be rounded up to the nearest prime. */
+/* The number of buckets will be rounded up to the nearest prime for chained
+ * maps and to the nearest power of two for open addressing ones and chained
+ * ones with MAPF_POW2.
+ * 'flags' is a bitwise OR of 'enum map_flag' values. MAPF_AUTOEXPAND is 1, so
+ * code passing a boolean 'allow_autoexpand' here keeps working. */
 struct map *
-map_create(size_t num_buckets, key_size_fn key_size, int allow_autoexpand);
+map_create(size_t num_buckets, key_size_fn key_size, int flags);
 
 /* Create a map with fixed size of keys. */
 struct map *
-map_create_fs(size_t num_buckets, size_t key_size, int allow_autoexpand);
+map_create_fs(size_t num_buckets, size_t key_size, int flags);
+
+/* These two use 'hash' instead of the default hash function (hash_wy). */
+struct map *
+map_create_h(size_t num_buckets, key_size_fn key_size, hash_fn hash, int flags);
+
+struct map *
+map_create_fs_h(size_t num_buckets, size_t key_size, hash_fn hash, int flags);
+
+/* Create a map with MAPF_INLINE, storing keys of 'key_size' bytes together
+ * with values of 'value_size' bytes (possibly 0) in its slots. Insertions
+ * copy 'value_size' bytes from the value pointer given (zeroes if it's NULL),
+ * and pairs returned by lookups point to the copies in the map.
+ * MAPF_INLINE passed to 'map_create_fs' makes a map with no values. It's
+ * ignored by maps with variable size keys. */
+struct map *
+map_create_inline(size_t num_buckets, size_t key_size, size_t value_size, int flags);
+
+/* Create a map holding 'n' pairs from 'keys' and 'values' (which may be NULL
+ * to make all values NULL), sized for them from the start. All keys are hashed
+ * first, split between up to 'num_threads' threads (0 and 1 both mean the
+ * calling thread only), so 'key_size' and the hash function must be
+ * thread-safe. Pass NULL as 'eq' if the keys are known to be unique, otherwise
+ * only the first occurence of a key is inserted. With MAPF_MULTI, the values
+ * of equal keys are appended in order instead, and 'eq' may not be NULL.
+ * Return NULL if there's not enough memory. */
+struct map *
+map_from_arrays(void **keys, void **values, size_t n, key_size_fn key_size,
+		key_eq_fn eq, int flags, size_t num_threads);
+
+/* Same, but with fixed size of keys. */
+struct map *
+map_from_arrays_fs(void **keys, void **values, size_t n, size_t key_size,
+		key_eq_fn eq, int flags, size_t num_threads);
 
 /* ---------- destruction ---------- */
 
@@ -62,7 +255,8 @@ map_destroy(struct map *);
 
 /* 'pair_destroyer' will be called on every pair in the mapping. 
  * The destroyer should *not* deallocate pairs themselves, the function takes
- * care of that. */
+ * care of that. With MAPF_MULTI, neither should it deallocate the pairs'
+ * 'struct map_values' (but it may deallocate the values in them). */
 void 
 map_destroy_ex(struct map *, void (*pair_destroyer)(void *pair));
 
@@ -74,7 +268,8 @@ map_destroy_exx(struct map *, void (*pair_destroyer)(void *pair, void *arg), voi
 
 /* Return MAPE_OK on success,
  * MAPE_NOMEM if there's not enough memory to create a new association,
- * MAPE_EXIST if the key already exists in the mapping.
+ * MAPE_EXIST if the key already exists in the mapping,
+ * MAPE_INVALID if the map has MAPF_MULTI.
  * Pass NULL as eq to avoid checking for existing keys.
  */
 enum map_err
@@ -84,15 +279,121 @@ map_insert(struct map *, void *key, void *value, key_eq_fn eq);
 enum map_err
 map_insert_ex(struct map *, void *key, void *value, key_eq_ex_fn eq, void *arg);
 
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'.
+ * Useful when the hash is needed for something else as well. */
+enum map_err
+map_insert_hashed(struct map *, void *key, void *value, size_t hash, key_eq_fn eq);
+
+enum map_err
+map_insert_hashed_ex(struct map *, void *key, void *value, size_t hash,
+		key_eq_ex_fn eq, void *arg);
+
+/* Insert 'n' pairs given by 'keys' and 'values' at once, hashing a bunch of keys
+ * and prefetching their buckets before inserting them to hide memory latency.
+ * If 'results' is not NULL, store the result of every insertion in it.
+ * Return the number of pairs inserted. */
+size_t
+map_insert_batch(struct map *, void **keys, void **values, size_t n,
+		key_eq_fn eq, enum map_err *results);
+
+/* Same, but the comparison function takes an extra argument. */
+size_t
+map_insert_batch_ex(struct map *, void **keys, void **values, size_t n,
+		key_eq_ex_fn eq, void *arg, enum map_err *results);
+
+/* Look up 'key', inserting it with a NULL value (zeroes with MAPF_INLINE) if
+ * it's not in the map, and store its pair in 'pair' and whether it was
+ * inserted in 'inserted' (which may be NULL). Unlike a lookup followed by an
+ * insertion, this hashes the key once and inserts a missing key without
+ * looking for it again. The pair is valid as long as one returned by
+ * 'map_lookup'. Its value may be set through it, and so may its key, to one
+ * equal to 'key' (say, a copy kept by the caller), except with MAPF_INLINE,
+ * where the value it points to should be written instead. 'eq' may not be
+ * NULL.
+ * Return MAPE_OK, MAPE_NOMEM if there's not enough memory, or MAPE_INVALID if
+ * the map has MAPF_MULTI. */
+enum map_err
+map_upsert(struct map *, void *key, key_eq_fn eq, struct map_pair **pair,
+		int *inserted);
+
+/* Same, but the comparison function takes an extra argument. */
+enum map_err
+map_upsert_ex(struct map *, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair **pair, int *inserted);
+
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'. */
+enum map_err
+map_upsert_hashed(struct map *, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair **pair, int *inserted);
+
+enum map_err
+map_upsert_hashed_ex(struct map *, void *key, size_t hash, key_eq_ex_fn eq,
+		void *arg, struct map_pair **pair, int *inserted);
+
+/* Maps with MAPF_MULTI only: append 'value' to the values of 'key', adding a
+ * pair for the key if it's not in the map yet. Takes a single lookup, and
+ * allocates memory only for the first value of a key and when its values
+ * double in number. 'eq' may not be NULL.
+ * Return MAPE_OK, or MAPE_NOMEM if there's not enough memory. */
+enum map_err
+map_append(struct map *, void *key, void *value, key_eq_fn eq);
+
+/* Same, but the comparison function takes an extra argument. */
+enum map_err
+map_append_ex(struct map *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
 /* Increase the number of buckets in the map by 'factor' times, but no less 
  * than 'min'.
+ * With MAPF_INCREMENTAL, this only allocates the new buckets, and the pairs are
+ * migrated a few buckets at a time by later operations.
  * Return 1 on success, 0 if there's not enough memory to do so. */
 int
 map_expand(struct map *map, double factor, size_t min);
 
+/* Resize the map to the number of buckets it needs for the pairs it holds,
+ * dropping tombstones of open addressing maps, and moving the pairs of maps
+ * with MAPF_POOL into a single chunk, which invalidates pointers to them. An
+ * incremental rehash is finished first.
+ * Return 1 on success, 0 if there's not enough memory to do so. */
+int
+map_shrink_to_fit(struct map *map);
+
+/* Make room for 'num_pairs' pairs in all, so that the map doesn't expand
+ * until it holds more than that. With MAPF_POOL, this also allocates entries
+ * for the pairs if there are no spare ones. Never shrinks the map.
+ * Return 1 on success, 0 if there's not enough memory to do so. */
+int
+map_reserve(struct map *map, size_t num_pairs);
+
+/* Set the load factor (between 0 and 1, exclusive) at which the map expands,
+ * 0.7 for chained maps and 0.875 for open addressing maps by default. Larger
+ * ones are lowered to 0.9375 for the latter. A lower one trades memory for
+ * shorter chains and probes. It takes effect with the next insertion.
+ * Return 1 on success, 0 if 'factor' is out of range (leaving the map as it
+ * was). */
+int
+map_set_max_load_factor(struct map *map, double factor);
+
+/* Set how many times the number of buckets grows on expansion (more than 1),
+ * 1.3 by default. Open addressing maps always at least double.
+ * Return 1 on success, 0 if 'factor' is out of range. */
+int
+map_set_growth_factor(struct map *map, double factor);
+
+/* Migrate pairs from up to 'budget' old buckets of an incremental rehash.
+ * Return a non-zero value if the rehash is still in progress afterwards. */
+int
+map_rehash_step(struct map *map, size_t budget);
+
 /* Remove an element from a map by given key.
  * Return the removed pair or NULL if the key is not found in the map.
  * It's up to the caller to free the pair later.
+ * Open addressing maps and maps with MAPF_POOL return a freshly allocated copy
+ * of the pair, and NULL (leaving the pair in place) if there's not enough
+ * memory to make it. Use 'map_remove_copy' to avoid that. With MAPF_INLINE,
+ * the copies of the key and value are allocated with the pair and freed with
+ * it. With MAPF_MULTI, the caller also takes the pair's 'struct map_values',
+ * to be freed with 'free'.
  */
 struct map_pair *
 map_remove(struct map *map, void *key, key_eq_fn eq);
@@ -101,8 +402,43 @@ map_remove(struct map *map, void *key, key_eq_fn eq);
 struct map_pair *
 map_remove_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg);
 
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'. */
+struct map_pair *
+map_remove_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq);
+
+struct map_pair *
+map_remove_hashed_ex(struct map *map, void *key, size_t hash, key_eq_ex_fn eq,
+		void *arg);
+
+/* Remove an element from a map by given key, copying the removed pair into
+ * 'out'. Never allocates, and the map keeps ownership of the pair's storage.
+ * With MAPF_INLINE, 'out' points to a copy of the key and value kept by the
+ * map until the next removal.
+ * Return 'out', or NULL if the key is not found in the map. */
+struct map_pair *
+map_remove_copy(struct map *map, void *key, key_eq_fn eq, struct map_pair *out);
+
+/* Same, but the comparison function takes an extra argument. */
+struct map_pair *
+map_remove_copy_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out);
+
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'. */
+struct map_pair *
+map_remove_copy_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair *out);
+
+struct map_pair *
+map_remove_copy_hashed_ex(struct map *map, void *key, size_t hash,
+		key_eq_ex_fn eq, void *arg, struct map_pair *out);
+
 /* ---------- information retrieval ---------- */
 
+/* In open addressing maps the returned pair lives in the map's slot array, so
+ * it's only valid until the next insertion into or removal from the map. In
+ * maps with MAPF_INLINE, it's one of a table of pairs pointing into the slots,
+ * so its key should not be set. Lookups don't write to the map, except with
+ * MAPF_INCREMENTAL. */
 struct map_pair *
 map_lookup(struct map *, void *key, key_eq_fn eq);
 
@@ -110,13 +446,123 @@ map_lookup(struct map *, void *key, key_eq_fn eq);
 struct map_pair *
 map_lookup_ex(struct map *, void *key, key_eq_ex_fn eq, void *eq_arg);
 
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'. */
+struct map_pair *
+map_lookup_hashed(struct map *, void *key, size_t hash, key_eq_fn eq);
+
+struct map_pair *
+map_lookup_hashed_ex(struct map *, void *key, size_t hash, key_eq_ex_fn eq,
+		void *eq_arg);
+
+/* Look up a key, copying its pair into 'out', so that it stays valid after
+ * the map changes. The key and value the pair points to are valid as with
+ * 'map_lookup'.
+ * Return 'out', or NULL if the key is not in the map. */
+struct map_pair *
+map_lookup_copy(struct map *, void *key, key_eq_fn eq, struct map_pair *out);
+
+/* Same, but equality function takes an extra argument. */
+struct map_pair *
+map_lookup_copy_ex(struct map *, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out);
+
+/* Same as the above two, but with 'hash' of the key precomputed by 'map_hash'. */
+struct map_pair *
+map_lookup_copy_hashed(struct map *, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair *out);
+
+struct map_pair *
+map_lookup_copy_hashed_ex(struct map *, void *key, size_t hash,
+		key_eq_ex_fn eq, void *eq_arg, struct map_pair *out);
+
+/* Look up 'n' keys at once, storing the pairs found (or NULL) in 'out_pairs'.
+ * Faster than looking them up one by one, as memory accesses for a bunch of
+ * keys are prefetched together.
+ * Return the number of keys found. */
+size_t
+map_lookup_batch(struct map *, void **keys, size_t n, key_eq_fn eq,
+		struct map_pair **out_pairs);
+
+/* Same, but equality function takes an extra argument. */
+size_t
+map_lookup_batch_ex(struct map *, void **keys, size_t n, key_eq_ex_fn eq,
+		void *eq_arg, struct map_pair **out_pairs);
+
+/* Same as the above two, but the pair of 'keys[i]' is copied into 'copies[i]'
+ * as by 'map_lookup_copy', and 'out_pairs[i]' points to it (or is NULL). */
+size_t
+map_lookup_batch_copy(struct map *, void **keys, size_t n, key_eq_fn eq,
+		struct map_pair *copies, struct map_pair **out_pairs);
+
+size_t
+map_lookup_batch_copy_ex(struct map *, void **keys, size_t n, key_eq_ex_fn eq,
+		void *eq_arg, struct map_pair *copies, struct map_pair **out_pairs);
+
+/* Maps with MAPF_MULTI only: return the values of 'key', storing their number
+ * in 'num_values', or NULL (and 0) if the key is not in the map. The array is
+ * valid until the next value is appended to the key, or the key is removed. */
+void **
+map_lookup_all(struct map *, void *key, key_eq_fn eq, size_t *num_values);
+
+void **
+map_lookup_all_ex(struct map *, void *key, key_eq_ex_fn eq, void *eq_arg,
+		size_t *num_values);
+
+/* Return the hash of 'key' as used by 'map'. */
+size_t
+map_hash(struct map *, void *key);
+
+/* Fill 'out' with statistics of the map, visiting every pair. For chained maps,
+ * the probe length of a pair is its position in its chain. For open addressing
+ * maps with MAPF_ROBIN_HOOD, it's the distance from its home slot. For other
+ * open addressing maps, it's the number of control bytes scanned before its
+ * own, so lengths below a group's width (16 with SSE2, 8 otherwise) mean it's
+ * found in the first group. */
+void
+map_stats(struct map *, struct map_stats *out);
+
+/* ---------- iteration ---------- */
+
+void
+map_iter_init(struct map_iter *, struct map *);
+
+/* Return the next pair of the map, or NULL if there are no more. */
+struct map_pair *
+map_iter_next(struct map_iter *);
+
+/* Copy the keys and values of all pairs of the map into 'keys_out' and
+ * 'values_out' (either may be NULL), which must have room for 'map_size(map)'
+ * elements. The i-th key is paired with the i-th value.
+ * Return the number of pairs copied. */
+size_t
+map_to_arrays(struct map *, void **keys_out, void **values_out);
+
 inline size_t
 map_num_buckets(struct map *map)
 {
+	if (map->flags & MAPF_OPEN)
+		return map->num_slots;
 	return arr_size(map->buckets);
 }
 
-double
-map_load_factor(struct map *);
+inline size_t
+map_size(struct map *map)
+{
+	return map->size;
+}
+
+/* The number of non-empty buckets. */
+inline size_t
+map_occupied(struct map *map)
+{
+	return map->num_occupied;
+}
+
+/* The ratio of non-empty buckets to all buckets. */
+inline double
+map_load_factor(struct map *map)
+{
+	return map->num_occupied * 1.0 / map_num_buckets(map);
+}
 
 #endif /* MAP_H */
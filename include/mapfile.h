@@ -0,0 +1,81 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+/** Map file module.
+ *
+ * Provides a file format for the contents of maps with fixed size keys, which
+ * can be written once and then served directly from a read-only memory mapping
+ * of the file. Opening a map file doesn't read or allocate anything per pair,
+ * so it's nearly instant regardless of the file's size, and processes opening
+ * the same file share its pages.
+ *
+ * Unlike maps, map files store the keys and values themselves rather than
+ * pointers to them: every value must have the same size as well. Keys are
+ * compared bytewise.
+ *
+ * Files are only readable on machines with the same byte order and word size
+ * as the one that has written them.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+struct mapfile
+{
+	/* The whole file, mapped read-only. */
+	void *data;
+	size_t length;
+
+	size_t key_size, value_size;
+	/* Every slot holds a hash, a key and a value, padded to 8 bytes. */
+	size_t slot_size;
+	/* A power of two. */
+	size_t num_slots;
+	size_t size;
+	uint64_t seed;
+	unsigned char *slots;
+};
+
+/* ---------- writing ---------- */
+
+/* Write the contents of 'map', which must have been created with a fixed key
+ * size, to the file at 'path', replacing it. The file is written under a
+ * temporary name in the same directory first, and renamed to 'path' once it's
+ * complete, so those who have the old file open keep it, and a failure leaves
+ * it as it was. Every value of the map should
+ * point to 'value_size' bytes, which are written along with the key. NULL
+ * values are written as zeroes. If 'value_size' is 0, only the keys are
+ * written.
+ * Return 1 on success, 0 on failure, with errno set. */
+int
+mapfile_write(struct map *map, const char *path, size_t value_size);
+
+/* ---------- opening and closing ---------- */
+
+/* Return NULL on failure, with errno set. EINVAL means that the file is not a
+ * valid map file. */
+struct mapfile *
+mapfile_open(const char *path);
+
+void
+mapfile_close(struct mapfile *);
+
+/* ---------- lookup ---------- */
+
+/* Look up 'key', which must be 'key_size' bytes long. If it's found, fill 'out'
+ * with pointers to the key and the value stored in the file (the value is NULL
+ * if the file has no values) and return it. These are valid until the file is
+ * closed. Return NULL if the key is not found. */
+struct map_pair *
+mapfile_lookup(struct mapfile *, void *key, struct map_pair *out);
+
+inline size_t
+mapfile_size(struct mapfile *mapfile)
+{
+	return mapfile->size;
+}
+
+#endif /* MAPFILE_H */
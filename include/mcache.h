@@ -0,0 +1,202 @@
+#ifndef MCACHE_H
+#define MCACHE_H
+
+/** Cache module.
+ *
+ * Provides caches: maps holding at most a fixed number of pairs, which evict
+ * a pair to make room for a new one once they are full. The pair to evict is
+ * chosen either by LRU (the least recently used one) or by CLOCK (an
+ * approximation of LRU that only sets a bit on a hit instead of reordering
+ * anything).
+ *
+ * All entries of a cache are allocated when it's created, and its keys are
+ * indexed by a Robin Hood map sized for the capacity, so hits never allocate
+ * memory, and insertions only do if the map has to grow because of colliding
+ * hashes.
+ *
+ * Caches are not thread-safe. Sharded caches (struct cmcache) split the
+ * capacity between several caches, each protected by a lock of its own, the
+ * same way concurrent maps do.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+enum mcache_policy
+{
+	MCACHE_LRU,
+	MCACHE_CLOCK,
+};
+
+struct mcache_entry
+{
+	struct map_pair pair;
+	size_t hash;
+	/* LRU: the neighbours in the recency list, the most recently used entry
+	 * first. Unused entries are linked by 'next'. */
+	struct mcache_entry *prev, *next;
+	/* CLOCK: set on every hit, cleared as the hand passes. */
+	int referenced;
+	int used;
+};
+
+struct mcache
+{
+	/* Maps keys to their entries. */
+	struct map *map;
+
+	/* 'capacity' entries, 'size' of them used. */
+	struct mcache_entry *entries;
+	size_t capacity, size;
+	struct mcache_entry *free_entries;
+
+	enum mcache_policy policy;
+	/* LRU: the most and the least recently used entries. */
+	struct mcache_entry *head, *tail;
+	/* CLOCK: the next entry to consider for eviction. */
+	size_t hand;
+
+	/* Called on every pair evicted or replaced, may be NULL. */
+	void (*on_evict)(void *pair);
+};
+
+/* Shards are aligned to cache lines so that locking one of them doesn't slow
+ * down threads using its neighbours. */
+struct cmcache_shard
+{
+	_Alignas(64) pthread_mutex_t lock;
+	struct mcache *cache;
+};
+
+struct cmcache
+{
+	struct cmcache_shard *shards;
+	/* A power of two. Shards are chosen by the top bits of a key's hash, all
+	 * shards use the same hash function and seed. */
+	size_t num_shards;
+	unsigned int shard_shift;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a cache holding up to 'capacity' pairs, which must be positive.
+ * 'on_evict' (which may be NULL) is called on every pair that's evicted or
+ * replaced by a pair with an equal key. Like the 'pair_destroyer' of
+ * 'map_destroy_ex', it should free the key and value if needed, but not the
+ * pair itself.
+ * Return NULL if there's not enough memory. */
+struct mcache *
+mcache_create(size_t capacity, key_size_fn key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair));
+
+/* Create a cache with fixed size of keys. */
+struct mcache *
+mcache_create_fs(size_t capacity, size_t key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair));
+
+/* Create a sharded cache with 'num_shards' shards rounded up to a power of
+ * two, but no more than 'capacity', which is split between them as evenly as
+ * it goes. The other arguments are the same as for 'mcache_create'. */
+struct cmcache *
+cmcache_create(size_t num_shards, size_t capacity, key_size_fn key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair));
+
+struct cmcache *
+cmcache_create_fs(size_t num_shards, size_t capacity, size_t key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair));
+
+/* ---------- destruction ---------- */
+
+/* These don't call 'on_evict'. */
+
+void
+mcache_destroy(struct mcache *);
+
+/* 'pair_destroyer' will be called on every pair in the cache, same as with
+ * 'map_destroy_ex'. */
+void
+mcache_destroy_ex(struct mcache *, void (*pair_destroyer)(void *pair));
+
+/* These are not thread-safe: no other thread may be using the cache. */
+
+void
+cmcache_destroy(struct cmcache *);
+
+void
+cmcache_destroy_ex(struct cmcache *, void (*pair_destroyer)(void *pair));
+
+/* ---------- manipulation ---------- */
+
+/* Associate 'key' with 'value', replacing the pair with an equal key if there
+ * is one, or evicting a pair if the cache is full. The pair becomes the most
+ * recently used one.
+ * Return MAPE_OK, or MAPE_NOMEM if there's not enough memory, in which case
+ * nothing is evicted. */
+enum map_err
+mcache_put(struct mcache *, void *key, void *value, key_eq_fn eq);
+
+/* Same, but the comparison function takes an extra argument. */
+enum map_err
+mcache_put_ex(struct mcache *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+/* Remove the pair with a key equal to 'key' without calling 'on_evict',
+ * copying it into 'out'.
+ * Return 'out', or NULL if the key is not in the cache. */
+struct map_pair *
+mcache_remove(struct mcache *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+mcache_remove_ex(struct mcache *, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out);
+
+/* These are thread-safe. 'on_evict' is called with the shard locked. */
+
+enum map_err
+cmcache_put(struct cmcache *, void *key, void *value, key_eq_fn eq);
+
+enum map_err
+cmcache_put_ex(struct cmcache *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+struct map_pair *
+cmcache_remove(struct cmcache *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+cmcache_remove_ex(struct cmcache *, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out);
+
+/* ---------- information retrieval ---------- */
+
+/* Return the pair with a key equal to 'key', marking it as used, or NULL if
+ * the key is not in the cache. The pair is valid until it's evicted, replaced
+ * or removed. */
+struct map_pair *
+mcache_get(struct mcache *, void *key, key_eq_fn eq);
+
+struct map_pair *
+mcache_get_ex(struct mcache *, void *key, key_eq_ex_fn eq, void *eq_arg);
+
+/* Same, but copy the pair found into 'out', as another thread may evict it at
+ * any moment.
+ * Return 'out', or NULL if the key is not in the cache. */
+struct map_pair *
+cmcache_get(struct cmcache *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+cmcache_get_ex(struct cmcache *, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out);
+
+inline size_t
+mcache_size(struct mcache *cache)
+{
+	return cache->size;
+}
+
+/* The sum of sizes of all shards. With concurrent modifications it's only a
+ * snapshot, and not necessarily a consistent one. */
+size_t
+cmcache_size(struct cmcache *);
+
+#endif /* MCACHE_H */
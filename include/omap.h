@@ -0,0 +1,130 @@
+#ifndef OMAP_H
+#define OMAP_H
+
+/** Ordered map module.
+ *
+ * Provides maps that remember the order in which their keys were inserted and
+ * iterate over them in that order, however they grow. Pairs are appended to a
+ * dense array of entries, and the hash table only holds indices into it, as
+ * small as the number of entries allows: a byte per slot for up to 170 pairs,
+ * four bytes for up to about 2.8 billion. Iteration reads the entries in
+ * order, and the table is much smaller than one of pairs would be.
+ *
+ * Removed pairs leave holes in the entries until the array fills up, when
+ * the live pairs are packed together again.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+/* Entries of removed pairs have NULL keys, so keys may not be NULL. */
+struct omap_entry
+{
+	struct map_pair pair;
+	size_t hash;
+};
+
+struct omap
+{
+	/* 'num_entries' entries in insertion order, some of them removed, with
+	 * room for 'capacity' of them. */
+	struct omap_entry *entries;
+	size_t num_entries, capacity;
+
+	/* A power of two of slots, 'index_width' bytes each, holding the index
+	 * of an entry plus one, or 0 in empty slots. Slots of removed entries
+	 * keep their index until the table is rebuilt. */
+	void *index;
+	size_t num_slots;
+	unsigned int index_width;
+
+	size_t size;
+
+	/* If this is NULL, then 'fixed_key_size' will be used instead. */
+	key_size_fn key_size;
+	size_t fixed_key_size;
+	hash_fn hash;
+	uint64_t seed;
+};
+
+/* Iterates over the pairs of an ordered map in insertion order. An iterator
+ * is invalidated by insertions, but not by removals. */
+struct omap_iter
+{
+	struct omap *map;
+	size_t ix;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a map with room for 'num_pairs' pairs. Keys are hashed by 'hash_wy'
+ * with a random seed.
+ * Return NULL if there's not enough memory. */
+struct omap *
+omap_create(size_t num_pairs, key_size_fn key_size);
+
+/* Create a map with fixed size of keys. */
+struct omap *
+omap_create_fs(size_t num_pairs, size_t key_size);
+
+/* ---------- destruction ---------- */
+
+void
+omap_destroy(struct omap *);
+
+/* 'pair_destroyer' will be called on every pair in the mapping, in insertion
+ * order, same as with 'map_destroy_ex'. */
+void
+omap_destroy_ex(struct omap *, void (*pair_destroyer)(void *pair));
+
+/* ---------- manipulation ---------- */
+
+/* Append a pair to the map. Same as 'map_insert': if 'eq' is NULL, the key is
+ * not looked for first. A key that's already in the map keeps its place.
+ * Return MAPE_OK, MAPE_EXIST, or MAPE_NOMEM if there's not enough memory to
+ * grow the map. */
+enum map_err
+omap_insert(struct omap *, void *key, void *value, key_eq_fn eq);
+
+enum map_err
+omap_insert_ex(struct omap *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+/* Remove the pair with a key equal to 'key', copying it into 'out'. The other
+ * pairs keep their order.
+ * Return 'out', or NULL if the key is not in the map. */
+struct map_pair *
+omap_remove(struct omap *, void *key, key_eq_fn eq, struct map_pair *out);
+
+struct map_pair *
+omap_remove_ex(struct omap *, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out);
+
+/* ---------- information retrieval ---------- */
+
+/* The returned pair lives in the map and is valid until the next insertion. */
+struct map_pair *
+omap_lookup(struct omap *, void *key, key_eq_fn eq);
+
+struct map_pair *
+omap_lookup_ex(struct omap *, void *key, key_eq_ex_fn eq, void *eq_arg);
+
+inline size_t
+omap_size(struct omap *map)
+{
+	return map->size;
+}
+
+/* ---------- iteration ---------- */
+
+void
+omap_iter_init(struct omap_iter *, struct omap *);
+
+/* Return the next pair of the map in insertion order, or NULL if there are no
+ * more. */
+struct map_pair *
+omap_iter_next(struct omap_iter *);
+
+#endif /* OMAP_H */
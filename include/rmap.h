@@ -0,0 +1,195 @@
+#ifndef RMAP_H
+#define RMAP_H
+
+/** Read-mostly map module.
+ *
+ * Provides a map for data that is looked up all the time from many threads and
+ * changed only rarely. Lookups take no locks and write nothing to shared
+ * memory, they only follow pointers. Writers are serialized by a mutex and
+ * never change anything a reader may be looking at except for the links
+ * between nodes: they link in new nodes, unlink old ones (or build a whole new
+ * table when the map is expanded) and retire whatever they've unlinked.
+ *
+ * Retired memory is freed only after every reader has passed through a
+ * quiescent state - a point at which it holds no pointers obtained from the
+ * map. To make this possible, every thread that does lookups must register
+ * itself as a reader and regularly announce its quiescent states with
+ * 'rmap_quiescent' (e.g. once per request it handles). A reader that is going
+ * to be idle for a while should go offline, so that it doesn't hold up the
+ * reclamation of memory.
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+/* Readers may be walking through a node while it's being unlinked, so 'next'
+ * stays valid until the node is freed. Nothing else changes after a node is
+ * published. */
+struct rmap_node
+{
+	_Atomic(struct rmap_node *) next;
+	size_t hash;
+	struct map_pair pair;
+
+	/* Set when the node is retired. */
+	struct rmap_node *retired_next;
+	uint64_t retired_epoch;
+	void (*pair_destroyer)(void *pair);
+};
+
+struct rmap_table
+{
+	/* Set when the table is retired, together with all of its nodes. */
+	struct rmap_table *retired_next;
+	uint64_t retired_epoch;
+
+	/* A power of two. */
+	size_t num_buckets;
+	_Atomic(struct rmap_node *) buckets[];
+};
+
+/* Every reader thread owns one of these. They are aligned to cache lines so
+ * that readers announcing quiescent states don't slow each other down. */
+struct rmap_reader
+{
+	/* The last epoch this reader has seen in a quiescent state, or
+	 * RMAP_OFFLINE. */
+	_Alignas(64) _Atomic uint64_t epoch;
+	struct rmap *rmap;
+	struct rmap_reader *next;
+};
+
+#define RMAP_OFFLINE UINT64_MAX
+
+struct rmap
+{
+	_Atomic(struct rmap_table *) table;
+	_Atomic uint64_t epoch;
+
+	/* Everything below is only accessed by writers, under 'lock'. */
+	pthread_mutex_t lock;
+	struct rmap_reader *readers;
+	/* Memory waiting for the readers to pass through a quiescent state. It
+	 * can be freed once every online reader has seen its retired epoch. */
+	struct rmap_node *retired_nodes;
+	struct rmap_table *retired_tables;
+	size_t size;
+
+	/* If this is NULL, then 'fixed_key_size' will be used instead. */
+	key_size_fn key_size;
+	size_t fixed_key_size;
+	hash_fn hash;
+	uint64_t seed;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a read-mostly map with at least 'num_buckets' buckets (rounded up to
+ * a power of two). The map always expands automatically. */
+struct rmap *
+rmap_create(size_t num_buckets, key_size_fn key_size);
+
+/* Create a read-mostly map with fixed size of keys. */
+struct rmap *
+rmap_create_fs(size_t num_buckets, size_t key_size);
+
+/* ---------- destruction ---------- */
+
+/* These are not thread-safe: no other thread may be using the map, and all
+ * readers must be unregistered already. */
+
+void
+rmap_destroy(struct rmap *);
+
+/* 'pair_destroyer' will be called on every pair in the mapping, same as with
+ * 'map_destroy_ex'. Pairs that are retired but not freed yet are destroyed with
+ * their own destroyers. */
+void
+rmap_destroy_ex(struct rmap *, void (*pair_destroyer)(void *pair));
+
+/* ---------- readers ---------- */
+
+/* Register the calling thread as a reader of 'rmap'. The reader starts online.
+ * Return NULL if an OOM condition has occured. */
+struct rmap_reader *
+rmap_reader_register(struct rmap *);
+
+/* The reader must not hold any pointers obtained from the map. */
+void
+rmap_reader_unregister(struct rmap_reader *);
+
+/* Announce that the reader holds no pointers obtained from the map. */
+void
+rmap_quiescent(struct rmap_reader *);
+
+/* An offline reader may not do lookups, but writers don't wait for it. Going
+ * offline is a quiescent state as well. */
+void
+rmap_reader_offline(struct rmap_reader *);
+
+void
+rmap_reader_online(struct rmap_reader *);
+
+/* ---------- manipulation ---------- */
+
+/* All of these lock the writers' mutex and may be called by any thread. They
+ * never wait for readers: retired memory that can't be freed yet is left for
+ * later operations. */
+
+/* Same as 'map_insert'. As there, if the map can't be expanded for lack of
+ * memory, the pair is not inserted and MAPE_NOMEM is returned. */
+enum map_err
+rmap_insert(struct rmap *, void *key, void *value, key_eq_fn eq);
+
+enum map_err
+rmap_insert_ex(struct rmap *, void *key, void *value, key_eq_ex_fn eq, void *arg);
+
+/* Associate 'key' with 'value', whether or not it's already in the map. The old
+ * pair, if any, is passed to 'pair_destroyer' (if it's not NULL) once no reader
+ * can see it anymore. Readers see either the old pair or the new one, but never
+ * neither. As with 'map_destroy_ex', the destroyer should not deallocate the
+ * pair itself.
+ * Return MAPE_OK on success, MAPE_NOMEM if there's not enough memory. */
+enum map_err
+rmap_replace(struct rmap *, void *key, void *value, key_eq_fn eq,
+		void (*pair_destroyer)(void *pair));
+
+enum map_err
+rmap_replace_ex(struct rmap *, void *key, void *value, key_eq_ex_fn eq, void *arg,
+		void (*pair_destroyer)(void *pair));
+
+/* Remove 'key' from the map. The removed pair is passed to 'pair_destroyer' (if
+ * it's not NULL) once no reader can see it anymore.
+ * Return a non-zero value if the key was removed, 0 if it wasn't there. */
+int
+rmap_remove(struct rmap *, void *key, key_eq_fn eq,
+		void (*pair_destroyer)(void *pair));
+
+int
+rmap_remove_ex(struct rmap *, void *key, key_eq_ex_fn eq, void *arg,
+		void (*pair_destroyer)(void *pair));
+
+/* Wait until every online reader has passed through a quiescent state, then
+ * free all retired memory. If the calling thread is a reader, it must be
+ * offline, or it will wait for itself forever. */
+void
+rmap_synchronize(struct rmap *);
+
+/* ---------- information retrieval ---------- */
+
+/* Lock-free. May only be called by online readers. The returned pair stays
+ * valid until the reader's next quiescent state. */
+struct map_pair *
+rmap_lookup(struct rmap *, void *key, key_eq_fn eq);
+
+struct map_pair *
+rmap_lookup_ex(struct rmap *, void *key, key_eq_ex_fn eq, void *eq_arg);
+
+size_t
+rmap_size(struct rmap *);
+
+#endif /* RMAP_H */
@@ -0,0 +1,90 @@
+#ifndef STRTAB_H
+#define STRTAB_H
+
+/** String table module.
+ *
+ * Provides string interning: a table stores every distinct string given to
+ * it once, and hands out the same pointer for equal strings, valid until the
+ * table is destroyed. Strings are copied into large chunks of memory owned by
+ * the table, and indexed by an open addressing map.
+ *
+ * Interned strings can be compared by their pointers alone, so maps keyed by
+ * them needn't look at their characters, either with 'strtab_ptr_hash' and
+ * 'strtab_ptr_eq', or as fixed size keys of inline maps (see
+ * 'map_create_inline') holding the pointers themselves.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+/* A chunk of interned strings. */
+struct strtab_chunk;
+
+struct strtab
+{
+	/* Maps interned strings to nothing, their hashes are those of their
+	 * characters without the terminating NUL. */
+	struct map *map;
+
+	/* The chunk strings are copied into first, followed by the full ones and
+	 * those holding a single long string. */
+	struct strtab_chunk *chunks;
+	/* The number of bytes taken by the strings, with their lengths, NULs
+	 * and padding. */
+	size_t num_bytes;
+};
+
+/* ---------- creation ---------- */
+
+/* Create a table with room for 'num_strings' strings.
+ * Return NULL if there's not enough memory. */
+struct strtab *
+strtab_create(size_t num_strings);
+
+/* ---------- destruction ---------- */
+
+/* Free the table together with all the strings interned in it. */
+void
+strtab_destroy(struct strtab *);
+
+/* ---------- manipulation ---------- */
+
+/* Return the interned copy of the NUL-terminated string 'str', copying it into
+ * the table if it's not there yet, or NULL if there's not enough memory. */
+const char *
+strtab_intern(struct strtab *, const char *str);
+
+/* Same, but with the 'len' characters at 'str', which needn't be followed by
+ * a NUL (the copy is), and may contain NULs. */
+const char *
+strtab_intern_n(struct strtab *, const char *str, size_t len);
+
+/* ---------- information retrieval ---------- */
+
+/* Return the interned copy of 'str', or NULL if it's not in the table. */
+const char *
+strtab_lookup(struct strtab *, const char *str);
+
+const char *
+strtab_lookup_n(struct strtab *, const char *str, size_t len);
+
+/* The number of distinct strings in the table. */
+inline size_t
+strtab_size(struct strtab *tab)
+{
+	return map_size(tab->map);
+}
+
+/* A hash function and a comparison function for maps keyed by interned
+ * strings themselves, rather than by pointers to them: the hash mixes the key
+ * pointer, ignoring the size, and keys are equal if their pointers are. */
+uint64_t
+strtab_ptr_hash(void *data, size_t size, uint64_t seed);
+
+int
+strtab_ptr_eq(void *a, void *b);
+
+#endif /* STRTAB_H */
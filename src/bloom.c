@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "hash.h"
+#include "map.h"
+
+/* A block holds 512 bits, so a bit within it takes 9 bits of the hash. */
+#define BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+#define BIT_INDEX_BITS 9
+
+/* Optimal filters set -log2(fp_rate) bits per key. More than this many only
+ * make queries slower, and blocking costs a bit of accuracy anyway. */
+#define MAX_BITS 16
+
+/* ---------- helper function declarations ---------- */
+
+static struct bloom *
+create_bloom(size_t capacity, double fp_rate, key_size_fn key_size,
+		size_t fixed_key_size);
+
+static uint64_t *
+find_block(struct bloom *, uint64_t mixed);
+
+/* ---------- creation ---------- */
+
+struct bloom *
+bloom_create(size_t capacity, double fp_rate, key_size_fn key_size)
+{
+	return create_bloom(capacity, fp_rate, key_size, 0);
+}
+
+struct bloom *
+bloom_create_fs(size_t capacity, double fp_rate, size_t key_size)
+{
+	return create_bloom(capacity, fp_rate, NULL, key_size);
+}
+
+/* ---------- destruction ---------- */
+
+void
+bloom_destroy(struct bloom *bloom)
+{
+	free(bloom->blocks);
+	free(bloom);
+}
+
+/* ---------- manipulation ---------- */
+
+void
+bloom_add(struct bloom *bloom, void *key)
+{
+	bloom_add_hashed(bloom, bloom_hash(bloom, key));
+}
+
+/* The block is chosen by the top half of the mixed hash, the bits within it
+ * by the bottom one, mixed again whenever it runs out. */
+void
+bloom_add_hashed(struct bloom *bloom, size_t hash)
+{
+	uint64_t mixed = hash_word(hash, bloom->seed);
+	uint64_t *block = find_block(bloom, mixed);
+	uint64_t bits = (uint32_t)mixed;
+	unsigned int left = 32 / BIT_INDEX_BITS;
+	for (unsigned int i = 0; i < bloom->num_bits; i++) {
+		if (left-- == 0) {
+			bits = hash_word(mixed, i);
+			left = 64 / BIT_INDEX_BITS - 1;
+		}
+		unsigned int bit = bits & (BLOCK_BITS - 1);
+		block[bit / 64] |= (uint64_t)1 << (bit % 64);
+		bits >>= BIT_INDEX_BITS;
+	}
+	bloom->count++;
+}
+
+void
+bloom_clear(struct bloom *bloom)
+{
+	memset(bloom->blocks, 0, bloom->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+	bloom->count = 0;
+}
+
+/* ---------- information retrieval ---------- */
+
+int
+bloom_contains(struct bloom *bloom, void *key)
+{
+	return bloom_contains_hashed(bloom, bloom_hash(bloom, key));
+}
+
+int
+bloom_contains_hashed(struct bloom *bloom, size_t hash)
+{
+	uint64_t mixed = hash_word(hash, bloom->seed);
+	uint64_t *block = find_block(bloom, mixed);
+	uint64_t bits = (uint32_t)mixed;
+	unsigned int left = 32 / BIT_INDEX_BITS;
+	for (unsigned int i = 0; i < bloom->num_bits; i++) {
+		if (left-- == 0) {
+			bits = hash_word(mixed, i);
+			left = 64 / BIT_INDEX_BITS - 1;
+		}
+		unsigned int bit = bits & (BLOCK_BITS - 1);
+		if (!(block[bit / 64] & ((uint64_t)1 << (bit % 64))))
+			return 0;
+		bits >>= BIT_INDEX_BITS;
+	}
+	return 1;
+}
+
+size_t
+bloom_hash(struct bloom *bloom, void *key)
+{
+	size_t size = bloom->key_size != NULL ? bloom->key_size(key) : bloom->fixed_key_size;
+	return bloom->hash(key, size, bloom->seed);
+}
+
+extern size_t
+bloom_count(struct bloom *bloom);
+
+/* ---------- helper functions ---------- */
+
+/* An optimal filter takes -log2(fp_rate) / ln(2) bits per key. */
+struct bloom *
+create_bloom(size_t capacity, double fp_rate, key_size_fn key_size,
+		size_t fixed_key_size)
+{
+	/* Written so that NaNs are rejected too. */
+	if (!(fp_rate > 0 && fp_rate < 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct bloom *res = malloc(sizeof(struct bloom));
+	if (res == NULL) return NULL;
+
+	double bits_per_key = -log2(fp_rate);
+	res->num_bits = bits_per_key < 1 ? 1 : bits_per_key + 0.5;
+	if (res->num_bits > MAX_BITS) res->num_bits = MAX_BITS;
+	double total_bits = (capacity > 0 ? capacity : 1) * bits_per_key / log(2);
+	res->num_blocks = ceil(total_bits / BLOCK_BITS);
+	if (res->num_blocks == 0) res->num_blocks = 1;
+
+	size_t size = res->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+	res->blocks = aligned_alloc(64, size);
+	if (res->blocks == NULL) {
+		free(res);
+		return NULL;
+	}
+	memset(res->blocks, 0, size);
+	res->capacity = capacity;
+	res->count = 0;
+	res->key_size = key_size;
+	res->fixed_key_size = fixed_key_size;
+	res->hash = &hash_wy;
+	res->seed = hash_random_seed();
+	return res;
+}
+
+/* Multiply and shift instead of dividing: the top half of the hash times the
+ * number of blocks, divided by 2^32. */
+uint64_t *
+find_block(struct bloom *bloom, uint64_t mixed)
+{
+	size_t ix = ((mixed >> 32) * (uint64_t)bloom->num_blocks) >> 32;
+	return bloom->blocks + ix * BLOOM_BLOCK_WORDS;
+}
@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ckmap.h"
+#include "hash.h"
+#include "map.h"
+
+/* Maps grow past this load factor. Buckets of four slots can be filled up to
+ * about 95% before insertions start running out of kicks. */
+#define MAX_LOAD 0.9
+
+/* The number of pairs an insertion may kick out before it uses the stash. */
+#define MAX_KICKS 256
+
+/* A resize that can't fit the pairs into this many times as many buckets as
+ * it was asked for gives up: too many of their hashes must be equal. */
+#define MAX_GROWTH 8
+
+/* ---------- helper function declarations ---------- */
+
+static struct ckmap *
+create_ckmap(size_t num_pairs, key_size_fn key_size, size_t fixed_key_size);
+
+static uint64_t
+hash_key(struct ckmap *, void *key);
+
+static size_t
+first_bucket(struct ckmap *, uint64_t tag);
+
+static size_t
+other_bucket(struct ckmap *, size_t ix, uint64_t tag);
+
+static int
+free_slot(struct ckmap_bucket *);
+
+static unsigned int
+next_random(struct ckmap *);
+
+/* Return the bucket (possibly the stash) holding the key, setting 'slot' to
+ * its slot, or NULL if it's not there. */
+static struct ckmap_bucket *
+find(struct ckmap *, void *key, uint64_t tag, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, int *slot);
+
+static int
+place(struct ckmap *, struct map_pair *pair, uint64_t *tag);
+
+static int
+resize(struct ckmap *, size_t num_buckets);
+
+static int
+rehash_into(struct ckmap *, struct ckmap *old);
+
+static void
+unstash(struct ckmap *);
+
+static enum map_err
+insert(struct ckmap *, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg);
+
+static struct map_pair *
+remove_pair(struct ckmap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg,
+		struct map_pair *out);
+
+static struct map_pair *
+lookup(struct ckmap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg);
+
+/* ---------- creation ---------- */
+
+struct ckmap *
+ckmap_create(size_t num_pairs, key_size_fn key_size)
+{
+	return create_ckmap(num_pairs, key_size, 0);
+}
+
+struct ckmap *
+ckmap_create_fs(size_t num_pairs, size_t key_size)
+{
+	return create_ckmap(num_pairs, NULL, key_size);
+}
+
+/* ---------- destruction ---------- */
+
+void
+ckmap_destroy(struct ckmap *map)
+{
+	free(map->buckets);
+	free(map);
+}
+
+void
+ckmap_destroy_ex(struct ckmap *map, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i <= map->num_buckets; i++) {
+		struct ckmap_bucket *bucket = i < map->num_buckets ? map->buckets + i : &map->stash;
+		for (int slot = 0; slot < CKMAP_BUCKET_SLOTS; slot++)
+			if (bucket->tags[slot] != 0)
+				pair_destroyer(bucket->pairs + slot);
+	}
+	ckmap_destroy(map);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+ckmap_insert(struct ckmap *map, void *key, void *value, key_eq_fn eq)
+{
+	return insert(map, key, value, eq, NULL, NULL);
+}
+
+enum map_err
+ckmap_insert_ex(struct ckmap *map, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return insert(map, key, value, NULL, eq, arg);
+}
+
+struct map_pair *
+ckmap_remove(struct ckmap *map, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	return remove_pair(map, key, eq, NULL, NULL, out);
+}
+
+struct map_pair *
+ckmap_remove_ex(struct ckmap *map, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out)
+{
+	return remove_pair(map, key, NULL, eq, arg, out);
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+ckmap_lookup(struct ckmap *map, void *key, key_eq_fn eq)
+{
+	return lookup(map, key, eq, NULL, NULL);
+}
+
+struct map_pair *
+ckmap_lookup_ex(struct ckmap *map, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return lookup(map, key, NULL, eq, eq_arg);
+}
+
+extern size_t
+ckmap_size(struct ckmap *map);
+
+/* ---------- helper functions ---------- */
+
+struct ckmap *
+create_ckmap(size_t num_pairs, key_size_fn key_size, size_t fixed_key_size)
+{
+	struct ckmap *res = malloc(sizeof(struct ckmap));
+	if (res == NULL) return NULL;
+
+	size_t num_buckets = 2;
+	while (num_buckets * CKMAP_BUCKET_SLOTS * MAX_LOAD < num_pairs) num_buckets *= 2;
+	res->buckets = calloc(num_buckets, sizeof(struct ckmap_bucket));
+	if (res->buckets == NULL) {
+		free(res);
+		return NULL;
+	}
+	res->num_buckets = num_buckets;
+	memset(&res->stash, 0, sizeof(res->stash));
+	res->stash_size = 0;
+	res->size = 0;
+	res->key_size = key_size;
+	res->fixed_key_size = fixed_key_size;
+	res->hash = &hash_wy;
+	res->seed = hash_random_seed();
+	res->rng = res->seed | 1;
+	return res;
+}
+
+uint64_t
+hash_key(struct ckmap *map, void *key)
+{
+	size_t size = map->key_size != NULL ? map->key_size(key) : map->fixed_key_size;
+	return map->hash(key, size, map->seed);
+}
+
+size_t
+first_bucket(struct ckmap *map, uint64_t tag)
+{
+	return (tag >> 1) & (map->num_buckets - 1);
+}
+
+/* The two buckets of a key differ by a non-zero value taken from the other
+ * half of its hash, so either one can be found from the other. */
+size_t
+other_bucket(struct ckmap *map, size_t ix, uint64_t tag)
+{
+	size_t delta = (tag >> 33) & (map->num_buckets - 1);
+	return ix ^ (delta != 0 ? delta : 1);
+}
+
+/* Return the index of a free slot, or -1 if the bucket is full. */
+int
+free_slot(struct ckmap_bucket *bucket)
+{
+	for (int slot = 0; slot < CKMAP_BUCKET_SLOTS; slot++)
+		if (bucket->tags[slot] == 0) return slot;
+	return -1;
+}
+
+/* Xorshift. */
+unsigned int
+next_random(struct ckmap *map)
+{
+	map->rng ^= map->rng << 13;
+	map->rng ^= map->rng >> 7;
+	map->rng ^= map->rng << 17;
+	return map->rng >> 32;
+}
+
+struct ckmap_bucket *
+find(struct ckmap *map, void *key, uint64_t tag, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, int *slot)
+{
+	size_t ix = first_bucket(map, tag);
+	struct ckmap_bucket *candidates[] = {
+		map->buckets + ix,
+		map->buckets + other_bucket(map, ix, tag),
+		&map->stash,
+	};
+	__builtin_prefetch(candidates[1]);
+	int num_candidates = map->stash_size > 0 ? 3 : 2;
+	for (int i = 0; i < num_candidates; i++) {
+		struct ckmap_bucket *bucket = candidates[i];
+		for (int s = 0; s < CKMAP_BUCKET_SLOTS; s++) {
+			if (bucket->tags[s] != tag) continue;
+			if (eq != NULL
+					? eq(bucket->pairs[s].key, key)
+					: eq_ex(bucket->pairs[s].key, key, arg)) {
+				*slot = s;
+				return bucket;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Put the pair into a free slot of one of its buckets. If both are full, it
+ * takes the slot of a random pair of one of them, which moves on to its other
+ * bucket, and so on. The pair left over after MAX_KICKS goes to the stash.
+ * Return 0 if the stash is full, leaving that pair in 'pair' and 'tag'. */
+int
+place(struct ckmap *map, struct map_pair *pair, uint64_t *tag)
+{
+	size_t ix = first_bucket(map, *tag);
+	int slot = free_slot(map->buckets + ix);
+	if (slot < 0) {
+		ix = other_bucket(map, ix, *tag);
+		slot = free_slot(map->buckets + ix);
+	}
+	for (int kicks = 0; slot < 0 && kicks < MAX_KICKS; kicks++) {
+		struct ckmap_bucket *bucket = map->buckets + ix;
+		int victim = next_random(map) % CKMAP_BUCKET_SLOTS;
+		uint64_t victim_tag = bucket->tags[victim];
+		struct map_pair victim_pair = bucket->pairs[victim];
+		bucket->tags[victim] = *tag;
+		bucket->pairs[victim] = *pair;
+		*tag = victim_tag;
+		*pair = victim_pair;
+		ix = other_bucket(map, ix, *tag);
+		slot = free_slot(map->buckets + ix);
+	}
+
+	struct ckmap_bucket *bucket = map->buckets + ix;
+	if (slot < 0) {
+		if (map->stash_size == CKMAP_BUCKET_SLOTS) return 0;
+		bucket = &map->stash;
+		slot = free_slot(bucket);
+		map->stash_size++;
+	}
+	bucket->tags[slot] = *tag;
+	bucket->pairs[slot] = *pair;
+	return 1;
+}
+
+/* Rehash all pairs into 'num_buckets' buckets, or into more of them if they
+ * don't fit with a slot of the stash to spare, so that the next insertion
+ * can't fail. On failure, the map is left as it was. */
+int
+resize(struct ckmap *map, size_t num_buckets)
+{
+	struct ckmap old = *map;
+	size_t max_buckets = num_buckets * MAX_GROWTH;
+	for (; num_buckets <= max_buckets; num_buckets *= 2) {
+		map->buckets = calloc(num_buckets, sizeof(struct ckmap_bucket));
+		if (map->buckets == NULL) break;
+		map->num_buckets = num_buckets;
+		memset(&map->stash, 0, sizeof(map->stash));
+		map->stash_size = 0;
+		if (rehash_into(map, &old) && map->stash_size < CKMAP_BUCKET_SLOTS) {
+			free(old.buckets);
+			return 1;
+		}
+		free(map->buckets);
+	}
+	*map = old;
+	return 0;
+}
+
+int
+rehash_into(struct ckmap *map, struct ckmap *old)
+{
+	for (size_t i = 0; i <= old->num_buckets; i++) {
+		struct ckmap_bucket *bucket = i < old->num_buckets ? old->buckets + i : &old->stash;
+		for (int slot = 0; slot < CKMAP_BUCKET_SLOTS; slot++) {
+			if (bucket->tags[slot] == 0) continue;
+			struct map_pair pair = bucket->pairs[slot];
+			uint64_t tag = bucket->tags[slot];
+			if (!place(map, &pair, &tag)) return 0;
+		}
+	}
+	return 1;
+}
+
+/* Move the pairs from the stash into their buckets where there's room. */
+void
+unstash(struct ckmap *map)
+{
+	for (int s = 0; s < CKMAP_BUCKET_SLOTS; s++) {
+		uint64_t tag = map->stash.tags[s];
+		if (tag == 0) continue;
+		size_t ix = first_bucket(map, tag);
+		int slot = free_slot(map->buckets + ix);
+		if (slot < 0) {
+			ix = other_bucket(map, ix, tag);
+			slot = free_slot(map->buckets + ix);
+		}
+		if (slot < 0) continue;
+		map->buckets[ix].tags[slot] = tag;
+		map->buckets[ix].pairs[slot] = map->stash.pairs[s];
+		map->stash.tags[s] = 0;
+		map->stash_size--;
+	}
+}
+
+/* With a free slot in the stash, placing the pair can't fail. */
+enum map_err
+insert(struct ckmap *map, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg)
+{
+	uint64_t tag = hash_key(map, key) | 1;
+	int slot;
+	if ((eq != NULL || eq_ex != NULL) && find(map, key, tag, eq, eq_ex, arg, &slot) != NULL)
+		return MAPE_EXIST;
+	if ((map->size + 1 > MAX_LOAD * map->num_buckets * CKMAP_BUCKET_SLOTS
+			|| map->stash_size == CKMAP_BUCKET_SLOTS)
+			&& !resize(map, 2 * map->num_buckets))
+		return MAPE_NOMEM;
+
+	struct map_pair pair = { key, value };
+	place(map, &pair, &tag);
+	map->size++;
+	return MAPE_OK;
+}
+
+struct map_pair *
+remove_pair(struct ckmap *map, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg,
+		struct map_pair *out)
+{
+	int slot;
+	struct ckmap_bucket *bucket = find(map, key, hash_key(map, key) | 1, eq, eq_ex,
+			arg, &slot);
+	if (bucket == NULL) return NULL;
+
+	*out = bucket->pairs[slot];
+	bucket->tags[slot] = 0;
+	map->size--;
+	if (bucket == &map->stash)
+		map->stash_size--;
+	else if (map->stash_size > 0)
+		unstash(map);
+	return out;
+}
+
+struct map_pair *
+lookup(struct ckmap *map, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg)
+{
+	int slot;
+	struct ckmap_bucket *bucket = find(map, key, hash_key(map, key) | 1, eq, eq_ex,
+			arg, &slot);
+	return bucket == NULL ? NULL : bucket->pairs + slot;
+}
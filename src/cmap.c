@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "cmap.h"
+#include "hash.h"
+#include "map.h"
+
+/* ---------- helper function declarations ---------- */
+
+static struct cmap *
+create_cmap(size_t num_shards, size_t num_buckets, key_size_fn key_size,
+		size_t fixed_key_size, int flags);
+
+static struct cmap_shard *
+find_shard(struct cmap *, size_t hash);
+
+static enum map_err
+get_or_insert(struct cmap *, void *key, void *value, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+/* ---------- creation ---------- */
+
+struct cmap *
+cmap_create(size_t num_shards, size_t num_buckets, key_size_fn key_size, int flags)
+{
+	return create_cmap(num_shards, num_buckets, key_size, 0, flags);
+}
+
+struct cmap *
+cmap_create_fs(size_t num_shards, size_t num_buckets, size_t key_size, int flags)
+{
+	return create_cmap(num_shards, num_buckets, NULL, key_size, flags);
+}
+
+/* ---------- destruction ---------- */
+
+void
+cmap_destroy(struct cmap *cmap)
+{
+	for (size_t i = 0; i < cmap->num_shards; i++) {
+		pthread_rwlock_destroy(&cmap->shards[i].lock);
+		map_destroy(cmap->shards[i].map);
+	}
+	free(cmap->shards);
+	free(cmap);
+}
+
+void
+cmap_destroy_ex(struct cmap *cmap, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < cmap->num_shards; i++) {
+		pthread_rwlock_destroy(&cmap->shards[i].lock);
+		map_destroy_ex(cmap->shards[i].map, pair_destroyer);
+	}
+	free(cmap->shards);
+	free(cmap);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+cmap_insert(struct cmap *cmap, void *key, void *value, key_eq_fn eq)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	enum map_err res = map_insert_hashed(shard->map, key, value, hash, eq);
+	pthread_rwlock_unlock(&shard->lock);
+	return res;
+}
+
+enum map_err
+cmap_insert_ex(struct cmap *cmap, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	enum map_err res = map_insert_hashed_ex(shard->map, key, value, hash, eq, arg);
+	pthread_rwlock_unlock(&shard->lock);
+	return res;
+}
+
+enum map_err
+cmap_get_or_insert(struct cmap *cmap, void *key, void *value, key_eq_fn eq,
+		struct map_pair *out)
+{
+	return get_or_insert(cmap, key, value, eq, NULL, NULL, out);
+}
+
+enum map_err
+cmap_get_or_insert_ex(struct cmap *cmap, void *key, void *value, key_eq_ex_fn eq,
+		void *arg, struct map_pair *out)
+{
+	return get_or_insert(cmap, key, value, NULL, eq, arg, out);
+}
+
+struct map_pair *
+cmap_remove(struct cmap *cmap, void *key, key_eq_fn eq)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct map_pair *res = map_remove_hashed(shard->map, key, hash, eq);
+	pthread_rwlock_unlock(&shard->lock);
+	return res;
+}
+
+struct map_pair *
+cmap_remove_ex(struct cmap *cmap, void *key, key_eq_ex_fn eq, void *arg)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct map_pair *res = map_remove_hashed_ex(shard->map, key, hash, eq, arg);
+	pthread_rwlock_unlock(&shard->lock);
+	return res;
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+cmap_lookup(struct cmap *cmap, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	struct map_pair *pair = map_lookup_hashed(shard->map, key, hash, eq);
+	if (pair != NULL) *out = *pair;
+	pthread_rwlock_unlock(&shard->lock);
+	return pair == NULL ? NULL : out;
+}
+
+struct map_pair *
+cmap_lookup_ex(struct cmap *cmap, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	struct map_pair *pair = map_lookup_hashed_ex(shard->map, key, hash, eq, eq_arg);
+	if (pair != NULL) *out = *pair;
+	pthread_rwlock_unlock(&shard->lock);
+	return pair == NULL ? NULL : out;
+}
+
+size_t
+cmap_size(struct cmap *cmap)
+{
+	size_t res = 0;
+	for (size_t i = 0; i < cmap->num_shards; i++) {
+		pthread_rwlock_rdlock(&cmap->shards[i].lock);
+		res += map_size(cmap->shards[i].map);
+		pthread_rwlock_unlock(&cmap->shards[i].lock);
+	}
+	return res;
+}
+
+/* ---------- helper functions ---------- */
+
+struct cmap *
+create_cmap(size_t num_shards, size_t num_buckets, key_size_fn key_size,
+		size_t fixed_key_size, int flags)
+{
+	struct cmap *res = malloc(sizeof(struct cmap));
+	if (res == NULL) return NULL;
+
+	/* Lookups in an incrementally rehashed map move pairs around, which
+	 * can't be done under a read lock. Inline maps have no pairs to copy out:
+	 * the keys and values would be read from slots after the lock is gone.
+	 * Multimaps only take appended values, which there's no call for. */
+	flags &= ~(MAPF_INCREMENTAL | MAPF_INLINE | MAPF_MULTI);
+
+	res->shard_shift = hash_shard_shift(num_shards, &res->num_shards);
+
+	res->shards = aligned_alloc(_Alignof(struct cmap_shard),
+			res->num_shards * sizeof(struct cmap_shard));
+	if (res->shards == NULL) {
+		free(res);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < res->num_shards; i++) {
+		struct map *map = key_size != NULL
+			? map_create(num_buckets, key_size, flags)
+			: map_create_fs(num_buckets, fixed_key_size, flags);
+		if (map != NULL && pthread_rwlock_init(&res->shards[i].lock, NULL) != 0) {
+			map_destroy(map);
+			map = NULL;
+		}
+		if (map == NULL) {
+			res->num_shards = i;
+			cmap_destroy(res);
+			return NULL;
+		}
+		/* The shard is chosen by the same hash as the bucket within it. */
+		if (i > 0) map->seed = res->shards[0].map->seed;
+		res->shards[i].map = map;
+	}
+	return res;
+}
+
+struct cmap_shard *
+find_shard(struct cmap *cmap, size_t hash)
+{
+	return cmap->shards + hash_shard(hash, cmap->shard_shift, cmap->num_shards);
+}
+
+enum map_err
+get_or_insert(struct cmap *cmap, void *key, void *value, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	size_t hash = map_hash(cmap->shards[0].map, key);
+	struct cmap_shard *shard = find_shard(cmap, hash);
+	enum map_err res = MAPE_EXIST;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct map_pair *pair = eq != NULL
+		? map_lookup_hashed(shard->map, key, hash, eq)
+		: map_lookup_hashed_ex(shard->map, key, hash, eq_ex, arg);
+	if (pair == NULL) {
+		/* Already known not to be there, don't check again. */
+		res = map_insert_hashed(shard->map, key, value, hash, NULL);
+		if (res == MAPE_OK && out != NULL) {
+			out->key = key;
+			out->value = value;
+		}
+	} else if (out != NULL) {
+		*out = *pair;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	return res;
+}
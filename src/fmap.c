@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmap.h"
+#include "hash.h"
+#include "map.h"
+
+/* The average number of keys per bucket. Larger buckets make the table of
+ * displacements smaller, but take longer to place, and leave fewer buckets of
+ * one key to fill the last slots. */
+#define BUCKET_SIZE 2
+
+/* If two keys of a bucket have the same hash, or a bucket finds no free slots
+ * within MAX_TRIES displacements, the map is built again with another seed, up
+ * to this many times. */
+#define MAX_ATTEMPTS 8
+
+/* Buckets of one key take the next free slot directly, with the displacement
+ * MAX_TRIES plus the slot. The others are placed while about an eighth of the
+ * slots are still free, so the last of them takes some 60 tries on average,
+ * and a limit of this many tries is only hit with a bad seed. */
+#define MAX_TRIES 4096
+
+/* ---------- helper function declarations ---------- */
+
+static uint64_t
+hash_key(struct fmap *, void *key);
+
+static size_t
+bucket_of(struct fmap *, uint64_t hash);
+
+static size_t
+slot_of(struct fmap *, uint64_t hash, uint32_t displacement);
+
+static int
+build(struct fmap *, struct fmap_slot *pairs);
+
+static struct map_pair *
+lookup(struct fmap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg);
+
+/* ---------- creation ---------- */
+
+struct fmap *
+fmap_create(struct map *map)
+{
+	/* Displacements number the slots of buckets of one key. A map this large
+	 * wouldn't fit into memory anyway. */
+	if (map_size(map) > UINT32_MAX - MAX_TRIES) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	struct fmap *res = malloc(sizeof(struct fmap));
+	if (res == NULL) return NULL;
+	res->size = map_size(map);
+	res->num_buckets = res->size / BUCKET_SIZE + 1;
+	res->key_size = map->key_size;
+	res->fixed_key_size = map->fixed_key_size;
+	res->hash = map->hash;
+	res->seed = map->seed;
+
+	res->slots = malloc(res->size * sizeof(struct fmap_slot) + 1);
+	res->displacements = malloc(res->num_buckets * sizeof(uint32_t));
+	struct fmap_slot *pairs = malloc(res->size * sizeof(struct fmap_slot) + 1);
+	if (res->slots == NULL || res->displacements == NULL || pairs == NULL) {
+		free(pairs);
+		fmap_destroy(res);
+		return NULL;
+	}
+
+	struct map_iter iter;
+	map_iter_init(&iter, map);
+	struct map_pair *pair;
+	for (size_t i = 0; (pair = map_iter_next(&iter)) != NULL; i++)
+		pairs[i].pair = *pair;
+
+	int built = 0;
+	for (int attempt = 0; built == 0 && attempt < MAX_ATTEMPTS; attempt++) {
+		if (attempt > 0) res->seed = hash_random_seed();
+		for (size_t i = 0; i < res->size; i++)
+			pairs[i].hash = hash_key(res, pairs[i].pair.key);
+		built = build(res, pairs);
+	}
+	free(pairs);
+	if (built != 1) {
+		fmap_destroy(res);
+		errno = built == 0 ? EINVAL : ENOMEM;
+		return NULL;
+	}
+	return res;
+}
+
+/* ---------- destruction ---------- */
+
+void
+fmap_destroy(struct fmap *fmap)
+{
+	free(fmap->slots);
+	free(fmap->displacements);
+	free(fmap);
+}
+
+void
+fmap_destroy_ex(struct fmap *fmap, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < fmap->size; i++)
+		pair_destroyer(&fmap->slots[i].pair);
+	fmap_destroy(fmap);
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+fmap_lookup(struct fmap *fmap, void *key, key_eq_fn eq)
+{
+	return lookup(fmap, key, eq, NULL, NULL);
+}
+
+struct map_pair *
+fmap_lookup_ex(struct fmap *fmap, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return lookup(fmap, key, NULL, eq, eq_arg);
+}
+
+extern size_t
+fmap_size(struct fmap *fmap);
+
+/* ---------- helper functions ---------- */
+
+uint64_t
+hash_key(struct fmap *fmap, void *key)
+{
+	size_t size = fmap->key_size != NULL ? fmap->key_size(key) : fmap->fixed_key_size;
+	return fmap->hash(key, size, fmap->seed);
+}
+
+size_t
+bucket_of(struct fmap *fmap, uint64_t hash)
+{
+	return (hash >> 32) % fmap->num_buckets;
+}
+
+size_t
+slot_of(struct fmap *fmap, uint64_t hash, uint32_t displacement)
+{
+	if (displacement >= MAX_TRIES) return displacement - MAX_TRIES;
+	return hash_word(hash, displacement) % fmap->size;
+}
+
+/* Hash and displace: the keys are grouped into buckets, and the buckets, the
+ * largest first, are given the smallest displacement that puts all of their
+ * keys into free slots, except for buckets of one key, which take the free
+ * slots left in order. Return 1 on success, 0 if another seed is needed
+ * (two keys in a bucket have the same hash, which no displacement can
+ * separate, or a bucket fits nowhere within the limit), or -1 if there's not
+ * enough memory. */
+int
+build(struct fmap *fmap, struct fmap_slot *pairs)
+{
+	size_t n = fmap->size, num_buckets = fmap->num_buckets;
+	/* Bucket 'b' holds pairs 'members[starts[b]]' to
+	 * 'members[starts[b + 1] - 1]'. */
+	size_t *starts = calloc(num_buckets + 1, sizeof(size_t));
+	size_t *fill = malloc(num_buckets * sizeof(size_t));
+	size_t *members = malloc(n * sizeof(size_t) + 1);
+	size_t *by_size = malloc(num_buckets * sizeof(size_t));
+	unsigned char *taken = calloc(n + 1, 1);
+	size_t *size_counts = NULL, *placed = NULL;
+	int res = -1;
+	if (starts == NULL || fill == NULL || members == NULL || by_size == NULL
+			|| taken == NULL)
+		goto done;
+
+	size_t max_size = 0;
+	for (size_t i = 0; i < n; i++)
+		starts[bucket_of(fmap, pairs[i].hash) + 1]++;
+	for (size_t b = 0; b < num_buckets; b++) {
+		if (starts[b + 1] > max_size) max_size = starts[b + 1];
+		starts[b + 1] += starts[b];
+	}
+	memcpy(fill, starts, num_buckets * sizeof(size_t));
+	for (size_t i = 0; i < n; i++)
+		members[fill[bucket_of(fmap, pairs[i].hash)]++] = i;
+
+	/* Largest buckets first, by counting sort on their sizes. */
+	size_counts = calloc(max_size + 2, sizeof(size_t));
+	placed = malloc((max_size + 1) * sizeof(size_t));
+	if (size_counts == NULL || placed == NULL) goto done;
+
+	res = 0;
+	for (size_t b = 0; b < num_buckets; b++)
+		for (size_t j = starts[b]; j < starts[b + 1]; j++)
+			for (size_t k = j + 1; k < starts[b + 1]; k++)
+				if (pairs[members[j]].hash == pairs[members[k]].hash)
+					goto done;
+
+	for (size_t b = 0; b < num_buckets; b++)
+		size_counts[max_size - (starts[b + 1] - starts[b]) + 1]++;
+	for (size_t i = 1; i <= max_size + 1; i++)
+		size_counts[i] += size_counts[i - 1];
+	for (size_t b = 0; b < num_buckets; b++)
+		by_size[size_counts[max_size - (starts[b + 1] - starts[b])]++] = b;
+
+	size_t next_free = 0;
+	for (size_t i = 0; i < num_buckets; i++) {
+		size_t b = by_size[i];
+		size_t from = starts[b], to = starts[b + 1];
+		if (to - from == 1) {
+			while (taken[next_free]) next_free++;
+			taken[next_free] = 1;
+			fmap->displacements[b] = MAX_TRIES + next_free;
+			fmap->slots[next_free] = pairs[members[from]];
+			continue;
+		}
+		uint32_t d = 0;
+		while (1) {
+			size_t num_placed = 0;
+			for (size_t k = from; k < to; k++) {
+				size_t slot = slot_of(fmap, pairs[members[k]].hash, d);
+				if (taken[slot]) break;
+				taken[slot] = 1;
+				placed[num_placed++] = slot;
+			}
+			if (num_placed == to - from) break;
+			while (num_placed > 0)
+				taken[placed[--num_placed]] = 0;
+			if (++d == MAX_TRIES) goto done;
+		}
+		fmap->displacements[b] = d;
+		for (size_t k = from; k < to; k++) {
+			struct fmap_slot *pair = pairs + members[k];
+			fmap->slots[slot_of(fmap, pair->hash, d)] = *pair;
+		}
+	}
+	res = 1;
+
+done:
+	free(starts);
+	free(fill);
+	free(members);
+	free(by_size);
+	free(taken);
+	free(size_counts);
+	free(placed);
+	return res;
+}
+
+struct map_pair *
+lookup(struct fmap *fmap, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg)
+{
+	if (fmap->size == 0) return NULL;
+	uint64_t hash = hash_key(fmap, key);
+	uint32_t d = fmap->displacements[bucket_of(fmap, hash)];
+	struct fmap_slot *slot = fmap->slots + slot_of(fmap, hash, d);
+	if (slot->hash != hash) return NULL;
+	if (eq != NULL ? eq(slot->pair.key, key) : eq_ex(slot->pair.key, key, arg))
+		return &slot->pair;
+	return NULL;
+}
@@ -0,0 +1,195 @@
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+static const uint64_t wy_secret[4] = {
+	0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+	0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+/* ---------- helper function declarations ---------- */
+
+static inline uint64_t
+read64(unsigned char *p);
+
+static inline uint64_t
+read32(unsigned char *p);
+
+static inline void
+mum(uint64_t *a, uint64_t *b);
+
+static inline uint64_t
+mix(uint64_t a, uint64_t b);
+
+static uint64_t
+initial_entropy(void);
+
+/* ---------- data ---------- */
+
+static _Atomic uint64_t seed_base;
+static _Atomic uint64_t seed_counter;
+
+/* ---------- hash functions ---------- */
+
+uint64_t
+hash_fnv(void *data, size_t size, uint64_t seed)
+{
+	unsigned char *p = data;
+	uint64_t h = 14695981039346656037ull ^ seed;
+
+	for (size_t i = 0; i < size; i++)
+		h = (h * 1099511628211ull) ^ p[i];
+	return h;
+}
+
+uint64_t
+hash_wy(void *data, size_t size, uint64_t seed)
+{
+	unsigned char *p = data;
+	uint64_t a, b;
+
+	seed ^= mix(seed ^ wy_secret[0], wy_secret[1]);
+	if (size <= 16) {
+		if (size >= 4) {
+			size_t mid = (size >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + mid);
+			b = (read32(p + size - 4) << 32) | read32(p + size - 4 - mid);
+		} else if (size > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t left = size;
+		if (left > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = mix(read64(p) ^ wy_secret[1], read64(p + 8) ^ seed);
+				seed1 = mix(read64(p + 16) ^ wy_secret[2], read64(p + 24) ^ seed1);
+				seed2 = mix(read64(p + 32) ^ wy_secret[3], read64(p + 40) ^ seed2);
+				p += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (left > 16) {
+			seed = mix(read64(p) ^ wy_secret[1], read64(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+		a = read64(p + left - 16);
+		b = read64(p + left - 8);
+	}
+
+	a ^= wy_secret[1];
+	b ^= seed;
+	mum(&a, &b);
+	return mix(a ^ wy_secret[0] ^ size, b ^ wy_secret[1]);
+}
+
+extern uint64_t
+hash_word(uint64_t word, uint64_t seed);
+
+/* ---------- seeds ---------- */
+
+uint64_t
+hash_random_seed(void)
+{
+	uint64_t base = atomic_load_explicit(&seed_base, memory_order_relaxed);
+	if (base == 0) {
+		uint64_t expected = 0;
+		base = initial_entropy() | 1;
+		if (!atomic_compare_exchange_strong(&seed_base, &expected, base))
+			base = expected;
+	}
+	uint64_t n = atomic_fetch_add_explicit(&seed_counter, 1, memory_order_relaxed);
+	return hash_word(n, base);
+}
+
+/* ---------- sharding ---------- */
+
+unsigned int
+hash_shard_shift(size_t num_shards, size_t *num)
+{
+	unsigned int bits = 0;
+	while (((size_t)1 << bits) < num_shards) bits++;
+	*num = (size_t)1 << bits;
+	/* With a single shard, shift by one bit less and mask the rest off. */
+	return sizeof(size_t) * CHAR_BIT - (bits == 0 ? 1 : bits);
+}
+
+extern size_t
+hash_shard(size_t hash, unsigned int shift, size_t num_shards);
+
+/* ---------- helper functions ---------- */
+
+uint64_t
+read64(unsigned char *p)
+{
+	uint64_t res;
+	memcpy(&res, p, sizeof(res));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	res = __builtin_bswap64(res);
+#endif
+	return res;
+}
+
+uint64_t
+read32(unsigned char *p)
+{
+	uint32_t res;
+	memcpy(&res, p, sizeof(res));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	res = __builtin_bswap32(res);
+#endif
+	return res;
+}
+
+/* Full 128-bit product of 'a' and 'b', low half into 'a', high into 'b'. */
+void
+mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t carry = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	carry += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+uint64_t
+mix(uint64_t a, uint64_t b)
+{
+	mum(&a, &b);
+	return a ^ b;
+}
+
+uint64_t
+initial_entropy(void)
+{
+	uint64_t res = 0;
+	FILE *urandom = fopen("/dev/urandom", "rb");
+	if (urandom != NULL) {
+		if (fread(&res, sizeof(res), 1, urandom) != 1)
+			res = 0;
+		fclose(urandom);
+	}
+	res ^= (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32);
+	res ^= (uint64_t)(uintptr_t)&seed_base;
+	return hash_word(res, 0);
+}
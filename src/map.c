@@ -1,384 +1,2413 @@
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "array.h"
+#include "bloom.h"
+#include "hash.h"
 #include "list.h"
 #include "map.h"
 
-#define CRIT_LOAD_FACTOR 0.7
-#define EXPAND_FACTOR 1.3
+/* The defaults for 'max_load_factor' and 'growth_factor' of new maps. Open
+ * addressing tables are powers of two, so they always grow at least twice. */
+#define CHAINED_MAX_LOAD 0.7
+#define OPEN_MAX_LOAD 0.875
+#define GROWTH_FACTOR 1.3
+
+/* Open addressing maps need empty slots to end their probes. */
+#define OPEN_MAX_LOAD_LIMIT 0.9375
+
+/* Automatic expansion adds at least this many buckets. */
 #define EXPAND_MIN 10
 
+/* Maps with MAPF_AUTOSHRINK and more than SHRINK_MIN buckets shrink when
+ * removals leave fewer than one pair per SHRINK_RATIO buckets, keeping room
+ * for twice as many pairs as they hold, so that they don't grow right back. */
+#define SHRINK_RATIO 8
+#define SHRINK_MIN 64
+
+/* The number of old buckets migrated by every operation on a map that's being
+ * rehashed incrementally. */
+#define REHASH_STEP 4
+
+/* Robin Hood maps grow when an insertion makes a probe longer than this, as
+ * long as at least a quarter of their slots are full. */
+#define RH_MAX_PROBE 32
+
+/* 2^64 divided by the golden ratio, for Fibonacci hashing. */
+#define FIB_MULT 0x9e3779b97f4a7c15ull
+
+/* The number of keys hashed and prefetched at once by batch operations. */
+#define BATCH_SIZE 16
+
+/* 'map_from_arrays' doesn't start more threads than it takes to give each of
+ * them at least this many keys to hash. */
+#define HASH_JOB_MIN 4096
+
+/* The smallest number of entries in a chunk of a pool. Every chunk holds at
+ * least as many entries as there are pairs in the map, so that the number of
+ * chunks grows logarithmically. */
+#define POOL_CHUNK_MIN 64
+
+/* Filters of maps with MAPF_BLOOM are sized for at least this many keys, with
+ * this rate of false positives. */
+#define FILTER_MIN_CAPACITY 64
+#define FILTER_FP_RATE 0.01
+
+/* ---------- chained map entries ---------- */
+
+/* What chains hold. The pair comes first, so that a pointer to an item is a
+ * pointer to its pair, and freeing a removed pair frees the whole item. The
+ * hash is kept so that keys are only compared when their hashes match and are
+ * never hashed again when the map is expanded. */
+struct map_item
+{
+	struct map_pair pair;
+	size_t hash;
+};
+
+/* An item allocated together with the list element holding it, see
+ * MAPF_POOL. */
+struct map_entry
+{
+	struct list_elem elem;
+	struct map_item item;
+};
+
+struct map_chunk
+{
+	struct map_chunk *next;
+	struct map_entry entries[];
+};
+
+/* ---------- open addressing control bytes ---------- */
+
+/* A full slot's control byte holds the lower 7 bits of its key's hash, so
+ * both special values have their high bit set. */
+#define CTRL_EMPTY ((unsigned char)0x80)
+#define CTRL_DELETED ((unsigned char)0xfe)
+
+/* Groups of control bytes are matched at once, giving a bitmask with one bit
+ * (SSE2) or one byte (portable version) per matching slot. */
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+#define GROUP_WIDTH 16
+#define GROUP_SHIFT 0
+
+typedef unsigned int group_mask;
+
+static inline group_mask
+group_match(unsigned char *ctrl, unsigned char h)
+{
+	__m128i group = _mm_loadu_si128((__m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h)));
+}
+
+static inline group_mask
+group_match_empty(unsigned char *ctrl)
+{
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+/* Match either empty or deleted slots. */
+static inline group_mask
+group_match_free(unsigned char *ctrl)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i *)ctrl));
+}
+
+#else /* no SSE2 */
+
+#define GROUP_WIDTH 8
+#define GROUP_SHIFT 3
+#define GROUP_LSBS 0x0101010101010101ull
+#define GROUP_MSBS 0x8080808080808080ull
+
+typedef uint64_t group_mask;
+
+static inline uint64_t
+group_load(unsigned char *ctrl)
+{
+	uint64_t res;
+	memcpy(&res, ctrl, sizeof(res));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	res = __builtin_bswap64(res);
+#endif
+	return res;
+}
+
+/* This may give false positives, which is fine, as keys are compared anyway. */
+static inline group_mask
+group_match(unsigned char *ctrl, unsigned char h)
+{
+	uint64_t x = group_load(ctrl) ^ (GROUP_LSBS * h);
+	return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+/* Empty and deleted bytes differ in the second lowest bit. */
+static inline group_mask
+group_match_empty(unsigned char *ctrl)
+{
+	uint64_t group = group_load(ctrl);
+	return group & (~group << 6) & GROUP_MSBS;
+}
+
+static inline group_mask
+group_match_free(unsigned char *ctrl)
+{
+	return group_load(ctrl) & GROUP_MSBS;
+}
+
+#endif /* __SSE2__ */
+
+/* Pop the lowest match from a mask, return its offset in the group. */
+static inline size_t
+group_next(group_mask *mask)
+{
+	size_t res = __builtin_ctzll(*mask) >> GROUP_SHIFT;
+	*mask &= *mask - 1;
+	return res;
+}
+
 /* ---------- helper function declarations ---------- */
 
-static size_t 
+static size_t
 next_prime(size_t i);
 
+static size_t
+next_pow2(size_t i);
+
 static int
 is_prime(size_t i);
 
-static void 
-destroy_list_from_array(void *ptr);
+static void
+destroy_buckets(struct map *, struct array *buckets);
+
+static void
+destroy_buckets_ex(struct map *, struct array *buckets,
+		void (*pair_destroyer)(void *pair));
 
 static void
-destroy_pair_list(void *list);
+destroy_buckets_exx(struct map *, struct array *buckets,
+		void (*pair_destroyer)(void *pair, void *arg), void *arg);
+
+static int
+init_map(struct map *, size_t num_buckets, int flags);
 
 static int
 init_buckets(struct map *, size_t num_buckets);
 
 static size_t
-fnv_hash(void *data, size_t size);
+get_size(struct map *, void *data);
+
+static inline size_t
+hash_key(struct map *, void *key);
+
+static inline size_t
+bucket_ix(struct map *, size_t hash, size_t num_buckets);
+
+static struct map_pair *
+create_pair(void *key, void *value);
+
+static struct map_item *
+create_item(void *key, void *value, size_t hash);
+
+static int
+needs_expand(struct map *);
+
+static int
+needs_shrink(struct map *);
+
+/* Resize the map to hold 'num_pairs' pairs without expanding, or to remove
+ * tombstones and unused pool entries if it's the right size already. */
+static int
+shrink(struct map *, size_t num_pairs);
+
+/* Start rehashing a chained map into 'num_buckets' new buckets, finishing the
+ * rehash in progress if there is one. */
+static int
+resize_buckets(struct map *, size_t num_buckets);
+
+static double
+default_max_load(int flags);
+
+static size_t
+buckets_for(double max_load_factor, size_t num_pairs);
+
+static struct list *
+find_chain(struct map *, size_t hash);
+
+static void
+rehash_step(struct map *, size_t budget);
 
 static size_t
-get_size(struct map *, void *data);
+export_buckets(struct array *buckets, size_t from, void **keys_out,
+		void **values_out, size_t pos);
+
+/* Engine-independent operations. Like open addressing helpers below, these
+ * take both kinds of comparison functions, one of which should be NULL. */
+
+static enum map_err
+insert(struct map *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static enum map_err
+insert_unfiltered(struct map *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out);
+
+static enum map_err
+upsert(struct map *, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, struct map_pair **out, int *inserted);
+
+static enum map_err
+find_or_insert(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out, int *inserted);
+
+static struct map_pair *
+lookup(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static struct map_pair *
+lookup_copy(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+/* If 'out' is not NULL, the removed pair is copied there, and 'out' is
+ * returned. */
+static struct map_pair *
+remove_pair(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+static enum map_err
+append(struct map *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static void
+free_values(struct map *);
+
+static struct map_pair *
+remove_unfiltered(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+static size_t
+insert_batch(struct map *, void **keys, void **values, size_t n,
+		key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg, enum map_err *results);
+
+static size_t
+lookup_batch(struct map *, void **keys, size_t n, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *copies,
+		struct map_pair **out_pairs);
+
+static void
+prefetch_bucket(struct map *, size_t hash);
+
+/* Bloom filter helpers, see MAPF_BLOOM. */
+
+static int
+init_filter(struct map *, size_t num_buckets);
+
+static void
+filter_add(struct map *, size_t hash);
+
+static int
+filter_rebuild(struct map *);
+
+/* Bulk construction helpers. */
+
+struct hash_job
+{
+	struct map *map;
+	void **keys;
+	size_t *hashes;
+	size_t from, to;
+	pthread_t thread;
+	int started;
+};
+
+static struct map *
+from_arrays(struct map *, void **keys, void **values, size_t n, key_eq_fn eq,
+		size_t num_threads);
+
+static void
+hash_keys(struct map *, void **keys, size_t n, size_t *hashes, size_t num_threads);
+
+static void *
+run_hash_job(void *job);
+
+static struct list_elem *
+chain_find(struct list *chain, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static enum map_err
+push_pair(struct map *, struct list *chain, void *key, void *value, size_t hash);
+
+/* Pool helpers. */
+
+static int
+pool_push(struct map *, struct list *chain, void *key, void *value, size_t hash);
+
+/* The free list must be empty. */
+static int
+pool_grow(struct map *, size_t num_entries);
+
+static int
+pool_compact(struct map *, size_t num_buckets);
+
+static void
+pool_destroy(struct map *);
+
+/* Open addressing helpers. One of 'eq' and 'eq_ex' is expected to be NULL. */
+
+static int
+open_init(struct map *, size_t num_slots);
+
+static int
+open_resize(struct map *, size_t num_slots);
+
+static struct map_pair *
+open_find(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static size_t
+open_find_free(struct map *, size_t hash);
+
+static void
+open_set_ctrl(struct map *, size_t ix, unsigned char ctrl);
+
+static enum map_err
+open_insert(struct map *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out);
+
+static struct map_pair *
+open_remove(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+static void
+open_destroy(struct map *);
+
+static size_t
+open_probe_length(struct map *, size_t ix);
+
+static size_t
+rh_dist(struct map *, size_t ix);
+
+static struct map_pair *
+rh_find(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static size_t
+rh_place(struct map *, void *key, void *value, size_t hash);
+
+static int
+same_key(void *a, void *b);
+
+static enum map_err
+rh_insert(struct map *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out);
+
+static struct map_pair *
+rh_remove(struct map *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+static void
+stats_add(struct map_stats *, size_t probe);
+
+static size_t
+align_for(size_t size);
+
+static inline unsigned char *
+inline_slot(struct map *, size_t ix);
+
+static void
+inline_pair(struct map *, unsigned char *slot, struct map_pair *out);
+
+static struct map_pair *
+open_pair(struct map *, size_t ix);
+
+static size_t
+open_hash(struct map *, size_t ix);
 
 static int
-can_find(struct list *list, void *data, key_eq_fn eq);
+open_make_room(struct map *);
+
+static struct map_pair *
+inline_find(struct map *, void *key, size_t hash);
+
+static enum map_err
+inline_insert(struct map *, void *key, void *value, size_t hash, int check,
+		struct map_pair **out);
+
+static struct map_pair *
+inline_remove(struct map *, void *key, size_t hash, struct map_pair *out);
+
+/* ---------- creation ---------- */
+
+struct map *
+map_create(size_t num_buckets, key_size_fn key_size, int flags)
+{
+	return map_create_h(num_buckets, key_size, &hash_wy, flags);
+}
+
+struct map *
+map_create_fs(size_t num_buckets, size_t key_size, int flags)
+{
+	return map_create_fs_h(num_buckets, key_size, &hash_wy, flags);
+}
+
+struct map *
+map_create_h(size_t num_buckets, key_size_fn key_size, hash_fn hash, int flags)
+{
+	struct map *res = malloc(sizeof(struct map));
+	if (res == NULL) return NULL;
+
+	res->value_size = 0;
+	if (!init_map(res, num_buckets, flags & ~MAPF_INLINE)) {
+		free(res);
+		return NULL;
+	}
+	res->key_size = key_size;
+	res->hash = hash;
+	res->seed = hash_random_seed();
+	if (!init_filter(res, num_buckets)) {
+		map_destroy(res);
+		return NULL;
+	}
+	return res;
+}
+
+struct map *
+map_create_fs_h(size_t num_buckets, size_t key_size, hash_fn hash, int flags)
+{
+	struct map *res = malloc(sizeof(struct map));
+	if (res == NULL) return NULL;
+
+	/* Inline slots are laid out by the key size. */
+	res->fixed_key_size = key_size;
+	res->value_size = 0;
+	if (!init_map(res, num_buckets, flags)) {
+		free(res);
+		return NULL;
+	}
+	res->key_size = NULL;
+	res->hash = hash;
+	res->seed = hash_random_seed();
+	if (!init_filter(res, num_buckets)) {
+		map_destroy(res);
+		return NULL;
+	}
+	return res;
+}
+
+struct map *
+map_create_inline(size_t num_buckets, size_t key_size, size_t value_size, int flags)
+{
+	struct map *res = malloc(sizeof(struct map));
+	if (res == NULL) return NULL;
+
+	res->fixed_key_size = key_size;
+	res->value_size = value_size;
+	if (!init_map(res, num_buckets, flags | MAPF_INLINE)) {
+		free(res);
+		return NULL;
+	}
+	res->key_size = NULL;
+	res->hash = &hash_wy;
+	res->seed = hash_random_seed();
+	if (!init_filter(res, num_buckets)) {
+		map_destroy(res);
+		return NULL;
+	}
+	return res;
+}
+
+struct map *
+map_from_arrays(void **keys, void **values, size_t n, key_size_fn key_size,
+		key_eq_fn eq, int flags, size_t num_threads)
+{
+	struct map *res = map_create(buckets_for(default_max_load(flags), n), key_size, flags);
+	if (res == NULL) return NULL;
+	return from_arrays(res, keys, values, n, eq, num_threads);
+}
+
+struct map *
+map_from_arrays_fs(void **keys, void **values, size_t n, size_t key_size,
+		key_eq_fn eq, int flags, size_t num_threads)
+{
+	struct map *res = map_create_fs(buckets_for(default_max_load(flags), n), key_size,
+			flags);
+	if (res == NULL) return NULL;
+	return from_arrays(res, keys, values, n, eq, num_threads);
+}
+
+/* ---------- destruction ---------- */
+
+void
+map_destroy(struct map *map)
+{
+	if (map->flags & MAPF_MULTI) free_values(map);
+	if (map->flags & MAPF_OPEN) {
+		open_destroy(map);
+		return;
+	}
+	destroy_buckets(map, map->buckets);
+	if (map->old_buckets != NULL)
+		destroy_buckets(map, map->old_buckets);
+	pool_destroy(map);
+	if (map->filter != NULL) bloom_destroy(map->filter);
+	free(map);
+}
+
+void
+map_destroy_ex(struct map *map, void (*pair_destroyer)(void *pair))
+{
+	if (map->flags & MAPF_MULTI) {
+		/* The destroyer may look at the values, so they are only freed
+		 * afterwards. */
+		struct map_iter iter;
+		struct map_pair *pair;
+		map_iter_init(&iter, map);
+		while ((pair = map_iter_next(&iter)) != NULL)
+			pair_destroyer(pair);
+		map_destroy(map);
+		return;
+	}
+	if (map->flags & MAPF_OPEN) {
+		for (size_t i = 0; i < map->num_slots; i++)
+			if (!(map->ctrl[i] & CTRL_EMPTY))
+				pair_destroyer(open_pair(map, i));
+		open_destroy(map);
+		return;
+	}
+	destroy_buckets_ex(map, map->buckets, pair_destroyer);
+	if (map->old_buckets != NULL)
+		destroy_buckets_ex(map, map->old_buckets, pair_destroyer);
+	pool_destroy(map);
+	if (map->filter != NULL) bloom_destroy(map->filter);
+	free(map);
+}
 
-static int 
-can_find_ex(struct list *list, void *data, key_eq_ex_fn eq, void *arg);
+void
+map_destroy_exx(struct map *map, void (*pair_destroyer)(void *pair, void *arg), void *arg)
+{
+	if (map->flags & MAPF_MULTI) {
+		struct map_iter iter;
+		struct map_pair *pair;
+		map_iter_init(&iter, map);
+		while ((pair = map_iter_next(&iter)) != NULL)
+			pair_destroyer(pair, arg);
+		map_destroy(map);
+		return;
+	}
+	if (map->flags & MAPF_OPEN) {
+		for (size_t i = 0; i < map->num_slots; i++)
+			if (!(map->ctrl[i] & CTRL_EMPTY))
+				pair_destroyer(open_pair(map, i), arg);
+		open_destroy(map);
+		return;
+	}
+	destroy_buckets_exx(map, map->buckets, pair_destroyer, arg);
+	if (map->old_buckets != NULL)
+		destroy_buckets_exx(map, map->old_buckets, pair_destroyer, arg);
+	pool_destroy(map);
+	if (map->filter != NULL) bloom_destroy(map->filter);
+	free(map);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+map_insert(struct map *map, void *key, void *value, key_eq_fn eq)
+{
+	return insert(map, key, value, hash_key(map, key), eq, NULL, NULL);
+}
+
+enum map_err
+map_insert_ex(struct map *map, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return insert(map, key, value, hash_key(map, key), NULL, eq, arg);
+}
+
+enum map_err
+map_insert_hashed(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq)
+{
+	return insert(map, key, value, hash, eq, NULL, NULL);
+}
+
+enum map_err
+map_insert_hashed_ex(struct map *map, void *key, void *value, size_t hash,
+		key_eq_ex_fn eq, void *arg)
+{
+	return insert(map, key, value, hash, NULL, eq, arg);
+}
+
+size_t
+map_insert_batch(struct map *map, void **keys, void **values, size_t n,
+		key_eq_fn eq, enum map_err *results)
+{
+	return insert_batch(map, keys, values, n, eq, NULL, NULL, results);
+}
+
+size_t
+map_insert_batch_ex(struct map *map, void **keys, void **values, size_t n,
+		key_eq_ex_fn eq, void *arg, enum map_err *results)
+{
+	return insert_batch(map, keys, values, n, NULL, eq, arg, results);
+}
+
+enum map_err
+map_upsert(struct map *map, void *key, key_eq_fn eq, struct map_pair **pair,
+		int *inserted)
+{
+	return upsert(map, key, hash_key(map, key), eq, NULL, NULL, pair, inserted);
+}
+
+enum map_err
+map_upsert_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair **pair, int *inserted)
+{
+	return upsert(map, key, hash_key(map, key), NULL, eq, arg, pair, inserted);
+}
+
+enum map_err
+map_upsert_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair **pair, int *inserted)
+{
+	return upsert(map, key, hash, eq, NULL, NULL, pair, inserted);
+}
+
+enum map_err
+map_upsert_hashed_ex(struct map *map, void *key, size_t hash, key_eq_ex_fn eq,
+		void *arg, struct map_pair **pair, int *inserted)
+{
+	return upsert(map, key, hash, NULL, eq, arg, pair, inserted);
+}
+
+enum map_err
+map_append(struct map *map, void *key, void *value, key_eq_fn eq)
+{
+	return append(map, key, value, hash_key(map, key), eq, NULL, NULL);
+}
+
+enum map_err
+map_append_ex(struct map *map, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return append(map, key, value, hash_key(map, key), NULL, eq, arg);
+}
+
+int
+map_expand(struct map *map, double factor, size_t min)
+{
+	size_t old_size = map_num_buckets(map);
+	size_t new_size = old_size * factor;
+	if (new_size < old_size + min) new_size = old_size + min;
+
+	if (map->flags & MAPF_OPEN)
+		return open_resize(map, new_size);
+	return resize_buckets(map, new_size);
+}
+
+int
+map_reserve(struct map *map, size_t num_pairs)
+{
+	size_t num_buckets = buckets_for(map->max_load_factor, num_pairs);
+	if ((map->flags & MAPF_POOL) && list_empty(map->free_entries)
+			&& num_pairs > map->size && !pool_grow(map, num_pairs - map->size))
+		return 0;
+	if (num_buckets <= map_num_buckets(map)) return 1;
+	if (map->flags & MAPF_OPEN)
+		return open_resize(map, num_buckets);
+	return resize_buckets(map, num_buckets);
+}
+
+/* Written so that NaNs are rejected too. */
+int
+map_set_max_load_factor(struct map *map, double factor)
+{
+	if (!(factor > 0 && factor < 1)) return 0;
+	if ((map->flags & MAPF_OPEN) && factor > OPEN_MAX_LOAD_LIMIT)
+		factor = OPEN_MAX_LOAD_LIMIT;
+	map->max_load_factor = factor;
+	return 1;
+}
+
+int
+map_set_growth_factor(struct map *map, double factor)
+{
+	if (!(factor > 1)) return 0;
+	map->growth_factor = factor;
+	return 1;
+}
+
+int
+map_shrink_to_fit(struct map *map)
+{
+	if (!shrink(map, map->size)) return 0;
+	if (map->old_buckets != NULL)
+		rehash_step(map, arr_size(map->old_buckets));
+	return 1;
+}
+
+struct map_pair *
+map_remove(struct map *map, void *key, key_eq_fn eq)
+{
+	return remove_pair(map, key, hash_key(map, key), eq, NULL, NULL, NULL);
+}
+
+struct map_pair *
+map_remove_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg)
+{
+	return remove_pair(map, key, hash_key(map, key), NULL, eq, arg, NULL);
+}
+
+struct map_pair *
+map_remove_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq)
+{
+	return remove_pair(map, key, hash, eq, NULL, NULL, NULL);
+}
+
+struct map_pair *
+map_remove_hashed_ex(struct map *map, void *key, size_t hash, key_eq_ex_fn eq,
+		void *arg)
+{
+	return remove_pair(map, key, hash, NULL, eq, arg, NULL);
+}
+
+struct map_pair *
+map_remove_copy(struct map *map, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	return remove_pair(map, key, hash_key(map, key), eq, NULL, NULL, out);
+}
+
+struct map_pair *
+map_remove_copy_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out)
+{
+	return remove_pair(map, key, hash_key(map, key), NULL, eq, arg, out);
+}
+
+struct map_pair *
+map_remove_copy_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair *out)
+{
+	return remove_pair(map, key, hash, eq, NULL, NULL, out);
+}
+
+struct map_pair *
+map_remove_copy_hashed_ex(struct map *map, void *key, size_t hash,
+		key_eq_ex_fn eq, void *arg, struct map_pair *out)
+{
+	return remove_pair(map, key, hash, NULL, eq, arg, out);
+}
+
+int
+map_rehash_step(struct map *map, size_t budget)
+{
+	if (map->old_buckets == NULL) return 0;
+	rehash_step(map, budget);
+	return map->old_buckets != NULL;
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+map_lookup(struct map *map, void *key, key_eq_fn eq)
+{
+	return lookup(map, key, hash_key(map, key), eq, NULL, NULL);
+}
+
+struct map_pair *
+map_lookup_ex(struct map *map, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return lookup(map, key, hash_key(map, key), NULL, eq, eq_arg);
+}
+
+struct map_pair *
+map_lookup_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq)
+{
+	return lookup(map, key, hash, eq, NULL, NULL);
+}
+
+struct map_pair *
+map_lookup_hashed_ex(struct map *map, void *key, size_t hash, key_eq_ex_fn eq,
+		void *eq_arg)
+{
+	return lookup(map, key, hash, NULL, eq, eq_arg);
+}
+
+struct map_pair *
+map_lookup_copy(struct map *map, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	return lookup_copy(map, key, hash_key(map, key), eq, NULL, NULL, out);
+}
+
+struct map_pair *
+map_lookup_copy_ex(struct map *map, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out)
+{
+	return lookup_copy(map, key, hash_key(map, key), NULL, eq, eq_arg, out);
+}
+
+struct map_pair *
+map_lookup_copy_hashed(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		struct map_pair *out)
+{
+	return lookup_copy(map, key, hash, eq, NULL, NULL, out);
+}
+
+struct map_pair *
+map_lookup_copy_hashed_ex(struct map *map, void *key, size_t hash,
+		key_eq_ex_fn eq, void *eq_arg, struct map_pair *out)
+{
+	return lookup_copy(map, key, hash, NULL, eq, eq_arg, out);
+}
+
+size_t
+map_lookup_batch(struct map *map, void **keys, size_t n, key_eq_fn eq,
+		struct map_pair **out_pairs)
+{
+	return lookup_batch(map, keys, n, eq, NULL, NULL, NULL, out_pairs);
+}
+
+size_t
+map_lookup_batch_ex(struct map *map, void **keys, size_t n, key_eq_ex_fn eq,
+		void *eq_arg, struct map_pair **out_pairs)
+{
+	return lookup_batch(map, keys, n, NULL, eq, eq_arg, NULL, out_pairs);
+}
+
+size_t
+map_lookup_batch_copy(struct map *map, void **keys, size_t n, key_eq_fn eq,
+		struct map_pair *copies, struct map_pair **out_pairs)
+{
+	return lookup_batch(map, keys, n, eq, NULL, NULL, copies, out_pairs);
+}
+
+size_t
+map_lookup_batch_copy_ex(struct map *map, void **keys, size_t n, key_eq_ex_fn eq,
+		void *eq_arg, struct map_pair *copies, struct map_pair **out_pairs)
+{
+	return lookup_batch(map, keys, n, NULL, eq, eq_arg, copies, out_pairs);
+}
+
+void **
+map_lookup_all(struct map *map, void *key, key_eq_fn eq, size_t *num_values)
+{
+	struct map_pair *pair = lookup(map, key, hash_key(map, key), eq, NULL, NULL);
+	struct map_values *values = pair != NULL ? pair->value : NULL;
+	*num_values = values != NULL ? values->size : 0;
+	return values != NULL ? values->values : NULL;
+}
+
+void **
+map_lookup_all_ex(struct map *map, void *key, key_eq_ex_fn eq, void *eq_arg,
+		size_t *num_values)
+{
+	struct map_pair *pair = lookup(map, key, hash_key(map, key), NULL, eq, eq_arg);
+	struct map_values *values = pair != NULL ? pair->value : NULL;
+	*num_values = values != NULL ? values->size : 0;
+	return values != NULL ? values->values : NULL;
+}
+
+size_t
+map_hash(struct map *map, void *key)
+{
+	return hash_key(map, key);
+}
+
+void
+map_stats(struct map *map, struct map_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->size = map->size;
+	out->num_buckets = map_num_buckets(map);
+	out->num_occupied = map->num_occupied;
+	out->load_factor = map_load_factor(map);
+
+	if (map->flags & MAPF_OPEN) {
+		for (size_t i = 0; i < map->num_slots; i++)
+			if (!(map->ctrl[i] & CTRL_EMPTY))
+				stats_add(out, open_probe_length(map, i));
+	} else {
+		/* During a rehash, the old buckets before 'rehash_ix' are empty. */
+		struct array *buckets[] = { map->buckets, map->old_buckets };
+		size_t from[] = { 0, map->rehash_ix };
+		for (int b = 0; b < 2 && buckets[b] != NULL; b++) {
+			for (size_t i = from[b]; i < arr_size(buckets[b]); i++) {
+				struct list *chain = arr_ix(buckets[b], i);
+				size_t probe = 0;
+				for (struct list_elem *cur = list_first(chain); cur != NULL;
+						cur = list_next(cur))
+					stats_add(out, probe++);
+			}
+		}
+	}
+	if (map->size > 0) out->mean_probe /= map->size;
+}
+
+/* ---------- iteration ---------- */
+
+void
+map_iter_init(struct map_iter *iter, struct map *map)
+{
+	iter->map = map;
+	iter->buckets = map->buckets;
+	iter->ix = 0;
+	iter->elem = NULL;
+}
+
+struct map_pair *
+map_iter_next(struct map_iter *iter)
+{
+	struct map *map = iter->map;
+	if (map->flags & MAPF_OPEN) {
+		for (; iter->ix < map->num_slots; iter->ix++)
+			if (!(map->ctrl[iter->ix] & CTRL_EMPTY))
+				return open_pair(map, iter->ix++);
+		return NULL;
+	}
+
+	while (iter->elem == NULL) {
+		if (iter->ix == arr_size(iter->buckets)) {
+			/* The old buckets before 'rehash_ix' are empty already. */
+			if (iter->buckets != map->buckets || map->old_buckets == NULL)
+				return NULL;
+			iter->buckets = map->old_buckets;
+			iter->ix = map->rehash_ix;
+			continue;
+		}
+		struct list *chain = arr_ix(iter->buckets, iter->ix++);
+		iter->elem = list_first(chain);
+	}
+	struct map_pair *res = list_data(iter->elem);
+	iter->elem = list_next(iter->elem);
+	return res;
+}
+
+size_t
+map_to_arrays(struct map *map, void **keys_out, void **values_out)
+{
+	size_t res = 0;
+	if (map->flags & MAPF_OPEN) {
+		/* One pass over the control bytes, touching only the full
+		 * slots. */
+		for (size_t i = 0; i < map->num_slots; i++) {
+			if (map->ctrl[i] & CTRL_EMPTY) continue;
+			struct map_pair *pair = open_pair(map, i);
+			if (keys_out != NULL) keys_out[res] = pair->key;
+			if (values_out != NULL) values_out[res] = pair->value;
+			res++;
+		}
+		return res;
+	}
+
+	res = export_buckets(map->buckets, 0, keys_out, values_out, res);
+	if (map->old_buckets != NULL)
+		res = export_buckets(map->old_buckets, map->rehash_ix, keys_out, values_out, res);
+	return res;
+}
+
+extern size_t
+map_num_buckets(struct map *map);
+
+extern size_t
+map_size(struct map *map);
+
+extern size_t
+map_occupied(struct map *map);
+
+extern double
+map_load_factor(struct map *map);
+
+/* ---------- helper functions ---------- */
+
+int
+is_prime(size_t i)
+{
+	size_t root = sqrt(i);
+	for (size_t k = 2; k <= root; k++)
+		if (i % k == 0) return 0;
+	return 1;
+}
+
+size_t
+next_prime(size_t i)
+{
+	if (i % 2 == 0) i++;
+	while (1) {
+		i += 2;
+		if (is_prime(i)) return i;
+	}
+}
+
+/* Never returns less than 2. */
+size_t
+next_pow2(size_t i)
+{
+	size_t res = 2;
+	while (res < i) res *= 2;
+	return res;
+}
+
+/* Pooled list elements are freed together with their chunks. */
+void
+destroy_buckets(struct map *map, struct array *buckets)
+{
+	if (!(map->flags & MAPF_POOL)) {
+		size_t size = arr_size(buckets);
+		for (size_t i = 0; i < size; i++) {
+			struct list_elem *cur = list_first(arr_ix(buckets, i));
+			while (cur != NULL) {
+				struct list_elem *next = list_next(cur);
+				free(list_data(cur));
+				free(cur);
+				cur = next;
+			}
+		}
+	}
+	arr_destroy(buckets);
+}
+
+void
+destroy_buckets_ex(struct map *map, struct array *buckets,
+		void (*pair_destroyer)(void *pair))
+{
+	size_t size = arr_size(buckets);
+	for (size_t i = 0; i < size; i++) {
+		struct list *chain = arr_ix(buckets, i);
+		struct list_elem *cur = list_first(chain);
+		while (cur != NULL) {
+			pair_destroyer(list_data(cur));
+			cur = cur->next;
+		}
+	}
+	destroy_buckets(map, buckets);
+}
+
+void
+destroy_buckets_exx(struct map *map, struct array *buckets,
+		void (*pair_destroyer)(void *pair, void *arg), void *arg)
+{
+	size_t size = arr_size(buckets);
+	for (size_t i = 0; i < size; i++) {
+		struct list *chain = arr_ix(buckets, i);
+		struct list_elem *cur = list_first(chain);
+		while (cur != NULL) {
+			pair_destroyer(list_data(cur), arg);
+			cur = cur->next;
+		}
+	}
+	destroy_buckets(map, buckets);
+}
+
+int
+init_map(struct map *map, size_t num_buckets, int flags)
+{
+	map->flags = flags;
+	map->chunks = NULL;
+	map->free_entries = NULL;
+	map->inline_slots = map->removed = NULL;
+	map->filter = NULL;
+	if (flags & MAPF_INLINE) {
+		map->flags &= ~MAPF_MULTI;
+		/* The value is aligned for its size, and so is the next slot. */
+		map->flags = (map->flags | MAPF_OPEN) & ~MAPF_ROBIN_HOOD;
+		size_t value_align = align_for(map->value_size);
+		size_t slot_align = align_for(map->fixed_key_size) > value_align
+			? align_for(map->fixed_key_size)
+			: value_align;
+		map->value_offset = (map->fixed_key_size + value_align - 1) & ~(value_align - 1);
+		map->slot_size = (map->value_offset + map->value_size + slot_align - 1)
+			& ~(slot_align - 1);
+		map->removed = malloc(map->slot_size + 1);
+		if (map->removed == NULL) return 0;
+	}
+	if (flags & MAPF_ROBIN_HOOD) map->flags |= MAPF_OPEN;
+	map->max_load_factor = default_max_load(map->flags);
+	map->growth_factor = GROWTH_FACTOR;
+	if (map->flags & MAPF_OPEN) {
+		map->flags &= ~MAPF_POOL;
+		map->buckets = map->old_buckets = NULL;
+		if (!open_init(map, num_buckets)) {
+			free(map->removed);
+			return 0;
+		}
+		return 1;
+	}
+	if (flags & MAPF_POOL) {
+		map->free_entries = list_create();
+		if (map->free_entries == NULL) return 0;
+	}
+	map->old_buckets = NULL;
+	map->rehash_ix = 0;
+	map->ctrl = NULL;
+	map->slots = NULL;
+	map->hashes = NULL;
+	map->num_slots = map->num_deleted = 0;
+	map->size = map->num_occupied = 0;
+	if (!init_buckets(map, num_buckets)) {
+		if (map->free_entries != NULL) list_destroy(map->free_entries);
+		return 0;
+	}
+	return 1;
+}
+
+int
+init_buckets(struct map *map, size_t num_buckets)
+{
+	if (map->flags & MAPF_POW2)
+		num_buckets = next_pow2(num_buckets);
+	else
+		num_buckets = next_prime(num_buckets);
+	map->buckets = arr_create(num_buckets, sizeof(struct list));
+	if (map->buckets == NULL) return 0;
+
+	/* The capacity is there already, so appending doesn't allocate. */
+	struct list empty = { NULL, NULL };
+	for (size_t i = 0; i < num_buckets; i++)
+		arr_append(map->buckets, &empty);
+	return 1;
+}
+
+size_t
+get_size(struct map *map, void *data)
+{
+	if (map->key_size == NULL)
+		return map->fixed_key_size;
+	else
+		return map->key_size(data);
+}
+
+size_t
+hash_key(struct map *map, void *key)
+{
+	return map->hash(key, get_size(map, key), map->seed);
+}
+
+/* With MAPF_POW2, take the top bits of the hash multiplied by FIB_MULT, which
+ * mixes all of its bits in and avoids a division. */
+size_t
+bucket_ix(struct map *map, size_t hash, size_t num_buckets)
+{
+	if (map->flags & MAPF_POW2)
+		return ((uint64_t)hash * FIB_MULT) >> (64 - __builtin_ctzll(num_buckets));
+	return hash % num_buckets;
+}
+
+struct map_pair *
+create_pair(void *key, void *value)
+{
+	struct map_pair *res = malloc(sizeof(struct map_pair));
+	if (res == NULL) return NULL;
+	res->key = key;
+	res->value = value;
+	return res;
+}
+
+struct map_item *
+create_item(void *key, void *value, size_t hash)
+{
+	struct map_item *res = malloc(sizeof(struct map_item));
+	if (res == NULL) return NULL;
+	res->pair.key = key;
+	res->pair.value = value;
+	res->hash = hash;
+	return res;
+}
+
+/* Don't start another expansion while a rehash is in progress: the map
+ * will have grown enough when it's done. */
+int
+needs_expand(struct map *map)
+{
+	return (map->flags & MAPF_AUTOEXPAND) && map->old_buckets == NULL
+		&& map->num_occupied >= map->max_load_factor * arr_size(map->buckets);
+}
+
+int
+needs_shrink(struct map *map)
+{
+	size_t num_buckets = map_num_buckets(map);
+	return (map->flags & MAPF_AUTOSHRINK) && map->old_buckets == NULL
+		&& num_buckets > SHRINK_MIN && map->size < num_buckets / SHRINK_RATIO;
+}
+
+/* Rebuilding the filter drops the keys removed since it was built last. */
+int
+shrink(struct map *map, size_t num_pairs)
+{
+	size_t num_buckets = buckets_for(map->max_load_factor, num_pairs);
+	int ok = 1;
+	if (map->flags & MAPF_OPEN)
+		ok = open_resize(map, num_buckets);
+	else if (map->flags & MAPF_POOL)
+		ok = pool_compact(map, num_buckets);
+	else if (num_buckets < map_num_buckets(map))
+		ok = resize_buckets(map, num_buckets);
+	if (ok && map->filter != NULL) filter_rebuild(map);
+	return ok;
+}
+
+int
+resize_buckets(struct map *map, size_t num_buckets)
+{
+	/* Only one rehash may be in progress at a time. */
+	if (map->old_buckets != NULL)
+		rehash_step(map, arr_size(map->old_buckets));
+
+	struct array *old_buckets = map->buckets;
+	if (!init_buckets(map, num_buckets)) {
+		map->buckets = old_buckets;
+		return 0;
+	}
+
+	map->old_buckets = old_buckets;
+	map->rehash_ix = 0;
+	if (!(map->flags & MAPF_INCREMENTAL))
+		rehash_step(map, arr_size(old_buckets));
+	return 1;
+}
+
+/* The number of buckets (or slots) a map needs to hold 'num_pairs' pairs
+ * without expanding. */
+size_t
+buckets_for(double max_load_factor, size_t num_pairs)
+{
+	return num_pairs / max_load_factor + 1;
+}
+
+double
+default_max_load(int flags)
+{
+	return flags & (MAPF_OPEN | MAPF_ROBIN_HOOD | MAPF_INLINE)
+		? OPEN_MAX_LOAD
+		: CHAINED_MAX_LOAD;
+}
+
+/* During a rehash, the old buckets before 'rehash_ix' have been migrated
+ * already, and those past it still hold their pairs. */
+struct list *
+find_chain(struct map *map, size_t hash)
+{
+	if (map->old_buckets != NULL) {
+		size_t ix = bucket_ix(map, hash, arr_size(map->old_buckets));
+		if (ix >= map->rehash_ix)
+			return arr_ix(map->old_buckets, ix);
+	}
+	return arr_ix(map->buckets, bucket_ix(map, hash, arr_size(map->buckets)));
+}
+
+/* Move the pairs from up to 'budget' old buckets into the new ones. The list
+ * elements themselves are reused, so this never allocates. */
+void
+rehash_step(struct map *map, size_t budget)
+{
+	size_t old_size = arr_size(map->old_buckets);
+	size_t new_size = arr_size(map->buckets);
+	for (; budget > 0 && map->rehash_ix < old_size; budget--) {
+		struct list *old_chain = arr_ix(map->old_buckets, map->rehash_ix++);
+		if (list_empty(old_chain)) continue;
+
+		map->num_occupied--;
+		struct list_elem *cur = list_first(old_chain);
+		while (cur != NULL) {
+			struct list_elem *next = list_next(cur);
+			struct map_item *item = list_data(cur);
+			size_t ix = bucket_ix(map, item->hash, new_size);
+			struct list *chain = arr_ix(map->buckets, ix);
+			if (list_empty(chain)) map->num_occupied++;
+			list_extract(chain, old_chain, cur);
+			cur = next;
+		}
+	}
+
+	if (map->rehash_ix == old_size) {
+		destroy_buckets(map, map->old_buckets);
+		map->old_buckets = NULL;
+	}
+}
+
+/* Copy out the pairs from buckets starting with 'from', storing them starting
+ * with 'pos'.
+ * Return the position past the last pair stored. */
+size_t
+export_buckets(struct array *buckets, size_t from, void **keys_out,
+		void **values_out, size_t pos)
+{
+	size_t size = arr_size(buckets);
+	for (size_t i = from; i < size; i++) {
+		struct list *chain = arr_ix(buckets, i);
+		for (struct list_elem *cur = list_first(chain); cur != NULL;
+				cur = list_next(cur)) {
+			struct map_pair *pair = list_data(cur);
+			if (keys_out != NULL) keys_out[pos] = pair->key;
+			if (values_out != NULL) values_out[pos] = pair->value;
+			pos++;
+		}
+	}
+	return pos;
+}
+
+enum map_err
+push_pair(struct map *map, struct list *chain, void *key, void *value, size_t hash)
+{
+	int was_empty = list_empty(chain);
+	if (map->flags & MAPF_POOL) {
+		if (!pool_push(map, chain, key, value, hash))
+			return MAPE_NOMEM;
+	} else {
+		struct map_item *item = create_item(key, value, hash);
+		if (item == NULL)
+			return MAPE_NOMEM;
+		if (!list_push(chain, item)) {
+			free(item);
+			return MAPE_NOMEM;
+		}
+	}
+	map->size++;
+	if (was_empty) map->num_occupied++;
+	return MAPE_OK;
+}
+
+/* ---------- engine-independent operations ---------- */
+
+/* A key the filter has never seen can't be in the map, so there's no need to
+ * look for it. */
+enum map_err
+insert(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	/* The values of multimaps are made by 'append' alone. */
+	if (map->flags & MAPF_MULTI) return MAPE_INVALID;
+	if (map->filter == NULL)
+		return insert_unfiltered(map, key, value, hash, eq, eq_ex, arg, NULL);
+	if (!bloom_contains_hashed(map->filter, hash)) {
+		eq = NULL;
+		eq_ex = NULL;
+	}
+	enum map_err res = insert_unfiltered(map, key, value, hash, eq, eq_ex, arg, NULL);
+	if (res == MAPE_OK) filter_add(map, hash);
+	return res;
+}
+
+/* If 'out' is not NULL, it's set to the pair inserted. */
+enum map_err
+insert_unfiltered(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out)
+{
+	if (map->flags & MAPF_INLINE)
+		return inline_insert(map, key, value, hash, eq != NULL || eq_ex != NULL, out);
+	if (map->flags & MAPF_ROBIN_HOOD)
+		return rh_insert(map, key, value, hash, eq, eq_ex, arg, out);
+	if (map->flags & MAPF_OPEN)
+		return open_insert(map, key, value, hash, eq, eq_ex, arg, out);
+
+	if (map->old_buckets != NULL)
+		rehash_step(map, REHASH_STEP);
+
+	struct list *chain = find_chain(map, hash);
+	if ((eq != NULL || eq_ex != NULL) && chain_find(chain, key, hash, eq, eq_ex, arg) != NULL)
+		return MAPE_EXIST;
+
+	if (needs_expand(map)) {
+		int ok = map_expand(map, map->growth_factor, EXPAND_MIN);
+		if (!ok) return MAPE_NOMEM;
+		chain = find_chain(map, hash);
+	}
+
+	enum map_err res = push_pair(map, chain, key, value, hash);
+	/* New pairs go to the head of their chain. */
+	if (res == MAPE_OK && out != NULL) *out = list_data(list_first(chain));
+	return res;
+}
+
+/* Pairs with NULL values would pass for keys without values in multimaps. */
+enum map_err
+upsert(struct map *map, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, struct map_pair **out, int *inserted)
+{
+	if (map->flags & MAPF_MULTI) return MAPE_INVALID;
+	return find_or_insert(map, key, hash, eq, eq_ex, arg, out, inserted);
+}
+
+/* Keys are usually found, so the lookup is kept as fast as a plain one, and a
+ * missing key is inserted without looking for it again. */
+enum map_err
+find_or_insert(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out, int *inserted)
+{
+	*out = lookup(map, key, hash, eq, eq_ex, arg);
+	if (inserted != NULL) *inserted = *out == NULL;
+	if (*out != NULL) return MAPE_OK;
+	enum map_err res = insert_unfiltered(map, key, NULL, hash, NULL, NULL, NULL, out);
+	if (res == MAPE_OK && map->filter != NULL) filter_add(map, hash);
+	return res;
+}
+
+struct map_pair *
+lookup(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	if (map->filter != NULL && !bloom_contains_hashed(map->filter, hash))
+		return NULL;
+	if (map->flags & MAPF_INLINE)
+		return inline_find(map, key, hash);
+	if (map->flags & MAPF_ROBIN_HOOD)
+		return rh_find(map, key, hash, eq, eq_ex, arg);
+	if (map->flags & MAPF_OPEN)
+		return open_find(map, key, hash, eq, eq_ex, arg);
+
+	if (map->old_buckets != NULL)
+		rehash_step(map, REHASH_STEP);
+
+	struct list_elem *elem = chain_find(find_chain(map, hash), key, hash, eq, eq_ex, arg);
+	return elem == NULL ? NULL : list_data(elem);
+}
+
+struct map_pair *
+lookup_copy(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	struct map_pair *pair = lookup(map, key, hash, eq, eq_ex, arg);
+	if (pair == NULL) return NULL;
+	*out = *pair;
+	return out;
+}
+
+/* Most keys of a multimap have few values, so a key starts with room for one,
+ * doubled as needed. */
+enum map_err
+append(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	struct map_pair *pair;
+	int inserted;
+	enum map_err res = find_or_insert(map, key, hash, eq, eq_ex, arg, &pair, &inserted);
+	if (res != MAPE_OK) return res;
+
+	struct map_values *values;
+	if (inserted) {
+		values = malloc(sizeof(struct map_values) + sizeof(void *));
+		if (values == NULL) {
+			struct map_pair removed;
+			remove_unfiltered(map, key, hash, eq, eq_ex, arg, &removed);
+			return MAPE_NOMEM;
+		}
+		values->size = values->capacity = 1;
+		values->values[0] = value;
+		pair->value = values;
+		return MAPE_OK;
+	}
+
+	values = pair->value;
+	if (values->size == values->capacity) {
+		size_t capacity = 2 * values->capacity;
+		values = realloc(values, sizeof(struct map_values) + capacity * sizeof(void *));
+		if (values == NULL) return MAPE_NOMEM;
+		values->capacity = capacity;
+		pair->value = values;
+	}
+	values->values[values->size++] = value;
+	return MAPE_OK;
+}
+
+void
+free_values(struct map *map)
+{
+	struct map_iter iter;
+	struct map_pair *pair;
+	map_iter_init(&iter, map);
+	while ((pair = map_iter_next(&iter)) != NULL)
+		free(pair->value);
+}
+
+/* The pair removed is never in the map anymore, so shrinking it can't move
+ * the pair. */
+struct map_pair *
+remove_pair(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	if (map->filter != NULL && !bloom_contains_hashed(map->filter, hash))
+		return NULL;
+	struct map_pair *res = remove_unfiltered(map, key, hash, eq, eq_ex, arg, out);
+	/* Not shrinking for lack of memory is not an error. */
+	if (res != NULL && needs_shrink(map)) shrink(map, 2 * map->size);
+	return res;
+}
+
+struct map_pair *
+remove_unfiltered(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	if (map->flags & MAPF_INLINE)
+		return inline_remove(map, key, hash, out);
+	if (map->flags & MAPF_ROBIN_HOOD)
+		return rh_remove(map, key, hash, eq, eq_ex, arg, out);
+	if (map->flags & MAPF_OPEN)
+		return open_remove(map, key, hash, eq, eq_ex, arg, out);
+
+	if (map->old_buckets != NULL)
+		rehash_step(map, REHASH_STEP);
+
+	struct list *chain = find_chain(map, hash);
+	struct list_elem *elem = chain_find(chain, key, hash, eq, eq_ex, arg);
+	if (elem == NULL) return NULL;
+
+	struct map_pair *pair = list_data(elem);
+	if (map->flags & MAPF_POOL) {
+		/* The entry goes back to the pool, so the caller gets a copy. */
+		if (out == NULL) {
+			out = create_pair(pair->key, pair->value);
+			if (out == NULL) return NULL;
+		} else {
+			*out = *pair;
+		}
+		list_extract(map->free_entries, chain, elem);
+		pair = out;
+	} else {
+		list_remove(chain, elem);
+		free(elem);
+		if (out != NULL) {
+			*out = *pair;
+			free(pair);
+			pair = out;
+		}
+	}
+	map->size--;
+	if (list_empty(chain)) map->num_occupied--;
+	return pair;
+}
+
+/* Batches are processed in chunks: first every key of a chunk is hashed and
+ * the memory it will touch is prefetched, and only then are the keys looked
+ * up, by which time most of that memory should be in the cache. */
+
+size_t
+insert_batch(struct map *map, void **keys, void **values, size_t n,
+		key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg, enum map_err *results)
+{
+	size_t hashes[BATCH_SIZE];
+	size_t res = 0;
+	for (size_t start = 0; start < n; start += BATCH_SIZE) {
+		size_t len = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+		for (size_t i = 0; i < len; i++) {
+			hashes[i] = hash_key(map, keys[start + i]);
+			prefetch_bucket(map, hashes[i]);
+		}
+		for (size_t i = 0; i < len; i++) {
+			enum map_err err = insert(map, keys[start + i], values[start + i],
+					hashes[i], eq, eq_ex, arg);
+			if (results != NULL) results[start + i] = err;
+			if (err == MAPE_OK) res++;
+		}
+	}
+	return res;
+}
+
+size_t
+lookup_batch(struct map *map, void **keys, size_t n, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *copies,
+		struct map_pair **out_pairs)
+{
+	size_t hashes[BATCH_SIZE];
+	size_t res = 0;
+	for (size_t start = 0; start < n; start += BATCH_SIZE) {
+		size_t len = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+		for (size_t i = 0; i < len; i++) {
+			hashes[i] = hash_key(map, keys[start + i]);
+			prefetch_bucket(map, hashes[i]);
+		}
+		/* The first element of a chain is another pointer away from its
+		 * bucket, so chained maps get another round. */
+		if (!(map->flags & MAPF_OPEN)) {
+			for (size_t i = 0; i < len; i++) {
+				struct list_elem *first = list_first(find_chain(map, hashes[i]));
+				if (first != NULL) __builtin_prefetch(first);
+			}
+		}
+		for (size_t i = 0; i < len; i++) {
+			struct map_pair *pair = copies != NULL
+				? lookup_copy(map, keys[start + i], hashes[i], eq, eq_ex,
+						arg, copies + start + i)
+				: lookup(map, keys[start + i], hashes[i], eq, eq_ex, arg);
+			out_pairs[start + i] = pair;
+			if (pair != NULL) res++;
+		}
+	}
+	return res;
+}
+
+void
+prefetch_bucket(struct map *map, size_t hash)
+{
+	if (map->flags & MAPF_OPEN) {
+		size_t pos = (hash >> 7) & (map->num_slots - 1);
+		__builtin_prefetch(map->ctrl + pos);
+		if (map->flags & MAPF_INLINE)
+			__builtin_prefetch(inline_slot(map, pos));
+		else
+			__builtin_prefetch(map->slots + pos);
+	} else {
+		__builtin_prefetch(find_chain(map, hash));
+	}
+}
 
-static struct map_pair *
-create_pair(void *key, void *value);
+struct list_elem *
+chain_find(struct list *chain, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	struct list_elem *cur = list_first(chain);
+	while (cur != NULL) {
+		struct map_item *item = list_data(cur);
+		if (item->hash == hash && (eq != NULL
+				? eq(item->pair.key, key)
+				: eq_ex(item->pair.key, key, arg)))
+			return cur;
+		cur = list_next(cur);
+	}
+	return NULL;
+}
 
-/* ---------- creation ---------- */
+/* ---------- bulk construction helpers ---------- */
 
+/* Fill a map created large enough for 'n' pairs. The keys are all hashed
+ * first, and then inserted a batch at a time, as with 'insert_batch'. On an
+ * OOM condition, destroy the map and return NULL. */
 struct map *
-map_create(size_t num_buckets, key_size_fn key_size, int allow_autoexpand)
+from_arrays(struct map *map, void **keys, void **values, size_t n, key_eq_fn eq,
+		size_t num_threads)
 {
-	struct map *res = malloc(sizeof(struct map));
-	if (res == NULL) return NULL;
+	if (n == 0) return map;
+	size_t *hashes = malloc(n * sizeof(size_t));
+	if (hashes == NULL) {
+		map_destroy(map);
+		return NULL;
+	}
+	hash_keys(map, keys, n, hashes, num_threads);
 
-	if (!init_buckets(res, num_buckets)) {
-		free(res);
+	/* One chunk for all the entries. */
+	if ((map->flags & MAPF_POOL) && !pool_grow(map, n)) {
+		free(hashes);
+		map_destroy(map);
 		return NULL;
 	}
-	res->key_size = key_size;
-	res->allow_autoexpand = allow_autoexpand;
-	return res;
+
+	for (size_t start = 0; start < n; start += BATCH_SIZE) {
+		size_t len = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+		for (size_t i = start; i < start + len; i++)
+			prefetch_bucket(map, hashes[i]);
+		for (size_t i = start; i < start + len; i++) {
+			void *value = values != NULL ? values[i] : NULL;
+			enum map_err err = map->flags & MAPF_MULTI
+				? append(map, keys[i], value, hashes[i], eq, NULL, NULL)
+				: insert(map, keys[i], value, hashes[i], eq, NULL, NULL);
+			if (err == MAPE_NOMEM) {
+				free(hashes);
+				map_destroy(map);
+				return NULL;
+			}
+		}
+	}
+	free(hashes);
+	return map;
 }
 
-struct map *
-map_create_fs(size_t num_buckets, size_t key_size, int allow_autoexpand)
+/* Split the keys between up to 'num_threads' threads, the calling one
+ * included. If threads can't be started, their work is done by the calling
+ * thread. */
+void
+hash_keys(struct map *map, void **keys, size_t n, size_t *hashes, size_t num_threads)
 {
-	struct map *res = malloc(sizeof(struct map));
-	if (res == NULL) return NULL;
+	if (num_threads > n / HASH_JOB_MIN) num_threads = n / HASH_JOB_MIN;
+	struct hash_job *jobs = NULL;
+	if (num_threads > 1)
+		jobs = malloc(num_threads * sizeof(struct hash_job));
+	if (jobs == NULL) {
+		struct hash_job job = { .map = map, .keys = keys, .hashes = hashes,
+			.from = 0, .to = n };
+		run_hash_job(&job);
+		return;
+	}
 
-	if (!init_buckets(res, num_buckets)) {
-		free(res);
-		return NULL;
+	for (size_t i = 0; i < num_threads; i++) {
+		jobs[i] = (struct hash_job){ .map = map, .keys = keys, .hashes = hashes,
+			.from = n / num_threads * i,
+			.to = i + 1 == num_threads ? n : n / num_threads * (i + 1) };
+		jobs[i].started = i > 0
+			&& pthread_create(&jobs[i].thread, NULL, &run_hash_job, jobs + i) == 0;
 	}
-	res->key_size = NULL;
-	res->fixed_key_size = key_size;
-	res->allow_autoexpand = allow_autoexpand;
-	return res;
+	for (size_t i = 0; i < num_threads; i++)
+		if (!jobs[i].started) run_hash_job(jobs + i);
+	for (size_t i = 0; i < num_threads; i++)
+		if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+	free(jobs);
 }
 
-/* ---------- destruction ---------- */
+void *
+run_hash_job(void *ptr)
+{
+	struct hash_job *job = ptr;
+	for (size_t i = job->from; i < job->to; i++)
+		job->hashes[i] = hash_key(job->map, job->keys[i]);
+	return NULL;
+}
 
-void
-map_destroy(struct map *map)
+/* ---------- pool helpers ---------- */
+
+/* Take an entry from the free list straight into 'chain'. */
+int
+pool_push(struct map *map, struct list *chain, void *key, void *value, size_t hash)
 {
-	arr_destroy_ex(map->buckets, &destroy_pair_list);
-	free(map);
+	if (list_empty(map->free_entries)
+			&& !pool_grow(map, map->size < POOL_CHUNK_MIN ? POOL_CHUNK_MIN : map->size))
+		return 0;
+	struct list_elem *elem = list_first(map->free_entries);
+	struct map_entry *entry = (struct map_entry *)elem;
+	entry->item.pair.key = key;
+	entry->item.pair.value = value;
+	entry->item.hash = hash;
+	list_extract(chain, map->free_entries, elem);
+	return 1;
 }
 
-void
-map_destroy_ex(struct map *map, void (*pair_destroyer)(void *pair))
+int
+pool_grow(struct map *map, size_t num_entries)
 {
-	size_t size = arr_size(map->buckets);
-	for (size_t i = 0; i < size; i++) {
-		struct list **chain = arr_ix(map->buckets, i);
-		struct list_elem *cur = list_first(*chain);
-		while (cur != NULL) {
-			pair_destroyer(list_data(cur));
-			cur = cur->next;
+	struct map_chunk *chunk = malloc(sizeof(struct map_chunk)
+			+ num_entries * sizeof(struct map_entry));
+	if (chunk == NULL) return 0;
+	chunk->next = map->chunks;
+	map->chunks = chunk;
+
+	/* Link the entries in order, so that they are handed out in order. */
+	for (size_t i = 0; i < num_entries; i++) {
+		struct map_entry *entry = chunk->entries + i;
+		entry->elem.data = &entry->item;
+		entry->elem.prev = i > 0 ? &chunk->entries[i - 1].elem : NULL;
+		entry->elem.next = i + 1 < num_entries ? &chunk->entries[i + 1].elem : NULL;
+	}
+	map->free_entries->first = &chunk->entries[0].elem;
+	map->free_entries->last = &chunk->entries[num_entries - 1].elem;
+	return 1;
+}
+
+/* Move all pairs into new entries in a single chunk, and into new buckets, no
+ * more of them than there are now, then release the old chunks together with
+ * the entries freed by removals. */
+int
+pool_compact(struct map *map, size_t num_buckets)
+{
+	if (map->old_buckets != NULL)
+		rehash_step(map, arr_size(map->old_buckets));
+	if (num_buckets > arr_size(map->buckets))
+		num_buckets = arr_size(map->buckets);
+
+	struct array *old_buckets = map->buckets;
+	struct map_chunk *old_chunks = map->chunks;
+	struct list old_free = *map->free_entries;
+	if (!init_buckets(map, num_buckets)) {
+		map->buckets = old_buckets;
+		return 0;
+	}
+	map->chunks = NULL;
+	map->free_entries->first = map->free_entries->last = NULL;
+	if (map->size > 0 && !pool_grow(map, map->size)) {
+		arr_destroy(map->buckets);
+		map->buckets = old_buckets;
+		map->chunks = old_chunks;
+		*map->free_entries = old_free;
+		return 0;
+	}
+
+	/* There's an entry for every pair, so pushing them can't fail. */
+	size_t old_size = arr_size(old_buckets);
+	map->size = map->num_occupied = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		for (struct list_elem *cur = list_first(arr_ix(old_buckets, i)); cur != NULL;
+				cur = list_next(cur)) {
+			struct map_item *item = list_data(cur);
+			push_pair(map, find_chain(map, item->hash), item->pair.key,
+					item->pair.value, item->hash);
 		}
-		list_destroy_ex(*chain, &free);
 	}
-	arr_destroy(map->buckets);
-	free(map);
+	arr_destroy(old_buckets);
+	while (old_chunks != NULL) {
+		struct map_chunk *next = old_chunks->next;
+		free(old_chunks);
+		old_chunks = next;
+	}
+	return 1;
 }
 
 void
-map_destroy_exx(struct map *map, void (*pair_destroyer)(void *pair, void *arg), void *arg)
+pool_destroy(struct map *map)
 {
-	size_t size = arr_size(map->buckets);
-	for (size_t i = 0; i < size; i++) {
-		struct list **chain = arr_ix(map->buckets, i);
-		struct list_elem *cur = list_first(*chain);
-		while (cur != NULL) {
-			pair_destroyer(list_data(cur), arg);
-			cur = cur->next;
-		}
-		list_destroy_ex(*chain, &free);
+	if (map->free_entries == NULL) return;
+	/* Pooled list elements are freed together with their chunks. */
+	map->free_entries->first = map->free_entries->last = NULL;
+	list_destroy(map->free_entries);
+	while (map->chunks != NULL) {
+		struct map_chunk *next = map->chunks->next;
+		free(map->chunks);
+		map->chunks = next;
 	}
-	arr_destroy(map->buckets);
-	free(map);
 }
 
-/* ---------- manipulation ---------- */
+/* ---------- open addressing helpers ---------- */
 
-enum map_err
-map_insert(struct map *map, void *key, void *value, key_eq_fn eq)
+/* Past this many used (full or deleted) slots the table is rebuilt. */
+static inline size_t
+open_max_used(struct map *map, size_t num_slots)
 {
-	size_t ix = fnv_hash(key, get_size(map, key));
-	ix = ix % arr_size(map->buckets);
+	return num_slots * map->max_load_factor;
+}
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	if (eq != NULL && can_find(*chain, key, eq)) 
-		return MAPE_EXIST;
+/* The number of slots to grow the table to. */
+static inline size_t
+open_grown(struct map *map)
+{
+	size_t res = map->num_slots * map->growth_factor;
+	return res > 2 * map->num_slots ? res : 2 * map->num_slots;
+}
 
-	if (map->allow_autoexpand && map_load_factor(map) >= CRIT_LOAD_FACTOR) {
-		int ok = map_expand(map, EXPAND_FACTOR, EXPAND_MIN);
-		if (!ok) return MAPE_NOMEM;
-	}
+int
+open_init(struct map *map, size_t num_slots)
+{
+	size_t size = next_pow2(num_slots);
+	if (size < GROUP_WIDTH) size = GROUP_WIDTH;
 
-	struct map_pair *pair = create_pair(key, value);
-	if (pair == NULL)
-		return MAPE_NOMEM;
-	if (!list_push(*chain, pair)) {
-		free(pair);
-		return MAPE_NOMEM;
+	/* The first group's worth of control bytes is cloned past the end, so
+	 * that a group can be loaded starting at any slot. */
+	unsigned char *ctrl = malloc(size + GROUP_WIDTH);
+	if (ctrl == NULL) return 0;
+	struct map_pair *slots = NULL;
+	size_t *hashes = NULL;
+	unsigned char *inline_slots = NULL;
+	if (map->flags & MAPF_INLINE) {
+		inline_slots = malloc(size * map->slot_size + 1);
+		slots = malloc(size * sizeof(struct map_pair));
+		if (inline_slots == NULL || slots == NULL) {
+			free(ctrl);
+			free(inline_slots);
+			free(slots);
+			return 0;
+		}
+		/* A slot's pair depends only on where it is, so it's made once
+		 * here rather than by every lookup. */
+		for (size_t i = 0; i < size; i++) {
+			slots[i].key = inline_slots + i * map->slot_size;
+			slots[i].value = map->value_size > 0
+				? inline_slots + i * map->slot_size + map->value_offset
+				: NULL;
+		}
+	} else {
+		slots = malloc(size * sizeof(struct map_pair));
+		hashes = malloc(size * sizeof(size_t));
+		if (slots == NULL || hashes == NULL) {
+			free(ctrl);
+			free(slots);
+			free(hashes);
+			return 0;
+		}
 	}
-	return MAPE_OK;
+	memset(ctrl, CTRL_EMPTY, size + GROUP_WIDTH);
+
+	map->ctrl = ctrl;
+	map->slots = slots;
+	map->hashes = hashes;
+	map->inline_slots = inline_slots;
+	map->num_slots = size;
+	map->num_deleted = 0;
+	map->size = map->num_occupied = 0;
+	return 1;
 }
 
-enum map_err
-map_insert_ex(struct map *map, void *key, void *value, key_eq_ex_fn eq, void *arg)
+int
+open_resize(struct map *map, size_t num_slots)
 {
-	size_t ix = fnv_hash(key, get_size(map, key));
-	ix = ix % arr_size(map->buckets);
+	if (num_slots < GROUP_WIDTH) num_slots = GROUP_WIDTH;
+	while (open_max_used(map, num_slots) <= map->size) num_slots *= 2;
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	if (eq != NULL && can_find_ex(*chain, key, eq, arg)) 
-		return MAPE_EXIST;
+	struct map old = *map;
+	if (!open_init(map, num_slots)) return 0;
 
-	if (map->allow_autoexpand && map_load_factor(map) >= CRIT_LOAD_FACTOR) {
-		int ok = map_expand(map, EXPAND_FACTOR, EXPAND_MIN);
-		if (!ok) return MAPE_NOMEM;
+	for (size_t i = 0; i < old.num_slots; i++) {
+		if (old.ctrl[i] & CTRL_EMPTY) continue;
+		if (map->flags & MAPF_INLINE) {
+			/* Inline keys are small, so hashing them again is cheap. */
+			unsigned char *slot = inline_slot(&old, i);
+			size_t ix = open_find_free(map, hash_key(map, slot));
+			open_set_ctrl(map, ix, old.ctrl[i]);
+			memcpy(inline_slot(map, ix), slot, map->slot_size);
+			continue;
+		}
+		size_t hash = old.hashes[i];
+		if (map->flags & MAPF_ROBIN_HOOD) {
+			rh_place(map, old.slots[i].key, old.slots[i].value, hash);
+			continue;
+		}
+		size_t ix = open_find_free(map, hash);
+		open_set_ctrl(map, ix, old.ctrl[i]);
+		map->slots[ix] = old.slots[i];
+		map->hashes[ix] = hash;
 	}
+	map->size = map->num_occupied = old.size;
+	free(old.ctrl);
+	free(old.slots);
+	free(old.hashes);
+	free(old.inline_slots);
+	return 1;
+}
 
-	struct map_pair *pair = create_pair(key, value);
-	if (pair == NULL)
-		return MAPE_NOMEM;
-	if (!list_push(*chain, pair)) {
-		free(pair);
-		return MAPE_NOMEM;
+struct map_pair *
+open_find(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	size_t mask = map->num_slots - 1;
+	size_t pos = (hash >> 7) & mask;
+	size_t step = 0;
+	while (1) {
+		unsigned char *group = map->ctrl + pos;
+		group_mask match = group_match(group, hash & 0x7f);
+		while (match != 0) {
+			struct map_pair *pair = map->slots + ((pos + group_next(&match)) & mask);
+			if (eq != NULL ? eq(pair->key, key) : eq_ex(pair->key, key, arg))
+				return pair;
+		}
+		if (group_match_empty(group) != 0) return NULL;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
 	}
-	return MAPE_OK;
 }
 
-int
-map_expand(struct map *map, double factor, size_t min)
+/* There's always at least one empty slot, so this terminates. */
+size_t
+open_find_free(struct map *map, size_t hash)
 {
-	size_t old_size = arr_size(map->buckets);
-	size_t new_size = old_size * factor;
-	if (new_size < old_size + min) new_size = old_size + min;
-	new_size = next_prime(new_size);
+	size_t mask = map->num_slots - 1;
+	size_t pos = (hash >> 7) & mask;
+	size_t step = 0;
+	while (1) {
+		group_mask match = group_match_free(map->ctrl + pos);
+		if (match != 0)
+			return (pos + group_next(&match)) & mask;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+	}
+}
 
-	struct array *old_buckets = map->buckets;
-	int ok = init_buckets(map, new_size);
-	if (!ok) return 0;
+void
+open_set_ctrl(struct map *map, size_t ix, unsigned char ctrl)
+{
+	map->ctrl[ix] = ctrl;
+	if (ix < GROUP_WIDTH)
+		map->ctrl[map->num_slots + ix] = ctrl;
+}
 
-	for (size_t i = 0; i < old_size; i++) {
-		struct list **chain = arr_ix(old_buckets, i);
-		struct list_elem *cur = (*chain)->first;
-		while (cur != NULL) {
-			struct map_pair *pair = list_data(cur);
-			if (map_insert(map, pair->key, pair->value, NULL) != MAPE_OK) {
-				arr_destroy_ex(map->buckets, &destroy_pair_list);
-				map->buckets = old_buckets;
-				return 0;
-			}
-			cur = list_next(cur);
-		} /* foreach pair in chain */
-	} /* foreach bucket */
+enum map_err
+open_insert(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out)
+{
+	if ((eq != NULL || eq_ex != NULL) && open_find(map, key, hash, eq, eq_ex, arg) != NULL)
+		return MAPE_EXIST;
+	if (!open_make_room(map))
+		return MAPE_NOMEM;
 
-	arr_destroy_ex(old_buckets, &destroy_pair_list);
-	return 1;
+	size_t ix = open_find_free(map, hash);
+	if (map->ctrl[ix] == CTRL_DELETED) map->num_deleted--;
+	open_set_ctrl(map, ix, hash & 0x7f);
+	map->slots[ix].key = key;
+	map->slots[ix].value = value;
+	map->hashes[ix] = hash;
+	map->size++;
+	map->num_occupied++;
+	if (out != NULL) *out = map->slots + ix;
+	return MAPE_OK;
 }
 
 struct map_pair *
-map_remove(struct map *map, void *key, key_eq_fn eq)
+open_remove(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
 {
-	size_t ix = fnv_hash(key, get_size(map, key)) % arr_size(map->buckets);
+	struct map_pair *pair = open_find(map, key, hash, eq, eq_ex, arg);
+	if (pair == NULL) return NULL;
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	struct list_elem *cur = list_first(*chain);
-	while (cur != NULL) {
-		struct list_elem *next = list_next(cur);
-		struct map_pair *pair = list_data(cur);
-		if (eq(pair->key, key)) {
-			list_remove(*chain, cur);
-			free(cur);
-			return pair;
-		}
-		cur = next;
-	}
-	return NULL;
+	struct map_pair *res = out;
+	if (res == NULL) res = create_pair(pair->key, pair->value);
+	else *res = *pair;
+	if (res == NULL) return NULL;
+	open_set_ctrl(map, pair - map->slots, CTRL_DELETED);
+	map->size--;
+	map->num_occupied--;
+	map->num_deleted++;
+	return res;
+}
+
+/* Open addressing maps can't hold more pairs than they have slots, so they
+ * grow regardless of MAPF_AUTOEXPAND. If the table is mostly tombstones,
+ * rebuilding it at the same size is enough.
+ * Return 0 if there's not enough memory to grow. */
+int
+open_make_room(struct map *map)
+{
+	if (map->size + map->num_deleted + 1 <= open_max_used(map, map->num_slots))
+		return 1;
+	size_t num_slots = map->num_slots;
+	if (map->size + 1 > open_max_used(map, num_slots) / 2)
+		num_slots = open_grown(map);
+	return open_resize(map, num_slots);
 }
 
+/* The pair in full slot 'ix'. */
 struct map_pair *
-map_remove_ex(struct map *map, void *key, key_eq_ex_fn eq, void *arg)
+open_pair(struct map *map, size_t ix)
 {
-	size_t ix = fnv_hash(key, get_size(map, key)) % arr_size(map->buckets);
+	return map->slots + ix;
+}
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	struct list_elem *cur = list_first(*chain);
-	while (cur != NULL) {
-		struct list_elem *next = list_next(cur);
-		struct map_pair *pair = list_data(cur);
-		if (eq(pair->key, key, arg)) {
-			list_remove(*chain, cur);
-			free(cur);
-			return pair;
-		}
-		cur = next;
-	}
-	return NULL;
+/* The hash of the key in full slot 'ix'. */
+size_t
+open_hash(struct map *map, size_t ix)
+{
+	if (map->flags & MAPF_INLINE) return hash_key(map, inline_slot(map, ix));
+	return map->hashes[ix];
 }
 
-/* ---------- information retrieval ---------- */
+void
+open_destroy(struct map *map)
+{
+	free(map->ctrl);
+	free(map->slots);
+	free(map->hashes);
+	free(map->inline_slots);
+	free(map->removed);
+	if (map->filter != NULL) bloom_destroy(map->filter);
+	free(map);
+}
 
-struct map_pair *
-map_lookup(struct map *map, void *key, key_eq_fn eq)
+/* The number of control bytes that 'open_find' scans before reaching slot
+ * 'ix', following the probe sequence of its hash a group at a time. */
+size_t
+open_probe_length(struct map *map, size_t ix)
 {
-	size_t ix = fnv_hash(key, get_size(map, key)) % arr_size(map->buckets);
+	if (map->flags & MAPF_ROBIN_HOOD) return rh_dist(map, ix);
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	struct list_elem *cur = list_first(*chain);
-	while (cur != NULL) {
-		struct map_pair *pair = list_data(cur);
-		if (eq(pair->key, key)) 
-			return pair;
-		cur = list_next(cur);
+	size_t mask = map->num_slots - 1;
+	size_t pos = (open_hash(map, ix) >> 7) & mask;
+	size_t step = 0, res = 0;
+	while (((ix - pos) & mask) >= GROUP_WIDTH) {
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+		res += GROUP_WIDTH;
 	}
-	return 0;
+	return res + ((ix - pos) & mask);
 }
 
-struct map_pair *
-map_lookup_ex(struct map *map, void *key, key_eq_ex_fn eq, void *eq_arg)
+/* ---------- Robin Hood helpers ---------- */
+
+/* Robin Hood maps share the slots, control bytes and hashes of open addressing
+ * maps, but probe one slot at a time, starting from the same home slot. They
+ * never have deleted slots. */
+
+/* The distance of the pair in full slot 'ix' from its home slot. */
+size_t
+rh_dist(struct map *map, size_t ix)
 {
-	size_t ix = fnv_hash(key, get_size(map, key)) % arr_size(map->buckets);
+	return (ix - (map->hashes[ix] >> 7)) & (map->num_slots - 1);
+}
 
-	struct list **chain = arr_ix(map->buckets, ix);
-	struct list_elem *cur = list_first(*chain);
-	while (cur != NULL) {
-		struct map_pair *pair = list_data(cur);
-		if (eq(pair->key, key, eq_arg))
-			return pair;
-		cur = list_next(cur);
+/* Pairs along a probe sequence are never closer to their home slots than the
+ * key being looked for is to its own, up to where it would be. */
+struct map_pair *
+rh_find(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	size_t mask = map->num_slots - 1;
+	size_t pos = (hash >> 7) & mask;
+	unsigned char tag = hash & 0x7f;
+	for (size_t dist = 0; ; dist++, pos = (pos + 1) & mask) {
+		unsigned char ctrl = map->ctrl[pos];
+		if (ctrl == CTRL_EMPTY || rh_dist(map, pos) < dist) return NULL;
+		if (ctrl == tag && map->hashes[pos] == hash) {
+			struct map_pair *pair = map->slots + pos;
+			if (eq != NULL ? eq(pair->key, key) : eq_ex(pair->key, key, arg))
+				return pair;
+		}
 	}
-	return 0;
 }
 
-extern size_t
-map_num_buckets(struct map *map);
-
-double
-map_load_factor(struct map *map)
+/* Put a pair into the table, which must have an empty slot, displacing the
+ * pairs closer to their home slots than the one being carried.
+ * Return the longest distance from its home slot that any pair has been put
+ * at. */
+size_t
+rh_place(struct map *map, void *key, void *value, size_t hash)
 {
-	size_t len = arr_size(map->buckets);
-	size_t num_used = 0;
-	for (size_t i = 0; i < len; i++) {
-		struct list **cur = arr_ix(map->buckets, i);
-		if (!list_empty(*cur)) num_used++;
+	size_t mask = map->num_slots - 1;
+	size_t pos = (hash >> 7) & mask;
+	size_t longest = 0;
+	for (size_t dist = 0; ; dist++, pos = (pos + 1) & mask) {
+		if (map->ctrl[pos] == CTRL_EMPTY) {
+			open_set_ctrl(map, pos, hash & 0x7f);
+			map->slots[pos].key = key;
+			map->slots[pos].value = value;
+			map->hashes[pos] = hash;
+			return dist > longest ? dist : longest;
+		}
+		size_t their_dist = rh_dist(map, pos);
+		if (their_dist >= dist) continue;
+
+		if (dist > longest) longest = dist;
+		struct map_pair pair = map->slots[pos];
+		size_t their_hash = map->hashes[pos];
+		open_set_ctrl(map, pos, hash & 0x7f);
+		map->slots[pos].key = key;
+		map->slots[pos].value = value;
+		map->hashes[pos] = hash;
+		key = pair.key;
+		value = pair.value;
+		hash = their_hash;
+		dist = their_dist;
 	}
-	return num_used * 1.0 / len;
 }
 
-/* ---------- helper functions ---------- */
-
+/* Tells the very key inserted from other ones equal to it. */
 int
-is_prime(size_t i)
+same_key(void *a, void *b)
 {
-	size_t root = sqrt(i);
-	for (size_t k = 2; k <= root; k++)
-		if (i % k == 0) return 0;
-	return 1;
+	return a == b;
 }
 
-size_t
-next_prime(size_t i)
+/* The pair inserted may be displaced by the ones placed after it, or moved by
+ * growing the table, so it's found again by its key pointer to set 'out'. */
+enum map_err
+rh_insert(struct map *map, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair **out)
 {
-	if (i % 2 == 0) i++;
+	if ((eq != NULL || eq_ex != NULL) && rh_find(map, key, hash, eq, eq_ex, arg) != NULL)
+		return MAPE_EXIST;
+
+	if (map->size + 1 > open_max_used(map, map->num_slots)
+			&& !open_resize(map, open_grown(map)))
+		return MAPE_NOMEM;
+
+	size_t longest = rh_place(map, key, value, hash);
+	map->size++;
+	map->num_occupied++;
+	/* The pair is in already, so failing to grow is fine. */
+	if (longest > RH_MAX_PROBE && map->size >= map->num_slots / 4)
+		open_resize(map, open_grown(map));
+	if (out != NULL) *out = rh_find(map, key, hash, &same_key, NULL, NULL);
+	return MAPE_OK;
+}
+
+/* Shift the pairs following the removed one back by a slot, up to an empty
+ * slot or a pair in its home slot. */
+struct map_pair *
+rh_remove(struct map *map, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	struct map_pair *pair = rh_find(map, key, hash, eq, eq_ex, arg);
+	if (pair == NULL) return NULL;
+
+	struct map_pair *res = out;
+	if (res == NULL) res = create_pair(pair->key, pair->value);
+	else *res = *pair;
+	if (res == NULL) return NULL;
+
+	size_t mask = map->num_slots - 1;
+	size_t ix = pair - map->slots;
 	while (1) {
-		i += 2;
-		if (is_prime(i)) return i;
+		size_t next = (ix + 1) & mask;
+		if (map->ctrl[next] == CTRL_EMPTY || rh_dist(map, next) == 0) break;
+		open_set_ctrl(map, ix, map->ctrl[next]);
+		map->slots[ix] = map->slots[next];
+		map->hashes[ix] = map->hashes[next];
+		ix = next;
 	}
+	open_set_ctrl(map, ix, CTRL_EMPTY);
+	map->size--;
+	map->num_occupied--;
+	return res;
 }
 
+/* ---------- statistics helpers ---------- */
+
+/* 'mean_probe' holds the sum of probe lengths until all pairs are added. */
 void
-destroy_list_from_array(void *ptr)
+stats_add(struct map_stats *stats, size_t probe)
+{
+	if (probe > stats->max_probe) stats->max_probe = probe;
+	stats->mean_probe += probe;
+	stats->histogram[probe < MAP_STATS_HISTOGRAM ? probe : MAP_STATS_HISTOGRAM - 1]++;
+}
+
+/* ---------- inline helpers ---------- */
+
+/* The alignment of an object of 'size' bytes: the largest power of two that
+ * divides it, up to 8. */
+size_t
+align_for(size_t size)
+{
+	if (size == 0) return 1;
+	size_t res = size & -size;
+	return res > 8 ? 8 : res;
+}
+
+unsigned char *
+inline_slot(struct map *map, size_t ix)
 {
-	struct list **list = ptr;
-	list_destroy(*list);
+	return map->inline_slots + ix * map->slot_size;
 }
 
 void
-destroy_pair_list(void *ptr)
+inline_pair(struct map *map, unsigned char *slot, struct map_pair *out)
 {
-	struct list **list = ptr;
-	list_destroy_ex(*list, &free);
+	out->key = slot;
+	out->value = map->value_size > 0 ? slot + map->value_offset : NULL;
 }
 
-int
-init_buckets(struct map *map, size_t num_buckets)
+/* Keys of a word or half a word are compared as such. */
+static inline int
+inline_key_eq(struct map *map, void *a, void *b)
 {
-	num_buckets = next_prime(num_buckets);
-	map->buckets = arr_create(num_buckets, sizeof(struct list *));
-	if (map->buckets == NULL) return 0;
+	if (map->fixed_key_size == sizeof(uint64_t)) {
+		uint64_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return x == y;
+	}
+	if (map->fixed_key_size == sizeof(uint32_t)) {
+		uint32_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return x == y;
+	}
+	return memcmp(a, b, map->fixed_key_size) == 0;
+}
 
-	for (size_t i = 0; i < num_buckets; i++) {
-		struct list *chain = list_create();
-		if (chain == NULL) {
-			arr_destroy_ex(map->buckets, &destroy_list_from_array);
-			return 0;
+/* Same as 'open_find', comparing the keys in the slots themselves. */
+struct map_pair *
+inline_find(struct map *map, void *key, size_t hash)
+{
+	size_t mask = map->num_slots - 1;
+	size_t pos = (hash >> 7) & mask;
+	size_t step = 0;
+	while (1) {
+		unsigned char *group = map->ctrl + pos;
+		group_mask match = group_match(group, hash & 0x7f);
+		while (match != 0) {
+			size_t ix = (pos + group_next(&match)) & mask;
+			if (inline_key_eq(map, inline_slot(map, ix), key))
+				return map->slots + ix;
 		}
-		arr_append(map->buckets, &chain);
+		if (group_match_empty(group) != 0) return NULL;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
 	}
-	return 1;
 }
 
-size_t
-fnv_hash(void *data, size_t size)
+enum map_err
+inline_insert(struct map *map, void *key, void *value, size_t hash, int check,
+		struct map_pair **out)
 {
-	unsigned char *p = data;
-	unsigned int h = 2166136261;
+	if (check && inline_find(map, key, hash) != NULL)
+		return MAPE_EXIST;
+	if (!open_make_room(map))
+		return MAPE_NOMEM;
 
-	for (size_t i = 0; i < size; i++) 
-		h = (h * 16777619) ^ p[i];
-	return h;
+	size_t ix = open_find_free(map, hash);
+	if (map->ctrl[ix] == CTRL_DELETED) map->num_deleted--;
+	open_set_ctrl(map, ix, hash & 0x7f);
+	unsigned char *slot = inline_slot(map, ix);
+	memcpy(slot, key, map->fixed_key_size);
+	if (value != NULL)
+		memcpy(slot + map->value_offset, value, map->value_size);
+	else
+		memset(slot + map->value_offset, 0, map->value_size);
+	map->size++;
+	map->num_occupied++;
+	if (out != NULL) *out = map->slots + ix;
+	return MAPE_OK;
 }
 
-size_t
-get_size(struct map *map, void *data)
+/* Without 'out', the copy of the slot follows the pair in the same
+ * allocation. */
+struct map_pair *
+inline_remove(struct map *map, void *key, size_t hash, struct map_pair *out)
 {
-	if (map->key_size == NULL)
-		return map->fixed_key_size;
-	else
-		return map->key_size(data);
+	struct map_pair *pair = inline_find(map, key, hash);
+	if (pair == NULL) return NULL;
+
+	struct map_pair *res = out;
+	unsigned char *copy = map->removed;
+	if (res == NULL) {
+		res = malloc(sizeof(struct map_pair) + map->slot_size);
+		if (res == NULL) return NULL;
+		copy = (unsigned char *)(res + 1);
+	}
+	memcpy(copy, pair->key, map->slot_size);
+	inline_pair(map, copy, res);
+	open_set_ctrl(map, pair - map->slots, CTRL_DELETED);
+	map->size--;
+	map->num_occupied--;
+	map->num_deleted++;
+	return res;
 }
 
+/* ---------- bloom filter helpers ---------- */
+
 int
-can_find(struct list *list, void *data, key_eq_fn eq)
+init_filter(struct map *map, size_t num_buckets)
 {
-	return list_find_eq(list, data, eq) != NULL;
+	if (!(map->flags & MAPF_BLOOM)) return 1;
+	size_t capacity = num_buckets > FILTER_MIN_CAPACITY ? num_buckets : FILTER_MIN_CAPACITY;
+	map->filter = bloom_create_fs(capacity, FILTER_FP_RATE, 0);
+	return map->filter != NULL;
 }
 
-int
-can_find_ex(struct list *list, void *data, key_eq_ex_fn eq, void *arg)
+/* A full filter is rebuilt, which also drops the keys removed since the last
+ * rebuild. If there's not enough memory for that, the old one is kept: it
+ * only gives more false positives. */
+void
+filter_add(struct map *map, size_t hash)
 {
-	return list_find_eq_ex(list, data, eq, arg) != NULL;
+	struct bloom *filter = map->filter;
+	/* The new pair is in the map already. */
+	if (bloom_count(filter) >= filter->capacity && filter_rebuild(map))
+		return;
+	bloom_add_hashed(filter, hash);
 }
 
-struct map_pair *
-create_pair(void *key, void *value)
+/* The new filter has room for as many keys again as the map holds. */
+int
+filter_rebuild(struct map *map)
 {
-	struct map_pair *res = malloc(sizeof(struct map_pair));
-	if (res == NULL) return NULL;
-	res->key = key;
-	res->value = value;
-	return res;
+	size_t capacity = 2 * map->size;
+	if (capacity < FILTER_MIN_CAPACITY) capacity = FILTER_MIN_CAPACITY;
+	struct bloom *filter = bloom_create_fs(capacity, FILTER_FP_RATE, 0);
+	if (filter == NULL) return 0;
+
+	if (map->flags & MAPF_OPEN) {
+		for (size_t i = 0; i < map->num_slots; i++)
+			if (!(map->ctrl[i] & CTRL_EMPTY))
+				bloom_add_hashed(filter, open_hash(map, i));
+	} else {
+		struct array *arrays[] = { map->buckets, map->old_buckets };
+		for (size_t a = 0; a < 2 && arrays[a] != NULL; a++) {
+			size_t size = arr_size(arrays[a]);
+			for (size_t i = 0; i < size; i++) {
+				struct list *chain = arr_ix(arrays[a], i);
+				for (struct list_elem *cur = list_first(chain); cur != NULL; cur = cur->next) {
+					struct map_item *item = list_data(cur);
+					bloom_add_hashed(filter, item->hash);
+				}
+			}
+		}
+	}
+	bloom_destroy(map->filter);
+	map->filter = filter;
+	return 1;
 }
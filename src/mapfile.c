@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "map.h"
+#include "mapfile.h"
+
+#define MAGIC "miscmap1"
+/* Reads differently on machines with a different byte order. */
+#define BYTE_ORDER_MARK 0x0102030405060708ull
+
+/* Slots are at most this full, so that lookups of missing keys stay short. */
+#define MAX_LOAD_FACTOR 0.75
+
+/* Appended to the path of a file being written, for 'mkstemp'. */
+#define TMP_SUFFIX ".XXXXXX"
+
+/* A slot starts with the hash of its key with the lowest bit set, so that 0
+ * can mark empty slots. The key and the value follow. */
+#define SLOT_FULL 1ull
+
+struct header
+{
+	char magic[8];
+	uint64_t byte_order;
+	uint64_t key_size, value_size, slot_size;
+	uint64_t num_slots, size;
+	uint64_t seed;
+};
+
+/* ---------- helper function declarations ---------- */
+
+static size_t
+slot_size_for(size_t key_size, size_t value_size);
+
+static uint64_t
+slot_hash(uint64_t seed, void *key, size_t key_size);
+
+static size_t
+first_slot(uint64_t hash, size_t num_slots);
+
+static int
+write_all(int fd, void *data, size_t size);
+
+static int
+write_file(const char *path, struct header *, unsigned char *slots);
+
+static int
+valid_header(struct header *, size_t length);
+
+/* ---------- writing ---------- */
+
+int
+mapfile_write(struct map *map, const char *path, size_t value_size)
+{
+	if (map->key_size != NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	struct header header = { .magic = MAGIC, .byte_order = BYTE_ORDER_MARK };
+	header.key_size = map->fixed_key_size;
+	header.value_size = value_size;
+	header.slot_size = slot_size_for(header.key_size, value_size);
+	header.size = map_size(map);
+	header.seed = map->seed;
+	header.num_slots = 2;
+	while (header.num_slots * MAX_LOAD_FACTOR < header.size)
+		header.num_slots *= 2;
+
+	unsigned char *slots = calloc(header.num_slots, header.slot_size);
+	if (slots == NULL) return 0;
+
+	struct map_iter iter;
+	map_iter_init(&iter, map);
+	struct map_pair *pair;
+	size_t mask = header.num_slots - 1;
+	while ((pair = map_iter_next(&iter)) != NULL) {
+		uint64_t hash = slot_hash(header.seed, pair->key, header.key_size);
+		size_t ix = first_slot(hash, header.num_slots);
+		while (*(uint64_t *)(slots + ix * header.slot_size) != 0)
+			ix = (ix + 1) & mask;
+		unsigned char *slot = slots + ix * header.slot_size;
+		memcpy(slot, &hash, sizeof(hash));
+		memcpy(slot + sizeof(hash), pair->key, header.key_size);
+		if (value_size > 0 && pair->value != NULL)
+			memcpy(slot + sizeof(hash) + header.key_size, pair->value, value_size);
+	}
+
+	int ok = write_file(path, &header, slots);
+	free(slots);
+	return ok;
+}
+
+/* ---------- opening and closing ---------- */
+
+struct mapfile *
+mapfile_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	size_t length = st.st_size;
+	if (length < sizeof(struct header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+
+	struct header *header = data;
+	struct mapfile *res = malloc(sizeof(struct mapfile));
+	if (res == NULL || !valid_header(header, length)) {
+		munmap(data, length);
+		free(res);
+		if (res != NULL) errno = EINVAL;
+		return NULL;
+	}
+	res->data = data;
+	res->length = length;
+	res->key_size = header->key_size;
+	res->value_size = header->value_size;
+	res->slot_size = header->slot_size;
+	res->num_slots = header->num_slots;
+	res->size = header->size;
+	res->seed = header->seed;
+	res->slots = (unsigned char *)data + sizeof(struct header);
+	return res;
+}
+
+void
+mapfile_close(struct mapfile *mapfile)
+{
+	munmap(mapfile->data, mapfile->length);
+	free(mapfile);
+}
+
+/* ---------- lookup ---------- */
+
+/* Files are never written without empty slots, but a corrupted one may have
+ * none, so a probe ends after going round all of them. */
+struct map_pair *
+mapfile_lookup(struct mapfile *mapfile, void *key, struct map_pair *out)
+{
+	uint64_t hash = slot_hash(mapfile->seed, key, mapfile->key_size);
+	size_t mask = mapfile->num_slots - 1;
+	size_t ix = first_slot(hash, mapfile->num_slots);
+	for (size_t i = 0; i < mapfile->num_slots; i++) {
+		unsigned char *slot = mapfile->slots + ix * mapfile->slot_size;
+		uint64_t stored;
+		memcpy(&stored, slot, sizeof(stored));
+		if (stored == 0) return NULL;
+		if (stored == hash
+				&& memcmp(slot + sizeof(hash), key, mapfile->key_size) == 0) {
+			out->key = slot + sizeof(hash);
+			out->value = mapfile->value_size > 0
+				? slot + sizeof(hash) + mapfile->key_size
+				: NULL;
+			return out;
+		}
+		ix = (ix + 1) & mask;
+	}
+	return NULL;
+}
+
+extern size_t
+mapfile_size(struct mapfile *mapfile);
+
+/* ---------- helper functions ---------- */
+
+size_t
+slot_size_for(size_t key_size, size_t value_size)
+{
+	size_t res = sizeof(uint64_t) + key_size + value_size;
+	return (res + 7) & ~(size_t)7;
+}
+
+uint64_t
+slot_hash(uint64_t seed, void *key, size_t key_size)
+{
+	return hash_wy(key, key_size, seed) | SLOT_FULL;
+}
+
+/* The top bits of the hash, the lowest one is always set. */
+size_t
+first_slot(uint64_t hash, size_t num_slots)
+{
+	return hash >> (64 - __builtin_ctzll(num_slots));
+}
+
+int
+write_all(int fd, void *data, size_t size)
+{
+	unsigned char *p = data;
+	while (size > 0) {
+		ssize_t written = write(fd, p, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		p += written;
+		size -= written;
+	}
+	return 1;
+}
+
+/* Readers may have the old file mapped, and would get SIGBUS if it shrank
+ * under them, so the new one is written next to it and renamed over it once
+ * it's complete. A failure leaves the old file as it was. */
+int
+write_file(const char *path, struct header *header, unsigned char *slots)
+{
+	size_t path_len = strlen(path);
+	char *tmp_path = malloc(path_len + sizeof(TMP_SUFFIX));
+	if (tmp_path == NULL) return 0;
+	memcpy(tmp_path, path, path_len);
+	memcpy(tmp_path + path_len, TMP_SUFFIX, sizeof(TMP_SUFFIX));
+
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		free(tmp_path);
+		return 0;
+	}
+	int ok = fchmod(fd, 0644) == 0
+		&& write_all(fd, header, sizeof(*header))
+		&& write_all(fd, slots, header->num_slots * header->slot_size)
+		&& fsync(fd) == 0;
+	int err = errno;
+	if (close(fd) != 0 && ok) {
+		ok = 0;
+		err = errno;
+	}
+	if (ok && rename(tmp_path, path) != 0) {
+		ok = 0;
+		err = errno;
+	}
+	if (!ok) {
+		unlink(tmp_path);
+		errno = err;
+	}
+	free(tmp_path);
+	return ok;
+}
+
+/* There must be at least one empty slot, or lookups of missing keys would never
+ * stop. */
+int
+valid_header(struct header *header, size_t length)
+{
+	if (memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0
+			|| header->byte_order != BYTE_ORDER_MARK)
+		return 0;
+	if (header->num_slots < 2 || (header->num_slots & (header->num_slots - 1)) != 0
+			|| header->size >= header->num_slots)
+		return 0;
+	if (header->key_size > length || header->value_size > length
+			|| header->slot_size != slot_size_for(header->key_size, header->value_size))
+		return 0;
+	if (header->slot_size == 0
+			|| (length - sizeof(struct header)) / header->slot_size < header->num_slots)
+		return 0;
+	return 1;
+}
@@ -0,0 +1,484 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "map.h"
+#include "mcache.h"
+
+/* ---------- helper function declarations ---------- */
+
+static struct mcache *
+create_mcache(size_t capacity, key_size_fn key_size, size_t fixed_key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair));
+
+static struct cmcache *
+create_cmcache(size_t num_shards, size_t capacity, key_size_fn key_size,
+		size_t fixed_key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair));
+
+static struct cmcache_shard *
+find_shard(struct cmcache *, size_t hash);
+
+static struct map_pair *
+get(struct mcache *, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg);
+
+static enum map_err
+put(struct mcache *, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static struct map_pair *
+remove_pair(struct mcache *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out);
+
+static void
+touch(struct mcache *, struct mcache_entry *);
+
+static void
+unlink_entry(struct mcache *, struct mcache_entry *);
+
+static struct mcache_entry *
+choose_victim(struct mcache *);
+
+static void
+evict(struct mcache *, struct mcache_entry *);
+
+static void
+release_entry(struct mcache *, struct mcache_entry *);
+
+static int
+same_key(void *key1, void *key2, void *arg);
+
+/* ---------- creation ---------- */
+
+struct mcache *
+mcache_create(size_t capacity, key_size_fn key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair))
+{
+	return create_mcache(capacity, key_size, 0, policy, on_evict);
+}
+
+struct mcache *
+mcache_create_fs(size_t capacity, size_t key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair))
+{
+	return create_mcache(capacity, NULL, key_size, policy, on_evict);
+}
+
+struct cmcache *
+cmcache_create(size_t num_shards, size_t capacity, key_size_fn key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair))
+{
+	return create_cmcache(num_shards, capacity, key_size, 0, policy, on_evict);
+}
+
+struct cmcache *
+cmcache_create_fs(size_t num_shards, size_t capacity, size_t key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair))
+{
+	return create_cmcache(num_shards, capacity, NULL, key_size, policy, on_evict);
+}
+
+/* ---------- destruction ---------- */
+
+void
+mcache_destroy(struct mcache *cache)
+{
+	map_destroy(cache->map);
+	free(cache->entries);
+	free(cache);
+}
+
+void
+mcache_destroy_ex(struct mcache *cache, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < cache->capacity; i++)
+		if (cache->entries[i].used)
+			pair_destroyer(&cache->entries[i].pair);
+	mcache_destroy(cache);
+}
+
+void
+cmcache_destroy(struct cmcache *cmcache)
+{
+	for (size_t i = 0; i < cmcache->num_shards; i++) {
+		pthread_mutex_destroy(&cmcache->shards[i].lock);
+		mcache_destroy(cmcache->shards[i].cache);
+	}
+	free(cmcache->shards);
+	free(cmcache);
+}
+
+void
+cmcache_destroy_ex(struct cmcache *cmcache, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < cmcache->num_shards; i++) {
+		pthread_mutex_destroy(&cmcache->shards[i].lock);
+		mcache_destroy_ex(cmcache->shards[i].cache, pair_destroyer);
+	}
+	free(cmcache->shards);
+	free(cmcache);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+mcache_put(struct mcache *cache, void *key, void *value, key_eq_fn eq)
+{
+	return put(cache, key, value, map_hash(cache->map, key), eq, NULL, NULL);
+}
+
+enum map_err
+mcache_put_ex(struct mcache *cache, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return put(cache, key, value, map_hash(cache->map, key), NULL, eq, arg);
+}
+
+struct map_pair *
+mcache_remove(struct mcache *cache, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	return remove_pair(cache, key, map_hash(cache->map, key), eq, NULL, NULL, out);
+}
+
+struct map_pair *
+mcache_remove_ex(struct mcache *cache, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out)
+{
+	return remove_pair(cache, key, map_hash(cache->map, key), NULL, eq, arg, out);
+}
+
+enum map_err
+cmcache_put(struct cmcache *cmcache, void *key, void *value, key_eq_fn eq)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	enum map_err res = put(shard->cache, key, value, hash, eq, NULL, NULL);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+enum map_err
+cmcache_put_ex(struct cmcache *cmcache, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	enum map_err res = put(shard->cache, key, value, hash, NULL, eq, arg);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+struct map_pair *
+cmcache_remove(struct cmcache *cmcache, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct map_pair *res = remove_pair(shard->cache, key, hash, eq, NULL, NULL, out);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+struct map_pair *
+cmcache_remove_ex(struct cmcache *cmcache, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct map_pair *res = remove_pair(shard->cache, key, hash, NULL, eq, arg, out);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+mcache_get(struct mcache *cache, void *key, key_eq_fn eq)
+{
+	return get(cache, key, map_hash(cache->map, key), eq, NULL, NULL);
+}
+
+struct map_pair *
+mcache_get_ex(struct mcache *cache, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return get(cache, key, map_hash(cache->map, key), NULL, eq, eq_arg);
+}
+
+struct map_pair *
+cmcache_get(struct cmcache *cmcache, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct map_pair *pair = get(shard->cache, key, hash, eq, NULL, NULL);
+	if (pair != NULL) *out = *pair;
+	pthread_mutex_unlock(&shard->lock);
+	return pair == NULL ? NULL : out;
+}
+
+struct map_pair *
+cmcache_get_ex(struct cmcache *cmcache, void *key, key_eq_ex_fn eq, void *eq_arg,
+		struct map_pair *out)
+{
+	size_t hash = map_hash(cmcache->shards[0].cache->map, key);
+	struct cmcache_shard *shard = find_shard(cmcache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct map_pair *pair = get(shard->cache, key, hash, NULL, eq, eq_arg);
+	if (pair != NULL) *out = *pair;
+	pthread_mutex_unlock(&shard->lock);
+	return pair == NULL ? NULL : out;
+}
+
+extern size_t
+mcache_size(struct mcache *cache);
+
+size_t
+cmcache_size(struct cmcache *cmcache)
+{
+	size_t res = 0;
+	for (size_t i = 0; i < cmcache->num_shards; i++) {
+		pthread_mutex_lock(&cmcache->shards[i].lock);
+		res += mcache_size(cmcache->shards[i].cache);
+		pthread_mutex_unlock(&cmcache->shards[i].lock);
+	}
+	return res;
+}
+
+/* ---------- helper functions ---------- */
+
+/* The map never holds more than 'capacity' keys, plus the one being put while
+ * the pair it replaces is evicted, so a Robin Hood map (which leaves no
+ * tombstones) sized for them only grows if probes get too long. */
+struct mcache *
+create_mcache(size_t capacity, key_size_fn key_size, size_t fixed_key_size,
+		enum mcache_policy policy, void (*on_evict)(void *pair))
+{
+	if (capacity == 0) return NULL;
+	struct mcache *res = malloc(sizeof(struct mcache));
+	if (res == NULL) return NULL;
+
+	size_t num_slots = capacity + 1 + (capacity + 1) / 7 + 1;
+	res->map = key_size != NULL
+		? map_create(num_slots, key_size, MAPF_ROBIN_HOOD)
+		: map_create_fs(num_slots, fixed_key_size, MAPF_ROBIN_HOOD);
+	res->entries = calloc(capacity, sizeof(struct mcache_entry));
+	if (res->map == NULL || res->entries == NULL) {
+		if (res->map != NULL) map_destroy(res->map);
+		free(res->entries);
+		free(res);
+		return NULL;
+	}
+
+	for (size_t i = 0; i + 1 < capacity; i++)
+		res->entries[i].next = res->entries + i + 1;
+	res->free_entries = res->entries;
+	res->capacity = capacity;
+	res->size = 0;
+	res->policy = policy;
+	res->head = res->tail = NULL;
+	res->hand = 0;
+	res->on_evict = on_evict;
+	return res;
+}
+
+struct cmcache *
+create_cmcache(size_t num_shards, size_t capacity, key_size_fn key_size,
+		size_t fixed_key_size, enum mcache_policy policy,
+		void (*on_evict)(void *pair))
+{
+	if (capacity == 0) return NULL;
+	struct cmcache *res = malloc(sizeof(struct cmcache));
+	if (res == NULL) return NULL;
+
+	/* Every shard holds a pair at least, so a small capacity takes fewer
+	 * shards. */
+	res->shard_shift = hash_shard_shift(num_shards, &res->num_shards);
+	while (res->num_shards > capacity)
+		res->shard_shift = hash_shard_shift(res->num_shards / 2, &res->num_shards);
+
+	res->shards = aligned_alloc(_Alignof(struct cmcache_shard),
+			res->num_shards * sizeof(struct cmcache_shard));
+	if (res->shards == NULL) {
+		free(res);
+		return NULL;
+	}
+
+	/* The first shards take a pair each of what's left over, so that the
+	 * shards hold 'capacity' pairs in all. */
+	size_t shard_capacity = capacity / res->num_shards;
+	size_t num_larger = capacity % res->num_shards;
+	for (size_t i = 0; i < res->num_shards; i++) {
+		struct mcache *cache = create_mcache(shard_capacity + (i < num_larger),
+				key_size, fixed_key_size, policy, on_evict);
+		if (cache != NULL && pthread_mutex_init(&res->shards[i].lock, NULL) != 0) {
+			mcache_destroy(cache);
+			cache = NULL;
+		}
+		if (cache == NULL) {
+			res->num_shards = i;
+			cmcache_destroy(res);
+			return NULL;
+		}
+		/* The shard is chosen by the same hash as the slot within it. */
+		if (i > 0) cache->map->seed = res->shards[0].cache->map->seed;
+		res->shards[i].cache = cache;
+	}
+	return res;
+}
+
+struct cmcache_shard *
+find_shard(struct cmcache *cmcache, size_t hash)
+{
+	return cmcache->shards + hash_shard(hash, cmcache->shard_shift, cmcache->num_shards);
+}
+
+struct map_pair *
+get(struct mcache *cache, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg)
+{
+	struct map_pair *pair = eq != NULL
+		? map_lookup_hashed(cache->map, key, hash, eq)
+		: map_lookup_hashed_ex(cache->map, key, hash, eq_ex, arg);
+	if (pair == NULL) return NULL;
+	struct mcache_entry *entry = pair->value;
+	touch(cache, entry);
+	return &entry->pair;
+}
+
+enum map_err
+put(struct mcache *cache, void *key, void *value, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	struct map_pair *pair = eq != NULL
+		? map_lookup_hashed(cache->map, key, hash, eq)
+		: map_lookup_hashed_ex(cache->map, key, hash, eq_ex, arg);
+	if (pair != NULL) {
+		struct mcache_entry *entry = pair->value;
+		struct map_pair old = entry->pair;
+		entry->pair.key = pair->key = key;
+		entry->pair.value = value;
+		touch(cache, entry);
+		if (cache->on_evict != NULL) cache->on_evict(&old);
+		return MAPE_OK;
+	}
+
+	/* The key goes into the map before anything is evicted, so that a put
+	 * that fails loses no pair. */
+	struct mcache_entry *entry = cache->free_entries;
+	if (entry == NULL) entry = choose_victim(cache);
+	if (map_insert_hashed(cache->map, key, entry, hash, NULL) != MAPE_OK)
+		return MAPE_NOMEM;
+	if (entry == cache->free_entries) cache->free_entries = entry->next;
+	else evict(cache, entry);
+	entry->pair.key = key;
+	entry->pair.value = value;
+	entry->hash = hash;
+	entry->used = 1;
+	/* Only hits count, so that a scan of keys used once doesn't push out
+	 * the ones used over and over. */
+	entry->referenced = 0;
+	if (cache->policy == MCACHE_LRU) {
+		entry->prev = NULL;
+		entry->next = cache->head;
+		if (cache->head != NULL) cache->head->prev = entry;
+		else cache->tail = entry;
+		cache->head = entry;
+	}
+	cache->size++;
+	return MAPE_OK;
+}
+
+struct map_pair *
+remove_pair(struct mcache *cache, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg, struct map_pair *out)
+{
+	struct map_pair removed;
+	struct map_pair *pair = eq != NULL
+		? map_remove_copy_hashed(cache->map, key, hash, eq, &removed)
+		: map_remove_copy_hashed_ex(cache->map, key, hash, eq_ex, arg, &removed);
+	if (pair == NULL) return NULL;
+	struct mcache_entry *entry = removed.value;
+	*out = entry->pair;
+	unlink_entry(cache, entry);
+	release_entry(cache, entry);
+	cache->size--;
+	return out;
+}
+
+/* Mark an entry as used just now. */
+void
+touch(struct mcache *cache, struct mcache_entry *entry)
+{
+	if (cache->policy == MCACHE_CLOCK) {
+		entry->referenced = 1;
+		return;
+	}
+	if (cache->head == entry) return;
+	unlink_entry(cache, entry);
+	entry->prev = NULL;
+	entry->next = cache->head;
+	cache->head->prev = entry;
+	cache->head = entry;
+}
+
+/* Take an entry out of the recency list. */
+void
+unlink_entry(struct mcache *cache, struct mcache_entry *entry)
+{
+	if (cache->policy != MCACHE_LRU) return;
+	if (entry->prev != NULL) entry->prev->next = entry->next;
+	else cache->head = entry->next;
+	if (entry->next != NULL) entry->next->prev = entry->prev;
+	else cache->tail = entry->prev;
+}
+
+/* Return the used entry whose pair is to be evicted next. */
+struct mcache_entry *
+choose_victim(struct mcache *cache)
+{
+	if (cache->policy == MCACHE_LRU) return cache->tail;
+
+	/* Give every referenced entry a second chance. */
+	while (1) {
+		struct mcache_entry *res = cache->entries + cache->hand;
+		cache->hand = (cache->hand + 1) % cache->capacity;
+		if (!res->referenced) return res;
+		res->referenced = 0;
+	}
+}
+
+/* Evict the pair of a used entry, leaving the entry to be reused. */
+void
+evict(struct mcache *cache, struct mcache_entry *entry)
+{
+	struct map_pair removed;
+	map_remove_copy_hashed_ex(cache->map, entry->pair.key, entry->hash, &same_key,
+			NULL, &removed);
+	unlink_entry(cache, entry);
+	entry->used = 0;
+	cache->size--;
+	if (cache->on_evict != NULL) cache->on_evict(&entry->pair);
+}
+
+void
+release_entry(struct mcache *cache, struct mcache_entry *entry)
+{
+	entry->used = 0;
+	entry->next = cache->free_entries;
+	cache->free_entries = entry;
+}
+
+/* The map holds the very key pointers the entries do. */
+int
+same_key(void *key1, void *key2, void *arg)
+{
+	return key1 == key2;
+}
@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "map.h"
+#include "omap.h"
+
+/* The number of slots of the smallest table. */
+#define MIN_SLOTS 8
+
+/* ---------- helper function declarations ---------- */
+
+static struct omap *
+create_omap(size_t num_pairs, key_size_fn key_size, size_t fixed_key_size);
+
+static size_t
+hash_key(struct omap *, void *key);
+
+static size_t
+capacity_for(size_t num_slots);
+
+static unsigned int
+width_for(size_t capacity);
+
+static size_t
+index_get(struct omap *, size_t slot);
+
+static void
+index_set(struct omap *, size_t slot, size_t value);
+
+static struct omap_entry *
+find(struct omap *, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg);
+
+static void
+place(struct omap *, size_t ix);
+
+static int
+resize(struct omap *, size_t num_pairs);
+
+static enum map_err
+insert(struct omap *, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg);
+
+static struct map_pair *
+remove_pair(struct omap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg,
+		struct map_pair *out);
+
+static struct map_pair *
+lookup(struct omap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg);
+
+/* ---------- creation ---------- */
+
+struct omap *
+omap_create(size_t num_pairs, key_size_fn key_size)
+{
+	return create_omap(num_pairs, key_size, 0);
+}
+
+struct omap *
+omap_create_fs(size_t num_pairs, size_t key_size)
+{
+	return create_omap(num_pairs, NULL, key_size);
+}
+
+/* ---------- destruction ---------- */
+
+void
+omap_destroy(struct omap *map)
+{
+	free(map->entries);
+	free(map->index);
+	free(map);
+}
+
+void
+omap_destroy_ex(struct omap *map, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < map->num_entries; i++)
+		if (map->entries[i].pair.key != NULL)
+			pair_destroyer(&map->entries[i].pair);
+	omap_destroy(map);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+omap_insert(struct omap *map, void *key, void *value, key_eq_fn eq)
+{
+	return insert(map, key, value, eq, NULL, NULL);
+}
+
+enum map_err
+omap_insert_ex(struct omap *map, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return insert(map, key, value, NULL, eq, arg);
+}
+
+struct map_pair *
+omap_remove(struct omap *map, void *key, key_eq_fn eq, struct map_pair *out)
+{
+	return remove_pair(map, key, eq, NULL, NULL, out);
+}
+
+struct map_pair *
+omap_remove_ex(struct omap *map, void *key, key_eq_ex_fn eq, void *arg,
+		struct map_pair *out)
+{
+	return remove_pair(map, key, NULL, eq, arg, out);
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+omap_lookup(struct omap *map, void *key, key_eq_fn eq)
+{
+	return lookup(map, key, eq, NULL, NULL);
+}
+
+struct map_pair *
+omap_lookup_ex(struct omap *map, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return lookup(map, key, NULL, eq, eq_arg);
+}
+
+extern size_t
+omap_size(struct omap *map);
+
+/* ---------- iteration ---------- */
+
+void
+omap_iter_init(struct omap_iter *iter, struct omap *map)
+{
+	iter->map = map;
+	iter->ix = 0;
+}
+
+struct map_pair *
+omap_iter_next(struct omap_iter *iter)
+{
+	struct omap *map = iter->map;
+	for (; iter->ix < map->num_entries; iter->ix++)
+		if (map->entries[iter->ix].pair.key != NULL)
+			return &map->entries[iter->ix++].pair;
+	return NULL;
+}
+
+/* ---------- helper functions ---------- */
+
+struct omap *
+create_omap(size_t num_pairs, key_size_fn key_size, size_t fixed_key_size)
+{
+	struct omap *res = malloc(sizeof(struct omap));
+	if (res == NULL) return NULL;
+
+	res->entries = NULL;
+	res->index = NULL;
+	res->num_entries = res->capacity = res->num_slots = 0;
+	res->size = 0;
+	if (!resize(res, num_pairs)) {
+		free(res);
+		return NULL;
+	}
+	res->key_size = key_size;
+	res->fixed_key_size = fixed_key_size;
+	res->hash = &hash_wy;
+	res->seed = hash_random_seed();
+	return res;
+}
+
+size_t
+hash_key(struct omap *map, void *key)
+{
+	size_t size = map->key_size != NULL ? map->key_size(key) : map->fixed_key_size;
+	return map->hash(key, size, map->seed);
+}
+
+/* The table grows when two thirds of its slots are taken, which keeps probes
+ * short while indices cost so little that empty slots don't matter much.
+ * Computed without overflowing. */
+size_t
+capacity_for(size_t num_slots)
+{
+	return num_slots / 3 * 2 + num_slots % 3 * 2 / 3;
+}
+
+/* Slots hold indices up to the capacity, which 0 doesn't count towards. */
+unsigned int
+width_for(size_t capacity)
+{
+	if (capacity <= UINT8_MAX) return 1;
+	if (capacity <= UINT16_MAX) return 2;
+	if (capacity <= UINT32_MAX) return 4;
+	return 8;
+}
+
+size_t
+index_get(struct omap *map, size_t slot)
+{
+	switch (map->index_width) {
+		case 1: return ((uint8_t *)map->index)[slot];
+		case 2: return ((uint16_t *)map->index)[slot];
+		case 4: return ((uint32_t *)map->index)[slot];
+		default: return ((uint64_t *)map->index)[slot];
+	}
+}
+
+void
+index_set(struct omap *map, size_t slot, size_t value)
+{
+	switch (map->index_width) {
+		case 1: ((uint8_t *)map->index)[slot] = value; break;
+		case 2: ((uint16_t *)map->index)[slot] = value; break;
+		case 4: ((uint32_t *)map->index)[slot] = value; break;
+		default: ((uint64_t *)map->index)[slot] = value; break;
+	}
+}
+
+/* There are more slots than entries, so a probe always reaches an empty
+ * one. Hashes are compared before keys, and removed entries are skipped. */
+struct omap_entry *
+find(struct omap *map, void *key, size_t hash, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg)
+{
+	size_t mask = map->num_slots - 1;
+	for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+		size_t ix = index_get(map, slot);
+		if (ix == 0) return NULL;
+		struct omap_entry *entry = map->entries + ix - 1;
+		if (entry->hash != hash || entry->pair.key == NULL) continue;
+		if (eq != NULL ? eq(entry->pair.key, key) : eq_ex(entry->pair.key, key, arg))
+			return entry;
+	}
+}
+
+/* Put the index of entry 'ix' into the first empty slot of its probe. */
+void
+place(struct omap *map, size_t ix)
+{
+	size_t mask = map->num_slots - 1;
+	size_t slot = map->entries[ix].hash & mask;
+	while (index_get(map, slot) != 0)
+		slot = (slot + 1) & mask;
+	index_set(map, slot, ix + 1);
+}
+
+/* Make a table with room for 'num_pairs' pairs, moving the live entries into
+ * a new array in order. Growing and dropping removed entries are the same
+ * thing. On failure, the map is left as it was. */
+int
+resize(struct omap *map, size_t num_pairs)
+{
+	size_t num_slots = MIN_SLOTS;
+	while (capacity_for(num_slots) < num_pairs) num_slots *= 2;
+	size_t capacity = capacity_for(num_slots);
+	unsigned int width = width_for(capacity);
+
+	void *index = calloc(num_slots, width);
+	struct omap_entry *entries = malloc(capacity * sizeof(struct omap_entry));
+	if (index == NULL || entries == NULL) {
+		free(index);
+		free(entries);
+		return 0;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < map->num_entries; i++)
+		if (map->entries[i].pair.key != NULL)
+			entries[n++] = map->entries[i];
+	free(map->entries);
+	free(map->index);
+	map->entries = entries;
+	map->num_entries = n;
+	map->capacity = capacity;
+	map->index = index;
+	map->num_slots = num_slots;
+	map->index_width = width;
+	for (size_t i = 0; i < n; i++)
+		place(map, i);
+	return 1;
+}
+
+/* Once the entries run out, the map is rebuilt with room for twice the pairs
+ * it holds: with few removed entries that's growing, with many it's
+ * packing them. */
+enum map_err
+insert(struct omap *map, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg)
+{
+	size_t hash = hash_key(map, key);
+	if ((eq != NULL || eq_ex != NULL) && find(map, key, hash, eq, eq_ex, arg) != NULL)
+		return MAPE_EXIST;
+	if (map->num_entries == map->capacity && !resize(map, 2 * map->size + 1))
+		return MAPE_NOMEM;
+
+	size_t ix = map->num_entries++;
+	map->entries[ix].pair.key = key;
+	map->entries[ix].pair.value = value;
+	map->entries[ix].hash = hash;
+	place(map, ix);
+	map->size++;
+	return MAPE_OK;
+}
+
+/* The entry stays where it is, so that the order of the others and the
+ * probes passing its slot are kept. */
+struct map_pair *
+remove_pair(struct omap *map, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg,
+		struct map_pair *out)
+{
+	struct omap_entry *entry = find(map, key, hash_key(map, key), eq, eq_ex, arg);
+	if (entry == NULL) return NULL;
+
+	*out = entry->pair;
+	entry->pair.key = NULL;
+	map->size--;
+	return out;
+}
+
+struct map_pair *
+lookup(struct omap *map, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg)
+{
+	struct omap_entry *entry = find(map, key, hash_key(map, key), eq, eq_ex, arg);
+	return entry == NULL ? NULL : &entry->pair;
+}
@@ -0,0 +1,515 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "map.h"
+#include "rmap.h"
+
+/* The map is expanded when there are more pairs than this many times the
+ * number of buckets. */
+#define CRIT_LOAD_FACTOR 0.75
+
+/* ---------- helper function declarations ---------- */
+
+static struct rmap *
+create_rmap(size_t num_buckets, key_size_fn key_size, size_t fixed_key_size);
+
+static struct rmap_table *
+create_table(size_t num_buckets);
+
+static void
+free_table(struct rmap_table *, void (*pair_destroyer)(void *pair));
+
+static void
+free_node(struct rmap_node *);
+
+static size_t
+hash_key(struct rmap *, void *key);
+
+static enum map_err
+insert(struct rmap *, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, int replace, void (*pair_destroyer)(void *pair));
+
+static int
+remove_key(struct rmap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, void (*pair_destroyer)(void *pair));
+
+static struct map_pair *
+lookup(struct rmap *, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg);
+
+static _Atomic(struct rmap_node *) *
+find_link(struct rmap_table *, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg);
+
+static int
+expand(struct rmap *);
+
+static uint64_t
+next_epoch(struct rmap *);
+
+static void
+retire_node(struct rmap *, struct rmap_node *, uint64_t epoch,
+		void (*pair_destroyer)(void *pair));
+
+static uint64_t
+min_reader_epoch(struct rmap *);
+
+static void
+reclaim(struct rmap *, uint64_t safe_epoch);
+
+/* ---------- creation ---------- */
+
+struct rmap *
+rmap_create(size_t num_buckets, key_size_fn key_size)
+{
+	return create_rmap(num_buckets, key_size, 0);
+}
+
+struct rmap *
+rmap_create_fs(size_t num_buckets, size_t key_size)
+{
+	return create_rmap(num_buckets, NULL, key_size);
+}
+
+/* ---------- destruction ---------- */
+
+void
+rmap_destroy(struct rmap *rmap)
+{
+	rmap_destroy_ex(rmap, NULL);
+}
+
+void
+rmap_destroy_ex(struct rmap *rmap, void (*pair_destroyer)(void *pair))
+{
+	reclaim(rmap, RMAP_OFFLINE);
+	free_table(atomic_load_explicit(&rmap->table, memory_order_relaxed),
+			pair_destroyer);
+	pthread_mutex_destroy(&rmap->lock);
+	free(rmap);
+}
+
+/* ---------- readers ---------- */
+
+struct rmap_reader *
+rmap_reader_register(struct rmap *rmap)
+{
+	struct rmap_reader *res = aligned_alloc(_Alignof(struct rmap_reader),
+			sizeof(struct rmap_reader));
+	if (res == NULL) return NULL;
+	atomic_init(&res->epoch, RMAP_OFFLINE);
+	res->rmap = rmap;
+
+	pthread_mutex_lock(&rmap->lock);
+	res->next = rmap->readers;
+	rmap->readers = res;
+	pthread_mutex_unlock(&rmap->lock);
+
+	rmap_reader_online(res);
+	return res;
+}
+
+void
+rmap_reader_unregister(struct rmap_reader *reader)
+{
+	struct rmap *rmap = reader->rmap;
+
+	pthread_mutex_lock(&rmap->lock);
+	struct rmap_reader **link = &rmap->readers;
+	while (*link != reader)
+		link = &(*link)->next;
+	*link = reader->next;
+	pthread_mutex_unlock(&rmap->lock);
+
+	free(reader);
+}
+
+void
+rmap_quiescent(struct rmap_reader *reader)
+{
+	/* Seeing a new epoch also means seeing everything unlinked before it,
+	 * so the store doesn't need a full fence. */
+	uint64_t epoch = atomic_load_explicit(&reader->rmap->epoch, memory_order_acquire);
+	atomic_store_explicit(&reader->epoch, epoch, memory_order_release);
+}
+
+void
+rmap_reader_offline(struct rmap_reader *reader)
+{
+	atomic_store_explicit(&reader->epoch, RMAP_OFFLINE, memory_order_release);
+}
+
+void
+rmap_reader_online(struct rmap_reader *reader)
+{
+	uint64_t epoch = atomic_load_explicit(&reader->rmap->epoch, memory_order_acquire);
+	atomic_store_explicit(&reader->epoch, epoch, memory_order_relaxed);
+	/* A writer that has missed this store must not be missed by the
+	 * lookups that follow. Pairs with the fence in 'next_epoch'. */
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* ---------- manipulation ---------- */
+
+enum map_err
+rmap_insert(struct rmap *rmap, void *key, void *value, key_eq_fn eq)
+{
+	return insert(rmap, key, value, eq, NULL, NULL, 0, NULL);
+}
+
+enum map_err
+rmap_insert_ex(struct rmap *rmap, void *key, void *value, key_eq_ex_fn eq, void *arg)
+{
+	return insert(rmap, key, value, NULL, eq, arg, 0, NULL);
+}
+
+enum map_err
+rmap_replace(struct rmap *rmap, void *key, void *value, key_eq_fn eq,
+		void (*pair_destroyer)(void *pair))
+{
+	return insert(rmap, key, value, eq, NULL, NULL, 1, pair_destroyer);
+}
+
+enum map_err
+rmap_replace_ex(struct rmap *rmap, void *key, void *value, key_eq_ex_fn eq, void *arg,
+		void (*pair_destroyer)(void *pair))
+{
+	return insert(rmap, key, value, NULL, eq, arg, 1, pair_destroyer);
+}
+
+int
+rmap_remove(struct rmap *rmap, void *key, key_eq_fn eq,
+		void (*pair_destroyer)(void *pair))
+{
+	return remove_key(rmap, key, eq, NULL, NULL, pair_destroyer);
+}
+
+int
+rmap_remove_ex(struct rmap *rmap, void *key, key_eq_ex_fn eq, void *arg,
+		void (*pair_destroyer)(void *pair))
+{
+	return remove_key(rmap, key, NULL, eq, arg, pair_destroyer);
+}
+
+void
+rmap_synchronize(struct rmap *rmap)
+{
+	pthread_mutex_lock(&rmap->lock);
+	uint64_t epoch = next_epoch(rmap);
+	while (min_reader_epoch(rmap) < epoch)
+		sched_yield();
+	reclaim(rmap, epoch);
+	pthread_mutex_unlock(&rmap->lock);
+}
+
+/* ---------- information retrieval ---------- */
+
+struct map_pair *
+rmap_lookup(struct rmap *rmap, void *key, key_eq_fn eq)
+{
+	return lookup(rmap, key, eq, NULL, NULL);
+}
+
+struct map_pair *
+rmap_lookup_ex(struct rmap *rmap, void *key, key_eq_ex_fn eq, void *eq_arg)
+{
+	return lookup(rmap, key, NULL, eq, eq_arg);
+}
+
+size_t
+rmap_size(struct rmap *rmap)
+{
+	pthread_mutex_lock(&rmap->lock);
+	size_t res = rmap->size;
+	pthread_mutex_unlock(&rmap->lock);
+	return res;
+}
+
+/* ---------- helper functions ---------- */
+
+struct rmap *
+create_rmap(size_t num_buckets, key_size_fn key_size, size_t fixed_key_size)
+{
+	struct rmap *res = malloc(sizeof(struct rmap));
+	if (res == NULL) return NULL;
+
+	size_t n = 2;
+	while (n < num_buckets) n <<= 1;
+	struct rmap_table *table = create_table(n);
+	if (table == NULL) {
+		free(res);
+		return NULL;
+	}
+	if (pthread_mutex_init(&res->lock, NULL) != 0) {
+		free(table);
+		free(res);
+		return NULL;
+	}
+
+	atomic_init(&res->table, table);
+	atomic_init(&res->epoch, 1);
+	res->readers = NULL;
+	res->retired_nodes = NULL;
+	res->retired_tables = NULL;
+	res->size = 0;
+	res->key_size = key_size;
+	res->fixed_key_size = fixed_key_size;
+	res->hash = &hash_wy;
+	res->seed = hash_random_seed();
+	return res;
+}
+
+struct rmap_table *
+create_table(size_t num_buckets)
+{
+	struct rmap_table *res = malloc(sizeof(struct rmap_table)
+			+ num_buckets * sizeof(res->buckets[0]));
+	if (res == NULL) return NULL;
+	res->retired_next = NULL;
+	res->retired_epoch = 0;
+	res->num_buckets = num_buckets;
+	for (size_t i = 0; i < num_buckets; i++)
+		atomic_init(&res->buckets[i], NULL);
+	return res;
+}
+
+/* Free 'table' and the nodes still linked into it, but not the ones unlinked
+ * before it was retired, as they are retired on their own. */
+void
+free_table(struct rmap_table *table, void (*pair_destroyer)(void *pair))
+{
+	for (size_t i = 0; i < table->num_buckets; i++) {
+		struct rmap_node *node = atomic_load_explicit(table->buckets + i,
+				memory_order_relaxed);
+		while (node != NULL) {
+			struct rmap_node *next = atomic_load_explicit(&node->next,
+					memory_order_relaxed);
+			if (pair_destroyer != NULL) pair_destroyer(&node->pair);
+			free(node);
+			node = next;
+		}
+	}
+	free(table);
+}
+
+void
+free_node(struct rmap_node *node)
+{
+	if (node->pair_destroyer != NULL) node->pair_destroyer(&node->pair);
+	free(node);
+}
+
+size_t
+hash_key(struct rmap *rmap, void *key)
+{
+	size_t size = rmap->key_size != NULL ? rmap->key_size(key) : rmap->fixed_key_size;
+	return rmap->hash(key, size, rmap->seed);
+}
+
+enum map_err
+insert(struct rmap *rmap, void *key, void *value, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, int replace, void (*pair_destroyer)(void *pair))
+{
+	size_t hash = hash_key(rmap, key);
+	struct rmap_node *node = malloc(sizeof(struct rmap_node));
+	if (node == NULL) return MAPE_NOMEM;
+	node->hash = hash;
+	node->pair.key = key;
+	node->pair.value = value;
+	node->retired_next = NULL;
+	node->retired_epoch = 0;
+	node->pair_destroyer = NULL;
+
+	pthread_mutex_lock(&rmap->lock);
+	struct rmap_table *table = atomic_load_explicit(&rmap->table, memory_order_relaxed);
+	_Atomic(struct rmap_node *) *link = find_link(table, key, hash, eq, eq_ex, arg);
+	if (link != NULL && !replace) {
+		pthread_mutex_unlock(&rmap->lock);
+		free(node);
+		return MAPE_EXIST;
+	}
+
+	if (link != NULL) {
+		/* Readers see either the old node or the new one, both of which
+		 * lead to the rest of the chain. */
+		struct rmap_node *old = atomic_load_explicit(link, memory_order_relaxed);
+		atomic_init(&node->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+		atomic_store_explicit(link, node, memory_order_release);
+		retire_node(rmap, old, next_epoch(rmap), pair_destroyer);
+	} else {
+		if (rmap->size + 1 > CRIT_LOAD_FACTOR * table->num_buckets) {
+			if (!expand(rmap)) {
+				pthread_mutex_unlock(&rmap->lock);
+				free(node);
+				return MAPE_NOMEM;
+			}
+			table = atomic_load_explicit(&rmap->table, memory_order_relaxed);
+		}
+		_Atomic(struct rmap_node *) *bucket =
+			table->buckets + (hash & (table->num_buckets - 1));
+		atomic_init(&node->next, atomic_load_explicit(bucket, memory_order_relaxed));
+		atomic_store_explicit(bucket, node, memory_order_release);
+		rmap->size++;
+	}
+	reclaim(rmap, min_reader_epoch(rmap));
+	pthread_mutex_unlock(&rmap->lock);
+	return MAPE_OK;
+}
+
+int
+remove_key(struct rmap *rmap, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex,
+		void *arg, void (*pair_destroyer)(void *pair))
+{
+	size_t hash = hash_key(rmap, key);
+
+	pthread_mutex_lock(&rmap->lock);
+	struct rmap_table *table = atomic_load_explicit(&rmap->table, memory_order_relaxed);
+	_Atomic(struct rmap_node *) *link = find_link(table, key, hash, eq, eq_ex, arg);
+	if (link == NULL) {
+		pthread_mutex_unlock(&rmap->lock);
+		return 0;
+	}
+	/* The node keeps pointing to the rest of the chain, so readers that are
+	 * standing on it right now can carry on. */
+	struct rmap_node *node = atomic_load_explicit(link, memory_order_relaxed);
+	atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed),
+			memory_order_release);
+	rmap->size--;
+	retire_node(rmap, node, next_epoch(rmap), pair_destroyer);
+	reclaim(rmap, min_reader_epoch(rmap));
+	pthread_mutex_unlock(&rmap->lock);
+	return 1;
+}
+
+struct map_pair *
+lookup(struct rmap *rmap, void *key, key_eq_fn eq, key_eq_ex_fn eq_ex, void *arg)
+{
+	size_t hash = hash_key(rmap, key);
+	struct rmap_table *table = atomic_load_explicit(&rmap->table, memory_order_acquire);
+	struct rmap_node *node = atomic_load_explicit(
+			table->buckets + (hash & (table->num_buckets - 1)),
+			memory_order_acquire);
+	while (node != NULL) {
+		if (node->hash == hash && (eq != NULL
+				? eq(node->pair.key, key)
+				: eq_ex(node->pair.key, key, arg)))
+			return &node->pair;
+		node = atomic_load_explicit(&node->next, memory_order_acquire);
+	}
+	return NULL;
+}
+
+/* Writers only. Return the link pointing to the node with 'key', or NULL if
+ * there is no such node. */
+_Atomic(struct rmap_node *) *
+find_link(struct rmap_table *table, void *key, size_t hash, key_eq_fn eq,
+		key_eq_ex_fn eq_ex, void *arg)
+{
+	_Atomic(struct rmap_node *) *link = table->buckets + (hash & (table->num_buckets - 1));
+	struct rmap_node *node;
+	while ((node = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+		if (node->hash == hash && (eq != NULL
+				? eq(node->pair.key, key)
+				: eq_ex(node->pair.key, key, arg)))
+			return link;
+		link = &node->next;
+	}
+	return NULL;
+}
+
+/* Readers may be walking the old table, so it's copied as a whole, nodes
+ * included, and retired. If there's not enough memory, the map is left as it
+ * was and 0 is returned, as 'map_expand' does. */
+int
+expand(struct rmap *rmap)
+{
+	struct rmap_table *old = atomic_load_explicit(&rmap->table, memory_order_relaxed);
+	struct rmap_table *new = create_table(old->num_buckets * 2);
+	if (new == NULL) return 0;
+	size_t mask = new->num_buckets - 1;
+
+	for (size_t i = 0; i < old->num_buckets; i++) {
+		struct rmap_node *node = atomic_load_explicit(old->buckets + i,
+				memory_order_relaxed);
+		for (; node != NULL; node = atomic_load_explicit(&node->next,
+					memory_order_relaxed)) {
+			struct rmap_node *copy = malloc(sizeof(struct rmap_node));
+			if (copy == NULL) {
+				free_table(new, NULL);
+				return 0;
+			}
+			*copy = (struct rmap_node){ .hash = node->hash, .pair = node->pair };
+			_Atomic(struct rmap_node *) *bucket = new->buckets + (node->hash & mask);
+			atomic_init(&copy->next, atomic_load_explicit(bucket, memory_order_relaxed));
+			atomic_store_explicit(bucket, copy, memory_order_relaxed);
+		}
+	}
+
+	atomic_store_explicit(&rmap->table, new, memory_order_release);
+	old->retired_epoch = next_epoch(rmap);
+	old->retired_next = rmap->retired_tables;
+	rmap->retired_tables = old;
+	return 1;
+}
+
+/* Start a new epoch after unlinking something, and return it. Whatever has
+ * been unlinked is safe to free once every online reader has seen it. */
+uint64_t
+next_epoch(struct rmap *rmap)
+{
+	uint64_t res = atomic_fetch_add_explicit(&rmap->epoch, 1, memory_order_acq_rel) + 1;
+	/* Pairs with the fence in 'rmap_reader_online'. */
+	atomic_thread_fence(memory_order_seq_cst);
+	return res;
+}
+
+void
+retire_node(struct rmap *rmap, struct rmap_node *node, uint64_t epoch,
+		void (*pair_destroyer)(void *pair))
+{
+	node->retired_epoch = epoch;
+	node->pair_destroyer = pair_destroyer;
+	node->retired_next = rmap->retired_nodes;
+	rmap->retired_nodes = node;
+}
+
+uint64_t
+min_reader_epoch(struct rmap *rmap)
+{
+	uint64_t res = RMAP_OFFLINE;
+	for (struct rmap_reader *reader = rmap->readers; reader != NULL;
+			reader = reader->next) {
+		uint64_t epoch = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+		if (epoch < res) res = epoch;
+	}
+	return res;
+}
+
+/* Free everything retired no later than 'safe_epoch'. */
+void
+reclaim(struct rmap *rmap, uint64_t safe_epoch)
+{
+	struct rmap_node **node_link = &rmap->retired_nodes;
+	while (*node_link != NULL) {
+		struct rmap_node *node = *node_link;
+		if (node->retired_epoch <= safe_epoch) {
+			*node_link = node->retired_next;
+			free_node(node);
+		} else {
+			node_link = &node->retired_next;
+		}
+	}
+
+	struct rmap_table **table_link = &rmap->retired_tables;
+	while (*table_link != NULL) {
+		struct rmap_table *table = *table_link;
+		if (table->retired_epoch <= safe_epoch) {
+			*table_link = table->retired_next;
+			free_table(table, NULL);
+		} else {
+			table_link = &table->retired_next;
+		}
+	}
+}
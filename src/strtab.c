@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "map.h"
+#include "strtab.h"
+
+/* Strings are copied into chunks of this many bytes. Longer strings than a
+ * quarter of that get chunks of their own, so as not to waste the rest of the
+ * current one. */
+#define CHUNK_SIZE (64 * 1024)
+
+/* Every string is preceded by its length, and strings are aligned for it. */
+#define LEN_SIZE sizeof(size_t)
+
+struct strtab_chunk
+{
+	struct strtab_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+/* ---------- helper function declarations ---------- */
+
+static size_t
+str_size(void *str);
+
+static int
+str_eq(void *interned, void *str, void *len);
+
+static size_t
+hash_str(struct strtab *, const char *str, size_t len);
+
+static size_t
+interned_len(const char *interned);
+
+static char *
+chunk_alloc(struct strtab *, size_t size);
+
+/* ---------- creation ---------- */
+
+struct strtab *
+strtab_create(size_t num_strings)
+{
+	struct strtab *res = malloc(sizeof(struct strtab));
+	if (res == NULL) return NULL;
+
+	res->map = map_create(0, &str_size, MAPF_OPEN);
+	if (res->map == NULL) {
+		free(res);
+		return NULL;
+	}
+	if (!map_reserve(res->map, num_strings)) {
+		map_destroy(res->map);
+		free(res);
+		return NULL;
+	}
+	res->chunks = NULL;
+	res->num_bytes = 0;
+	return res;
+}
+
+/* ---------- destruction ---------- */
+
+void
+strtab_destroy(struct strtab *tab)
+{
+	struct strtab_chunk *chunk = tab->chunks;
+	while (chunk != NULL) {
+		struct strtab_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	map_destroy(tab->map);
+	free(tab);
+}
+
+/* ---------- manipulation ---------- */
+
+const char *
+strtab_intern(struct strtab *tab, const char *str)
+{
+	return strtab_intern_n(tab, str, strlen(str));
+}
+
+/* A new string is inserted with the caller's pointer as its key, which is
+ * then replaced by the copy: the map is probed once either way. */
+const char *
+strtab_intern_n(struct strtab *tab, const char *str, size_t len)
+{
+	size_t hash = hash_str(tab, str, len);
+	struct map_pair *pair;
+	int inserted;
+	if (map_upsert_hashed_ex(tab->map, (void *)str, hash, &str_eq, &len, &pair,
+				&inserted) != MAPE_OK)
+		return NULL;
+	if (!inserted) return pair->key;
+
+	size_t size = (LEN_SIZE + len + 1 + LEN_SIZE - 1) & ~(LEN_SIZE - 1);
+	char *copy = chunk_alloc(tab, size);
+	if (copy == NULL) {
+		/* The key is still the caller's pointer, which has no length in
+		 * front of it to compare. */
+		struct map_pair removed;
+		map_remove_copy_hashed(tab->map, (void *)str, hash, &strtab_ptr_eq, &removed);
+		return NULL;
+	}
+	memcpy(copy, &len, LEN_SIZE);
+	copy += LEN_SIZE;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	pair->key = copy;
+	tab->num_bytes += size;
+	return copy;
+}
+
+/* ---------- information retrieval ---------- */
+
+const char *
+strtab_lookup(struct strtab *tab, const char *str)
+{
+	return strtab_lookup_n(tab, str, strlen(str));
+}
+
+const char *
+strtab_lookup_n(struct strtab *tab, const char *str, size_t len)
+{
+	struct map_pair *pair = map_lookup_hashed_ex(tab->map, (void *)str,
+			hash_str(tab, str, len), &str_eq, &len);
+	return pair == NULL ? NULL : pair->key;
+}
+
+extern size_t
+strtab_size(struct strtab *tab);
+
+uint64_t
+strtab_ptr_hash(void *data, size_t size, uint64_t seed)
+{
+	return hash_word((uintptr_t)data, seed);
+}
+
+int
+strtab_ptr_eq(void *a, void *b)
+{
+	return a == b;
+}
+
+/* ---------- helper functions ---------- */
+
+/* Only used by the map to hash interned strings again, which open addressing
+ * maps don't do. */
+size_t
+str_size(void *str)
+{
+	return interned_len(str);
+}
+
+/* 'str' may be neither terminated nor free of NULs, so the lengths are
+ * compared first, and then all the bytes. */
+int
+str_eq(void *interned, void *str, void *len)
+{
+	size_t n = *(size_t *)len;
+	return interned_len(interned) == n && memcmp(interned, str, n) == 0;
+}
+
+size_t
+hash_str(struct strtab *tab, const char *str, size_t len)
+{
+	return tab->map->hash((void *)str, len, tab->map->seed);
+}
+
+size_t
+interned_len(const char *interned)
+{
+	size_t res;
+	memcpy(&res, interned - LEN_SIZE, LEN_SIZE);
+	return res;
+}
+
+/* Long strings go into chunks of their own behind the current one. */
+char *
+chunk_alloc(struct strtab *tab, size_t size)
+{
+	struct strtab_chunk *chunk = tab->chunks;
+	if (chunk != NULL && chunk->size - chunk->used >= size) {
+		char *res = chunk->data + chunk->used;
+		chunk->used += size;
+		return res;
+	}
+
+	int own = size > CHUNK_SIZE / 4;
+	size_t chunk_size = own ? size : CHUNK_SIZE;
+	struct strtab_chunk *new = malloc(sizeof(struct strtab_chunk) + chunk_size);
+	if (new == NULL) return NULL;
+	new->size = chunk_size;
+	new->used = size;
+	if (own && chunk != NULL) {
+		new->next = chunk->next;
+		chunk->next = new;
+	} else {
+		new->next = chunk;
+		tab->chunks = new;
+	}
+	return new->data;
+}
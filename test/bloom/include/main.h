@@ -0,0 +1,7 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+size_t
+int_size(void *i);
+
+#endif /* MAIN_H */
@@ -0,0 +1,106 @@
+#include <check.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "bloom.h"
+
+#include "main.h"
+
+#define NUM_KEYS 10000
+
+static int keys[2 * NUM_KEYS];
+
+START_TEST(test_contains)
+{
+	struct bloom *bloom = bloom_create_fs(NUM_KEYS, 0.01, sizeof(int));
+	for (int i = 0; i < 2 * NUM_KEYS; i++) keys[i] = i;
+
+	for (int i = 0; i < NUM_KEYS; i++)
+		bloom_add(bloom, keys + i);
+	ck_assert_msg(bloom_count(bloom) == NUM_KEYS, "Wrong count of keys");
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg(bloom_contains(bloom, keys + i), "Key %d is missing", i);
+
+	/* The rate should be close to 1%, blocking costs a bit on top of that. */
+	int false_positives = 0;
+	for (int i = NUM_KEYS; i < 2 * NUM_KEYS; i++)
+		false_positives += bloom_contains(bloom, keys + i) != 0;
+	ck_assert_msg(false_positives < NUM_KEYS / 50,
+			"Too many false positives: %d", false_positives);
+
+	bloom_clear(bloom);
+	ck_assert_msg(bloom_count(bloom) == 0, "Clearing kept the count");
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg(!bloom_contains(bloom, keys + i), "Key %d is still there", i);
+
+	bloom_destroy(bloom);
+}
+END_TEST;
+
+START_TEST(test_hashed)
+{
+	struct bloom *bloom = bloom_create(100, 0.001, &int_size);
+	for (int i = 0; i < 2 * NUM_KEYS; i++) keys[i] = i;
+
+	/* Hashes computed elsewhere work as well, even past the capacity. */
+	for (int i = 0; i < NUM_KEYS; i++)
+		bloom_add_hashed(bloom, hash_word(i, 0));
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg(bloom_contains_hashed(bloom, hash_word(i, 0)),
+				"Hash of %d is missing", i);
+	ck_assert_msg(bloom_hash(bloom, keys + 1) == bloom_hash(bloom, keys + 1),
+			"Hashes differ");
+
+	bloom_destroy(bloom);
+}
+END_TEST;
+
+START_TEST(test_invalid)
+{
+	double rates[] = { 0, -0.5, 1, 2, NAN };
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		errno = 0;
+		ck_assert_msg(bloom_create_fs(100, rates[i], sizeof(int)) == NULL
+				&& errno == EINVAL, "Created a filter with rate %g", rates[i]);
+	}
+}
+END_TEST;
+
+Suite *
+bloom_suite(void)
+{
+	Suite *res = suite_create("Bloom filter");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_contains);
+	tcase_add_test(core_tests, test_hashed);
+	tcase_add_test(core_tests, test_invalid);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = bloom_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
@@ -0,0 +1,18 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <stdint.h>
+
+int
+int_eq(void *i1, void *i2);
+
+size_t
+int_size(void *i);
+
+uint64_t
+bad_hash(void *data, size_t size, uint64_t seed);
+
+void
+count_pair(void *pair);
+
+#endif /* MAIN_H */
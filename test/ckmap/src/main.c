@@ -0,0 +1,138 @@
+#include <check.h>
+#include <stdlib.h>
+
+#include "ckmap.h"
+
+#include "main.h"
+
+#define NUM_KEYS 100000
+
+static int keys[2 * NUM_KEYS];
+static int num_pairs;
+
+START_TEST(test_lookup)
+{
+	struct ckmap *map = ckmap_create(10, &int_size);
+	for (int i = 0; i < 2 * NUM_KEYS; i++) keys[i] = i;
+
+	/* The map grows a few times on the way. */
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg(ckmap_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d", i);
+	ck_assert_msg(ckmap_insert(map, keys + 7, keys + 7, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate key");
+	ck_assert_msg(ckmap_size(map) == NUM_KEYS, "Wrong size of a map");
+
+	for (int i = 0; i < 2 * NUM_KEYS; i++) {
+		struct map_pair *pair = ckmap_lookup(map, keys + i, &int_eq);
+		if (i < NUM_KEYS)
+			ck_assert_msg(pair != NULL && pair->value == keys + i,
+					"%d is not found", i);
+		else
+			ck_assert_msg(pair == NULL, "%d is found in a map it's not in", i);
+	}
+
+	struct map_pair removed;
+	for (int i = 0; i < NUM_KEYS; i += 2)
+		ck_assert_msg(ckmap_remove(map, keys + i, &int_eq, &removed) == &removed
+				&& removed.key == keys + i, "Failed to remove %d", i);
+	ck_assert_msg(ckmap_remove(map, keys, &int_eq, &removed) == NULL,
+			"Removed a key twice");
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg((ckmap_lookup(map, keys + i, &int_eq) != NULL) == (i % 2 == 1),
+				"Wrong lookup of %d after removals", i);
+	ck_assert_msg(ckmap_size(map) == NUM_KEYS / 2, "Wrong size after removals");
+
+	num_pairs = 0;
+	ckmap_destroy_ex(map, &count_pair);
+	ck_assert_msg(num_pairs == NUM_KEYS / 2, "Destroyed %d pairs", num_pairs);
+}
+END_TEST;
+
+START_TEST(test_collisions)
+{
+	struct ckmap *map = ckmap_create_fs(0, sizeof(int));
+	for (int i = 0; i < 2 * NUM_KEYS; i++) keys[i] = i;
+	map->hash = &bad_hash;
+
+	/* Keys with the same hash share both buckets and the stash, so no more
+	 * than 12 of them fit. */
+	int num_inserted = 0;
+	enum map_err err;
+	while ((err = ckmap_insert(map, keys + num_inserted * 16, NULL, &int_eq)) == MAPE_OK)
+		num_inserted++;
+	ck_assert_msg(err == MAPE_NOMEM && num_inserted == 3 * CKMAP_BUCKET_SLOTS,
+			"%d keys with the same hash fit", num_inserted);
+	for (int i = 0; i < num_inserted; i++)
+		ck_assert_msg(ckmap_lookup(map, keys + i * 16, &int_eq) != NULL,
+				"Lost %d after failing to insert", i * 16);
+
+	/* Removing a key from a bucket makes room for a stashed one. */
+	struct map_pair removed;
+	ckmap_remove(map, keys, &int_eq, &removed);
+	ckmap_remove(map, keys + 16, &int_eq, &removed);
+	ck_assert_msg(map->stash_size < CKMAP_BUCKET_SLOTS - 1, "Nothing left the stash");
+	for (int i = 2; i < num_inserted; i++)
+		ck_assert_msg(ckmap_lookup(map, keys + i * 16, &int_eq) != NULL,
+				"Lost %d after removals", i * 16);
+	ckmap_destroy(map);
+}
+END_TEST;
+
+Suite *
+ckmap_suite(void)
+{
+	Suite *res = suite_create("Cuckoo map");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_lookup);
+	tcase_add_test(core_tests, test_collisions);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = ckmap_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
+
+/* Multiples of 16 all get the same hash. */
+uint64_t
+bad_hash(void *data, size_t size, uint64_t seed)
+{
+	return *(int *)data % 16;
+}
+
+void
+count_pair(void *pair)
+{
+	num_pairs++;
+}
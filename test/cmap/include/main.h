@@ -0,0 +1,16 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+int
+int_eq(void *i1, void *i2);
+
+void *
+insert_range(void *arg);
+
+void *
+look_up_range(void *arg);
+
+void *
+count_winners(void *arg);
+
+#endif /* MAIN_H */
@@ -0,0 +1,216 @@
+
+#include <check.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "cmap.h"
+
+#include "main.h"
+
+#define NUM_THREADS 4
+#define KEYS_PER_THREAD 10000
+
+static struct cmap *shared_map;
+static int shared_keys[NUM_THREADS * KEYS_PER_THREAD];
+
+START_TEST(test_basic)
+{
+	struct cmap *map = cmap_create_fs(4, 10, sizeof(int), MAPF_AUTOEXPAND);
+
+	int keys[100];
+	for (int i = 0; i < 100; i++) {
+		keys[i] = i;
+		ck_assert_msg(cmap_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a concurrent map", i);
+	}
+	ck_assert_msg(cmap_insert(map, keys, NULL, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate into a concurrent map");
+	ck_assert_msg(cmap_size(map) == 100, "Wrong size of a concurrent map");
+
+	struct map_pair pair;
+	for (int i = 0; i < 100; i++) {
+		ck_assert_msg(cmap_lookup(map, keys + i, &int_eq, &pair) == &pair,
+				"%d is not found in a concurrent map", i);
+		ck_assert_msg(pair.value == keys + i, "Wrong value is associated with %d", i);
+	}
+
+	struct map_pair *removed = cmap_remove(map, keys + 5, &int_eq);
+	ck_assert_msg(removed != NULL && removed->value == keys + 5,
+			"Failed to remove 5 from a concurrent map");
+	free(removed);
+	ck_assert_msg(cmap_lookup(map, keys + 5, &int_eq, &pair) == NULL,
+			"5 is still found in a concurrent map");
+
+	cmap_destroy(map);
+
+	/* Values of plain pairs are not lists of values to free. */
+	map = cmap_create_fs(4, 10, sizeof(int), MAPF_MULTI);
+	ck_assert_msg(cmap_insert(map, keys, keys, &int_eq) == MAPE_OK,
+			"Failed to insert into a concurrent map with MAPF_MULTI");
+	cmap_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_threads)
+{
+	shared_map = cmap_create_fs(16, 64, sizeof(int), MAPF_AUTOEXPAND | MAPF_OPEN);
+	for (int i = 0; i < NUM_THREADS * KEYS_PER_THREAD; i++)
+		shared_keys[i] = i;
+
+	pthread_t threads[NUM_THREADS];
+	for (long i = 0; i < NUM_THREADS; i++)
+		pthread_create(threads + i, NULL, &insert_range, (void *)i);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	ck_assert_msg(cmap_size(shared_map) == NUM_THREADS * KEYS_PER_THREAD,
+			"Some keys were lost by concurrent insertion");
+	struct map_pair pair;
+	for (int i = 0; i < NUM_THREADS * KEYS_PER_THREAD; i++)
+		ck_assert_msg(cmap_lookup(shared_map, shared_keys + i, &int_eq, &pair) != NULL,
+				"%d is not found after concurrent insertion", i);
+
+	cmap_destroy(shared_map);
+}
+END_TEST;
+
+START_TEST(test_get_or_insert)
+{
+	shared_map = cmap_create_fs(8, 64, sizeof(int), MAPF_AUTOEXPAND);
+	for (int i = 0; i < KEYS_PER_THREAD; i++)
+		shared_keys[i] = i;
+
+	/* Every thread tries to claim every key, exactly one must win each. */
+	pthread_t threads[NUM_THREADS];
+	long wins[NUM_THREADS];
+	for (long i = 0; i < NUM_THREADS; i++)
+		pthread_create(threads + i, NULL, &count_winners, (void *)i);
+	long total = 0;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		wins[i] = (long)res;
+		total += wins[i];
+	}
+
+	ck_assert_msg(total == KEYS_PER_THREAD, "Keys were claimed %ld times instead of %d",
+			total, KEYS_PER_THREAD);
+	ck_assert_msg(cmap_size(shared_map) == KEYS_PER_THREAD, "Wrong size of a concurrent map");
+
+	cmap_destroy(shared_map);
+}
+END_TEST;
+
+START_TEST(test_inline_readers)
+{
+	/* The flag is dropped, so readers get pairs of their own while the
+	 * writers grow the shards. */
+	shared_map = cmap_create_fs(4, 16, sizeof(int),
+			MAPF_AUTOEXPAND | MAPF_OPEN | MAPF_INLINE);
+	for (int i = 0; i < NUM_THREADS * KEYS_PER_THREAD; i++)
+		shared_keys[i] = i;
+	for (int i = 0; i < KEYS_PER_THREAD; i++)
+		cmap_insert(shared_map, shared_keys + i, shared_keys + i, &int_eq);
+
+	pthread_t threads[NUM_THREADS];
+	for (long i = 0; i < NUM_THREADS; i++)
+		pthread_create(threads + i, NULL, i % 2 == 0 ? &look_up_range : &insert_range,
+				(void *)i);
+	long wrong = 0;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		wrong += (long)res;
+	}
+
+	ck_assert_msg(wrong == 0, "%ld concurrent lookups went wrong", wrong);
+	ck_assert_msg(cmap_size(shared_map) == (NUM_THREADS / 2 + 1) * KEYS_PER_THREAD,
+			"Wrong size of a concurrent map");
+
+	cmap_destroy(shared_map);
+}
+END_TEST;
+
+Suite *
+cmap_suite(void)
+{
+	Suite *res = suite_create("Concurrent map");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_basic);
+	tcase_add_test(core_tests, test_threads);
+	tcase_add_test(core_tests, test_get_or_insert);
+	tcase_add_test(core_tests, test_inline_readers);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = cmap_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+void *
+insert_range(void *arg)
+{
+	long thread = (long)arg;
+	for (int i = 0; i < KEYS_PER_THREAD; i++) {
+		int *key = shared_keys + thread * KEYS_PER_THREAD + i;
+		if (cmap_insert(shared_map, key, key, &int_eq) != MAPE_OK)
+			return NULL;
+	}
+	return NULL;
+}
+
+/* Look up the keys inserted before the threads were started, a few times
+ * over, returning the number of lookups that went wrong. */
+void *
+look_up_range(void *arg)
+{
+	long res = 0;
+	for (int round = 0; round < 4; round++) {
+		for (int i = 0; i < KEYS_PER_THREAD; i++) {
+			struct map_pair pair;
+			if (cmap_lookup(shared_map, shared_keys + i, &int_eq, &pair) == NULL
+					|| pair.value != shared_keys + i)
+				res++;
+		}
+	}
+	return (void *)res;
+}
+
+void *
+count_winners(void *arg)
+{
+	long thread = (long)arg;
+	long res = 0;
+	for (int i = 0; i < KEYS_PER_THREAD; i++) {
+		struct map_pair pair;
+		enum map_err err = cmap_get_or_insert(shared_map, shared_keys + i, (void *)thread,
+				&int_eq, &pair);
+		if (err == MAPE_OK) res++;
+	}
+	return (void *)res;
+}
@@ -0,0 +1,16 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+int
+int_eq(void *i1, void *i2);
+
+int
+int_eq_ex(void *i1, void *i2, void *arg);
+
+size_t
+int_size(void *i);
+
+void
+count_pair(void *pair);
+
+#endif /* MAIN_H */
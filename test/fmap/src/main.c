@@ -0,0 +1,165 @@
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fmap.h"
+#include "map.h"
+
+#include "main.h"
+
+#define NUM_KEYS 10000
+#define NUM_LARGE_KEYS 300000
+
+static int keys[NUM_KEYS];
+static int values[NUM_KEYS];
+static int num_destroyed;
+
+START_TEST(test_lookup)
+{
+	unsigned flags[] = { MAPF_AUTOEXPAND, MAPF_AUTOEXPAND | MAPF_OPEN,
+		MAPF_AUTOEXPAND | MAPF_POOL };
+	for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		struct map *map = map_create(10, &int_size, flags[f]);
+		for (int i = 0; i < NUM_KEYS; i++) {
+			keys[i] = i * 7;
+			values[i] = -i;
+			map_insert(map, keys + i, values + i, &int_eq);
+		}
+		struct fmap *fmap = fmap_create(map);
+		map_destroy(map);
+		ck_assert_msg(fmap != NULL, "Failed to create a frozen map");
+		ck_assert_msg(fmap_size(fmap) == NUM_KEYS, "Wrong size of a frozen map");
+
+		for (int i = 0; i < NUM_KEYS; i++) {
+			int key = i * 7;
+			struct map_pair *pair = fmap_lookup(fmap, &key, &int_eq);
+			ck_assert_msg(pair != NULL, "%d is not found in a frozen map", key);
+			ck_assert_msg(pair->key == keys + i && pair->value == values + i,
+					"Wrong pair found for %d", key);
+			key++;
+			ck_assert_msg(fmap_lookup_ex(fmap, &key, &int_eq_ex, NULL) == NULL,
+					"%d is found in a frozen map it's not in", key);
+		}
+
+		num_destroyed = 0;
+		fmap_destroy_ex(fmap, &count_pair);
+		ck_assert_msg(num_destroyed == NUM_KEYS, "Wrong number of pairs destroyed");
+	}
+}
+END_TEST;
+
+START_TEST(test_empty)
+{
+	struct map *map = map_create(10, &int_size, MAPF_AUTOEXPAND);
+	struct fmap *fmap = fmap_create(map);
+	map_destroy(map);
+	ck_assert_msg(fmap != NULL, "Failed to create an empty frozen map");
+	ck_assert_msg(fmap_size(fmap) == 0, "Wrong size of an empty frozen map");
+	int key = 1;
+	ck_assert_msg(fmap_lookup(fmap, &key, &int_eq) == NULL,
+			"Found a key in an empty frozen map");
+	fmap_destroy(fmap);
+}
+END_TEST;
+
+START_TEST(test_equal_keys)
+{
+	/* Without a comparison function, nothing stops equal keys going in. */
+	struct map *map = map_create(10, &int_size, MAPF_AUTOEXPAND);
+	keys[0] = keys[1] = 3;
+	map_insert(map, keys, NULL, NULL);
+	map_insert(map, keys + 1, NULL, NULL);
+	errno = 0;
+	ck_assert_msg(fmap_create(map) == NULL && errno == EINVAL,
+			"Equal keys were not reported");
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_large)
+{
+	/* Each bucket gives up after a fixed number of tries, so building takes
+	 * about linear time rather than quadratic. */
+	struct map *map = map_create_inline(NUM_LARGE_KEYS, sizeof(int), 0, MAPF_AUTOEXPAND);
+	for (int i = 0; i < NUM_LARGE_KEYS; i++) {
+		int key = i * 7;
+		map_insert(map, &key, NULL, &int_eq);
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct fmap *fmap = fmap_create(map);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ck_assert_msg(fmap != NULL, "Failed to create a large frozen map");
+	ck_assert_msg(seconds < 2, "Building a large frozen map took %.2f s", seconds);
+
+	for (int i = 0; i < NUM_LARGE_KEYS; i++) {
+		int key = i * 7;
+		struct map_pair *pair = fmap_lookup(fmap, &key, &int_eq);
+		ck_assert_msg(pair != NULL && *(int *)pair->key == key,
+				"%d is not found in a large frozen map", key);
+	}
+	fmap_destroy(fmap);
+	map_destroy(map);
+}
+END_TEST;
+
+Suite *
+fmap_suite(void)
+{
+	Suite *res = suite_create("Frozen map");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_lookup);
+	tcase_add_test(core_tests, test_empty);
+	tcase_add_test(core_tests, test_equal_keys);
+	tcase_add_test(core_tests, test_large);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = fmap_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+int
+int_eq_ex(void *i1, void *i2, void *arg)
+{
+	return int_eq(i1, i2);
+}
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
+
+void
+count_pair(void *pair)
+{
+	num_destroyed++;
+}
@@ -0,0 +1,115 @@
+
+#include <check.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+START_TEST(test_determinism)
+{
+	char data[300];
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i * 31;
+
+	for (size_t size = 0; size <= sizeof(data); size++) {
+		ck_assert_msg(hash_wy(data, size, 42) == hash_wy(data, size, 42),
+				"hash_wy is not deterministic for size %zu", size);
+		ck_assert_msg(hash_fnv(data, size, 42) == hash_fnv(data, size, 42),
+				"hash_fnv is not deterministic for size %zu", size);
+	}
+}
+END_TEST;
+
+START_TEST(test_sensitivity)
+{
+	char data[300];
+	memset(data, 0, sizeof(data));
+
+	for (size_t size = 1; size <= sizeof(data); size++) {
+		ck_assert_msg(hash_wy(data, size, 0) != hash_wy(data, size - 1, 0),
+				"Sizes %zu and %zu hash the same", size, size - 1);
+		ck_assert_msg(hash_wy(data, size, 0) != hash_wy(data, size, 1),
+				"Seed does not affect the hash of size %zu", size);
+		data[size - 1] = 1;
+		ck_assert_msg(hash_wy(data, size, 0) != hash_wy(data, size - 1, 0),
+				"Last byte does not affect the hash of size %zu", size);
+		data[size - 1] = 0;
+	}
+}
+END_TEST;
+
+START_TEST(test_distribution)
+{
+	int counts[64] = { 0 };
+	for (int i = 0; i < 64 * 100; i++)
+		counts[hash_wy(&i, sizeof(i), 0) >> 58]++;
+
+	for (int i = 0; i < 64; i++)
+		ck_assert_msg(counts[i] > 50 && counts[i] < 150,
+				"Top bits of hash_wy are poorly distributed");
+
+	for (int i = 0; i < 64; i++)
+		counts[i] = 0;
+	for (int i = 0; i < 64 * 100; i++)
+		counts[hash_word(i, 0) & 63]++;
+
+	for (int i = 0; i < 64; i++)
+		ck_assert_msg(counts[i] > 50 && counts[i] < 150,
+				"Low bits of hash_word are poorly distributed");
+}
+END_TEST;
+
+START_TEST(test_seeds)
+{
+	uint64_t s1 = hash_random_seed();
+	uint64_t s2 = hash_random_seed();
+	ck_assert_msg(s1 != s2, "Two random seeds are the same");
+}
+END_TEST;
+
+START_TEST(test_shards)
+{
+	size_t num;
+	unsigned int shift = hash_shard_shift(5, &num);
+	ck_assert_msg(num == 8, "5 shards were rounded up to %zu", num);
+	ck_assert_msg(hash_shard(SIZE_MAX, shift, num) == 7
+			&& hash_shard(SIZE_MAX >> 3, shift, num) == 0,
+			"Shards are not chosen by the top bits");
+
+	shift = hash_shard_shift(1, &num);
+	ck_assert_msg(num == 1 && hash_shard(SIZE_MAX, shift, num) == 0,
+			"A single shard is not chosen for every hash");
+}
+END_TEST;
+
+Suite *
+hash_suite(void)
+{
+	Suite *res = suite_create("Hash");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_determinism);
+	tcase_add_test(core_tests, test_sensitivity);
+	tcase_add_test(core_tests, test_distribution);
+	tcase_add_test(core_tests, test_seeds);
+	tcase_add_test(core_tests, test_shards);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = hash_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
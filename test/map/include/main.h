@@ -7,4 +7,10 @@ no_op_pair_destroyer(void *pair);
 int
 int_eq(void *i1, void *i2);
 
+size_t
+counted_int_size(void *i);
+
+int
+counted_int_eq(void *i1, void *i2);
+
 #endif /* MAIN_H */
@@ -2,10 +2,14 @@
 #include <check.h>
 #include <string.h>
 
+#include "list.h"
 #include "map.h"
 
 #include "main.h"
 
+static int num_size_calls;
+static int num_eq_calls;
+
 START_TEST(test_creation)
 {
 	struct map *map = map_create_fs(10, sizeof(int), 0);
@@ -134,6 +138,840 @@ START_TEST(test_remove)
 }
 END_TEST;
 
+START_TEST(test_open)
+{
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_OPEN);
+
+	int keys[100];
+	for (int i = 0; i < 100; i++) {
+		keys[i] = i * 7;
+		ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d into an open addressing map", keys[i]);
+	}
+	ck_assert_msg(map_insert(map, keys + 5, NULL, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate key into an open addressing map");
+	ck_assert_msg(map_num_buckets(map) >= 100, "The map did not grow");
+
+	for (int i = 0; i < 100; i += 2) {
+		struct map_pair *removed = map_remove(map, keys + i, &int_eq);
+		ck_assert_msg(removed != NULL, "Failed to remove %d from the map", keys[i]);
+		ck_assert_msg(removed->value == keys + i, "Removed a wrong pair");
+		free(removed);
+	}
+
+	for (int i = 0; i < 100; i++) {
+		int key = i * 7;
+		struct map_pair *pair = map_lookup(map, &key, &int_eq);
+		if (i % 2 == 0) {
+			ck_assert_msg(pair == NULL, "%d is still found in the map", key);
+		} else {
+			ck_assert_msg(pair != NULL, "%d is not found in the map", key);
+			ck_assert_msg(pair->value == keys + i, "Wrong value is associated with %d", key);
+		}
+	}
+
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_counters)
+{
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND);
+
+	int keys[1000];
+	for (int i = 0; i < 1000; i++) {
+		keys[i] = i;
+		ck_assert_msg(map_insert(map, keys + i, NULL, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a map", i);
+	}
+	ck_assert_msg(map_size(map) == 1000, "Wrong map size after insertion");
+	ck_assert_msg(map_num_buckets(map) > 10, "The map was not expanded");
+	ck_assert_msg(map_load_factor(map) < 0.7, "The map is overloaded");
+
+	for (int i = 0; i < 1000; i++)
+		ck_assert_msg(map_lookup(map, keys + i, &int_eq) != NULL,
+				"%d is not found in the map", i);
+
+	for (int i = 0; i < 500; i++)
+		free(map_remove(map, keys + i, &int_eq));
+	ck_assert_msg(map_size(map) == 500, "Wrong map size after removal");
+
+	size_t occupied = 0;
+	for (size_t i = 0; i < map_num_buckets(map); i++) {
+		struct list *chain = arr_ix(map->buckets, i);
+		if (!list_empty(chain)) occupied++;
+	}
+	ck_assert_msg(map_occupied(map) == occupied, "Wrong number of occupied buckets");
+
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_incremental)
+{
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND | MAPF_INCREMENTAL);
+
+	int keys[1000];
+	for (int i = 0; i < 1000; i++) {
+		keys[i] = i;
+		ck_assert_msg(map_insert(map, keys + i, NULL, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a map", i);
+	}
+	for (int i = 0; i < 1000; i++)
+		ck_assert_msg(map_lookup(map, keys + i, &int_eq) != NULL,
+				"%d is not found in the map", i);
+
+	size_t num_buckets = map_num_buckets(map);
+	ck_assert_msg(map_expand(map, 2, 1), "Failed to expand a map");
+	ck_assert_msg(map->old_buckets != NULL, "The map was rehashed all at once");
+	ck_assert_msg(map_num_buckets(map) >= 2 * num_buckets,
+			"The number of buckets did not increase");
+
+	for (int i = 0; i < 1000; i += 2)
+		free(map_remove(map, keys + i, &int_eq));
+	for (int i = 0; i < 1000; i++) {
+		struct map_pair *pair = map_lookup(map, keys + i, &int_eq);
+		ck_assert_msg((pair == NULL) == (i % 2 == 0),
+				"%d is found in the map when it shouldn't be or vice versa", i);
+	}
+
+	while (map_rehash_step(map, 10))
+		;
+	ck_assert_msg(map->old_buckets == NULL, "The rehash did not finish");
+	ck_assert_msg(map_size(map) == 500, "Wrong map size after rehashing");
+	for (int i = 1; i < 1000; i += 2)
+		ck_assert_msg(map_lookup(map, keys + i, &int_eq) != NULL,
+				"%d is not found in the map", i);
+
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_hash)
+{
+	struct map *map1 = map_create_fs_h(10, sizeof(int), &hash_fnv, MAPF_OPEN);
+	struct map *map2 = map_create_fs(10, sizeof(int), 0);
+	ck_assert_msg(map1->seed != map2->seed, "Two maps have the same seed");
+
+	int keys[100];
+	for (int i = 0; i < 100; i++) {
+		keys[i] = i;
+		ck_assert_msg(map_insert(map1, keys + i, NULL, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a map with a custom hash", i);
+	}
+	for (int i = 0; i < 100; i++)
+		ck_assert_msg(map_lookup(map1, keys + i, &int_eq) != NULL,
+				"%d is not found in a map with a custom hash", i);
+
+	map_destroy(map1);
+	map_destroy(map2);
+}
+END_TEST;
+
+START_TEST(test_pow2)
+{
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND | MAPF_POW2);
+	ck_assert_msg(map_num_buckets(map) == 16, "The number of buckets is not rounded up to 16");
+
+	int keys[1000];
+	for (int i = 0; i < 1000; i++) {
+		keys[i] = i;
+		ck_assert_msg(map_insert(map, keys + i, NULL, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a map", i);
+	}
+	size_t num_buckets = map_num_buckets(map);
+	ck_assert_msg((num_buckets & (num_buckets - 1)) == 0,
+			"The number of buckets is not a power of two after expansion");
+
+	for (int i = 0; i < 1000; i += 2)
+		free(map_remove(map, keys + i, &int_eq));
+	for (int i = 0; i < 1000; i++) {
+		struct map_pair *pair = map_lookup(map, keys + i, &int_eq);
+		ck_assert_msg((pair == NULL) == (i % 2 == 0),
+				"%d is found in the map when it shouldn't be or vice versa", i);
+	}
+
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_batch)
+{
+	int flags[] = { MAPF_AUTOEXPAND, MAPF_OPEN };
+	for (int f = 0; f < 2; f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flags[f]);
+
+		int keys[200];
+		void *key_ptrs[200];
+		enum map_err results[200];
+		struct map_pair *pairs[200];
+		for (int i = 0; i < 200; i++) {
+			keys[i] = i % 100;
+			key_ptrs[i] = keys + i;
+		}
+
+		ck_assert_msg(map_insert_batch(map, key_ptrs, key_ptrs, 100, &int_eq, results) == 100,
+				"Failed to insert a batch of keys");
+		ck_assert_msg(map_insert_batch(map, key_ptrs + 100, key_ptrs, 100, &int_eq, results) == 0,
+				"Inserted a batch of duplicate keys");
+		ck_assert_msg(results[0] == MAPE_EXIST, "Wrong result of inserting a duplicate key");
+
+		for (int i = 0; i < 200; i++)
+			keys[i] = i;
+		ck_assert_msg(map_lookup_batch(map, key_ptrs, 200, &int_eq, pairs) == 100,
+				"Wrong number of keys found in a batch");
+		for (int i = 0; i < 200; i++) {
+			ck_assert_msg((pairs[i] != NULL) == (i < 100),
+					"%d is found in the map when it shouldn't be or vice versa", i);
+			if (pairs[i] != NULL)
+				ck_assert_msg(*(int *)pairs[i]->key == i, "Wrong pair found for %d", i);
+		}
+
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_pool)
+{
+	int flags[] = { MAPF_AUTOEXPAND | MAPF_POOL,
+		MAPF_AUTOEXPAND | MAPF_POOL | MAPF_INCREMENTAL, MAPF_OPEN | MAPF_POOL };
+	for (int f = 0; f < 3; f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flags[f]);
+
+		int keys[1000];
+		for (int i = 0; i < 1000; i++) {
+			keys[i] = i;
+			ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+					"Failed to insert %d into a pooled map", i);
+		}
+
+		struct map_pair pair;
+		for (int i = 0; i < 1000; i += 2) {
+			ck_assert_msg(map_remove_copy(map, keys + i, &int_eq, &pair) == &pair,
+					"Failed to remove %d from a pooled map", i);
+			ck_assert_msg(pair.value == keys + i, "Wrong pair removed for %d", i);
+		}
+		ck_assert_msg(map_remove_copy(map, keys, &int_eq, &pair) == NULL,
+				"Removed a key twice");
+		struct map_pair *removed = map_remove(map, keys + 1, &int_eq);
+		ck_assert_msg(removed != NULL && removed->value == keys + 1,
+				"Failed to remove 1 from a pooled map");
+		free(removed);
+
+		/* These reuse the entries freed above. */
+		for (int i = 0; i < 1000; i += 2)
+			map_insert(map, keys + i, keys + i, &int_eq);
+		ck_assert_msg(map_size(map) == 999, "Wrong size of a pooled map");
+		for (int i = 2; i < 1000; i++) {
+			struct map_pair *found = map_lookup(map, keys + i, &int_eq);
+			ck_assert_msg(found != NULL && found->value == keys + i,
+					"%d is lost in a pooled map", i);
+		}
+
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_cached_hash)
+{
+	int flags[] = { MAPF_AUTOEXPAND, MAPF_AUTOEXPAND | MAPF_POOL, MAPF_OPEN };
+	for (int f = 0; f < 3; f++) {
+		struct map *map = map_create(10, &counted_int_size, flags[f]);
+
+		int keys[2000];
+		for (int i = 0; i < 2000; i++) {
+			keys[i] = i;
+			map_insert(map, keys + i, keys + i, NULL);
+		}
+
+		/* Expanding uses the stored hashes. */
+		num_size_calls = 0;
+		ck_assert_msg(map_expand(map, 4, 0), "Failed to expand a map");
+		ck_assert_msg(num_size_calls == 0, "Keys were rehashed on expansion");
+
+		/* Keys are only compared when their hashes match. Open addressing
+		 * maps only check 7 bits of the hash, so they may compare a few
+		 * keys in vain. */
+		num_eq_calls = 0;
+		for (int i = 1000; i < 2000; i++)
+			keys[i] = i + 1000;
+		for (int i = 1000; i < 2000; i++)
+			ck_assert_msg(map_lookup(map, keys + i, &counted_int_eq) == NULL,
+					"%d is found in a map it's not in", keys[i]);
+		if (!(flags[f] & MAPF_OPEN))
+			ck_assert_msg(num_eq_calls == 0, "Keys with different hashes were compared");
+		num_eq_calls = 0;
+		for (int i = 0; i < 1000; i++)
+			ck_assert_msg(map_lookup(map, keys + i, &counted_int_eq) != NULL,
+					"%d is not found in a map", i);
+		if (!(flags[f] & MAPF_OPEN))
+			ck_assert_msg(num_eq_calls == 1000, "Wrong number of comparisons");
+
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_iteration)
+{
+	int flags[] = { MAPF_AUTOEXPAND, MAPF_AUTOEXPAND | MAPF_INCREMENTAL, MAPF_OPEN };
+	for (int f = 0; f < 3; f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flags[f]);
+
+		int keys[500];
+		for (int i = 0; i < 500; i++) {
+			keys[i] = i;
+			map_insert(map, keys + i, keys + i, &int_eq);
+		}
+		/* Leave an incremental rehash half done. */
+		if (flags[f] & MAPF_INCREMENTAL) {
+			map_expand(map, 2, 0);
+			map_rehash_step(map, map_num_buckets(map) / 4);
+		}
+
+		int seen[500] = { 0 };
+		struct map_iter iter;
+		map_iter_init(&iter, map);
+		struct map_pair *pair;
+		size_t count = 0;
+		while ((pair = map_iter_next(&iter)) != NULL) {
+			ck_assert_msg(pair->key == pair->value, "Iterated over a wrong pair");
+			seen[*(int *)pair->key]++;
+			count++;
+		}
+		ck_assert_msg(count == 500, "Iterated over %zu pairs instead of 500", count);
+		for (int i = 0; i < 500; i++)
+			ck_assert_msg(seen[i] == 1, "%d was seen %d times", i, seen[i]);
+
+		void *keys_out[500], *values_out[500];
+		ck_assert_msg(map_to_arrays(map, keys_out, values_out) == 500,
+				"Wrong number of pairs exported");
+		for (int i = 0; i < 500; i++)
+			ck_assert_msg(keys_out[i] == values_out[i], "Exported pairs are mixed up");
+		ck_assert_msg(map_to_arrays(map, NULL, values_out) == 500,
+				"Wrong number of values exported");
+
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_from_arrays)
+{
+	int flags[] = { MAPF_AUTOEXPAND, MAPF_AUTOEXPAND | MAPF_POOL, MAPF_OPEN };
+	static int keys[20000];
+	static void *key_ptrs[20000];
+	for (int i = 0; i < 20000; i++) {
+		keys[i] = i % 10000;
+		key_ptrs[i] = keys + i;
+	}
+
+	for (int f = 0; f < 3; f++) {
+		/* Unique keys, hashed by several threads. */
+		struct map *map = map_from_arrays_fs(key_ptrs, key_ptrs, 10000, sizeof(int),
+				NULL, flags[f], 4);
+		ck_assert_msg(map != NULL, "Failed to build a map from arrays");
+		ck_assert_msg(map_size(map) == 10000, "Wrong size of a map built from arrays");
+		size_t num_buckets = map_num_buckets(map);
+		for (int i = 0; i < 10000; i++) {
+			struct map_pair *pair = map_lookup(map, keys + i, &int_eq);
+			ck_assert_msg(pair != NULL && pair->value == keys + i,
+					"%d is lost when building a map from arrays", i);
+		}
+		ck_assert_msg(map_insert(map, keys, NULL, &int_eq) == MAPE_EXIST,
+				"A map built from arrays accepts duplicates");
+		ck_assert_msg(map_num_buckets(map) == num_buckets,
+				"A map built from arrays was expanded");
+		map_destroy(map);
+
+		/* Every key twice, only the first one of each is kept. */
+		map = map_from_arrays_fs(key_ptrs, NULL, 20000, sizeof(int), &int_eq,
+				flags[f], 1);
+		ck_assert_msg(map_size(map) == 10000, "Duplicates were inserted from arrays");
+		for (int i = 0; i < 10000; i++) {
+			struct map_pair *pair = map_lookup(map, keys + i, &int_eq);
+			ck_assert_msg(pair != NULL && pair->key == keys + i && pair->value == NULL,
+					"Wrong pair for %d in a map built from arrays", i);
+		}
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_robin_hood)
+{
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_ROBIN_HOOD);
+	ck_assert_msg(map->flags & MAPF_OPEN, "Robin Hood maps are not open addressing");
+
+	int keys[5000];
+	for (int i = 0; i < 5000; i++) {
+		keys[i] = i * 7;
+		ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a Robin Hood map", keys[i]);
+	}
+	ck_assert_msg(map_insert(map, keys + 5, NULL, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate key into a Robin Hood map");
+
+	struct map_pair removed;
+	for (int i = 0; i < 5000; i += 2) {
+		ck_assert_msg(map_remove_copy(map, keys + i, &int_eq, &removed) == &removed,
+				"Failed to remove %d from the map", keys[i]);
+		ck_assert_msg(removed.value == keys + i, "Removed a wrong pair");
+	}
+	ck_assert_msg(map_size(map) == 2500, "Wrong size after removals");
+
+	for (int i = 0; i < 5000; i++) {
+		int key = i * 7;
+		struct map_pair *pair = map_lookup(map, &key, &int_eq);
+		if (i % 2 == 0) {
+			ck_assert_msg(pair == NULL, "%d is still found in the map", key);
+		} else {
+			ck_assert_msg(pair != NULL, "%d is not found in the map", key);
+			ck_assert_msg(pair->value == keys + i, "Wrong value is associated with %d", key);
+		}
+	}
+
+	/* Removals leave no tombstones behind, so every probe stays within the
+	 * bound. */
+	struct map_stats stats;
+	map_stats(map, &stats);
+	ck_assert_msg(stats.max_probe <= 32, "A probe of %zu slots", stats.max_probe);
+	ck_assert_msg(map->num_deleted == 0, "A Robin Hood map has deleted slots");
+
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_stats)
+{
+	int flags[] = { MAPF_AUTOEXPAND, MAPF_AUTOEXPAND | MAPF_INCREMENTAL, MAPF_OPEN,
+		MAPF_ROBIN_HOOD };
+	for (int f = 0; f < 4; f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flags[f]);
+		int keys[3000];
+		for (int i = 0; i < 3000; i++) {
+			keys[i] = i;
+			map_insert(map, keys + i, NULL, NULL);
+		}
+
+		struct map_stats stats;
+		map_stats(map, &stats);
+		ck_assert_msg(stats.size == 3000 && stats.num_occupied == map_occupied(map)
+				&& stats.num_buckets == map_num_buckets(map),
+				"Wrong sizes in the statistics of a map");
+		ck_assert_msg(stats.load_factor == map_load_factor(map),
+				"Wrong load factor in the statistics of a map");
+
+		size_t total = 0, sum = 0;
+		for (size_t i = 0; i < MAP_STATS_HISTOGRAM; i++) {
+			total += stats.histogram[i];
+			sum += i * stats.histogram[i];
+		}
+		ck_assert_msg(total == 3000, "The histogram counts %zu pairs", total);
+		ck_assert_msg(stats.histogram[0] > 0 && stats.mean_probe >= 0
+				&& stats.max_probe >= stats.mean_probe,
+				"Wrong probe lengths in the statistics of a map");
+		if (stats.max_probe < MAP_STATS_HISTOGRAM)
+			ck_assert_msg(sum == (size_t)(stats.mean_probe * 3000 + 0.5),
+					"The mean probe length doesn't match the histogram");
+
+		map_destroy(map);
+	}
+
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND);
+	struct map_stats stats;
+	map_stats(map, &stats);
+	ck_assert_msg(stats.size == 0 && stats.max_probe == 0 && stats.mean_probe == 0,
+			"Wrong statistics of an empty map");
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_inline)
+{
+	struct map *map = map_create_inline(10, sizeof(int), sizeof(double), MAPF_AUTOEXPAND);
+	ck_assert_msg(map->flags & MAPF_OPEN, "Inline maps are not open addressing");
+
+	/* Keys and values are copied, so they may be temporaries. */
+	for (int i = 0; i < 3000; i++) {
+		int key = i * 7;
+		double value = i / 4.0;
+		ck_assert_msg(map_insert(map, &key, &value, &counted_int_eq) == MAPE_OK,
+				"Failed to insert %d into an inline map", key);
+	}
+	int key = 21;
+	ck_assert_msg(map_insert(map, &key, NULL, &counted_int_eq) == MAPE_EXIST,
+			"Inserted a duplicate key into an inline map");
+	ck_assert_msg(map_expand(map, 2, 0), "Failed to expand an inline map");
+
+	num_eq_calls = 0;
+	for (int i = 0; i < 3000; i++) {
+		key = i * 7;
+		struct map_pair *pair = map_lookup(map, &key, &counted_int_eq);
+		ck_assert_msg(pair != NULL, "%d is not found in an inline map", key);
+		ck_assert_msg(pair->key != &key && *(int *)pair->key == key,
+				"Wrong key found for %d", key);
+		ck_assert_msg(*(double *)pair->value == i / 4.0, "Wrong value found for %d", key);
+		key++;
+		ck_assert_msg(map_lookup(map, &key, &counted_int_eq) == NULL,
+				"%d is found in an inline map it's not in", key);
+	}
+	ck_assert_msg(num_eq_calls == 0, "Inline keys were compared by the user function");
+
+	/* Copied lookups don't share a pair, in batches or not. */
+	int batch_keys[8];
+	void *batch_ptrs[8];
+	struct map_pair copies[8], *found[8];
+	for (int i = 0; i < 8; i++) {
+		batch_keys[i] = i * 7 + i % 2;
+		batch_ptrs[i] = batch_keys + i;
+	}
+	ck_assert_msg(map_lookup_batch_copy(map, batch_ptrs, 8, &int_eq, copies, found) == 4,
+			"Wrong number of keys found in an inline map by a batch");
+	for (int i = 0; i < 8; i++)
+		ck_assert_msg(i % 2 == 1 ? found[i] == NULL
+				: found[i] == copies + i && *(double *)found[i]->value == i / 4.0,
+				"Wrong pair found for %d by a batch", batch_keys[i]);
+	struct map_pair copy;
+	key = 14;
+	ck_assert_msg(map_lookup_copy(map, &key, &int_eq, &copy) == &copy
+			&& *(int *)copy.key == 14 && copy.key == found[2]->key,
+			"Wrong pair copied from an inline map");
+
+	/* Nor do plain ones, so a pair survives later lookups. */
+	ck_assert_msg(map_lookup_batch(map, batch_ptrs, 8, &int_eq, found) == 4,
+			"Wrong number of keys found in an inline map by a plain batch");
+	for (int i = 0; i < 8; i += 2)
+		ck_assert_msg(*(int *)found[i]->key == batch_keys[i]
+				&& *(double *)found[i]->value == i / 4.0,
+				"Wrong pair found for %d by a plain batch", batch_keys[i]);
+	key = 14;
+	ck_assert_msg(map_lookup(map, &key, &int_eq) == found[2],
+			"Another pair returned for the same inline key");
+
+	struct map_pair removed;
+	for (int i = 0; i < 3000; i += 2) {
+		key = i * 7;
+		struct map_pair *pair = i % 4 == 0
+			? map_remove(map, &key, &int_eq)
+			: map_remove_copy(map, &key, &int_eq, &removed);
+		ck_assert_msg(pair != NULL, "Failed to remove %d from an inline map", key);
+		ck_assert_msg(*(int *)pair->key == key && *(double *)pair->value == i / 4.0,
+				"Removed a wrong pair");
+		if (pair != &removed) free(pair);
+	}
+
+	struct map_iter iter;
+	map_iter_init(&iter, map);
+	size_t count = 0;
+	struct map_pair *pair;
+	while ((pair = map_iter_next(&iter)) != NULL) {
+		ck_assert_msg(*(int *)pair->key % 14 == 7, "Iterated over a removed key");
+		count++;
+	}
+	ck_assert_msg(count == 1500 && map_size(map) == 1500, "Wrong size after removals");
+	map_destroy(map);
+
+	/* A set of keys. */
+	map = map_create_fs(10, sizeof(int), MAPF_INLINE);
+	key = 5;
+	map_insert(map, &key, &key, &int_eq);
+	pair = map_lookup(map, &key, &int_eq);
+	ck_assert_msg(pair != NULL && pair->value == NULL, "Wrong pair in a set of keys");
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_bloom)
+{
+	int flag_sets[] = {
+		MAPF_AUTOEXPAND,
+		MAPF_AUTOEXPAND | MAPF_INCREMENTAL | MAPF_POW2,
+		MAPF_AUTOEXPAND | MAPF_OPEN,
+		MAPF_ROBIN_HOOD,
+		MAPF_INLINE,
+	};
+	static int keys[4000];
+	for (int i = 0; i < 4000; i++) keys[i] = i;
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(int); f++) {
+		/* The filter starts small, so it's rebuilt a few times. */
+		struct map *map = map_create_fs(10, sizeof(int), flag_sets[f] | MAPF_BLOOM);
+		ck_assert_msg(map->filter != NULL, "No filter with flags %d", flag_sets[f]);
+		for (int i = 0; i < 2000; i++)
+			ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+					"Failed to insert %d", i);
+		ck_assert_msg(map_insert(map, keys + 5, keys + 5, &int_eq) == MAPE_EXIST,
+				"Inserted a duplicate key past the filter");
+
+		for (int i = 0; i < 2000; i++)
+			ck_assert_msg(map_lookup(map, keys + i, &int_eq) != NULL,
+					"%d is not found with flags %d", i, flag_sets[f]);
+		/* Missing keys rarely get as far as a comparison. */
+		num_eq_calls = 0;
+		for (int i = 2000; i < 4000; i++) {
+			ck_assert_msg(map_lookup(map, keys + i, &counted_int_eq) == NULL,
+					"%d is found in a map it's not in", i);
+			ck_assert_msg(map_remove(map, keys + i, &counted_int_eq) == NULL,
+					"Removed %d from a map it's not in", i);
+		}
+		ck_assert_msg(num_eq_calls < 100, "%d comparisons for missing keys",
+				num_eq_calls);
+
+		/* Removed keys stay in the filter, but not in the map. */
+		struct map_pair removed;
+		for (int i = 0; i < 2000; i += 2)
+			ck_assert_msg(map_remove_copy(map, keys + i, &int_eq, &removed) != NULL,
+					"Failed to remove %d", i);
+		for (int i = 0; i < 2000; i++)
+			ck_assert_msg((map_lookup(map, keys + i, &int_eq) != NULL) == (i % 2 == 1),
+					"Wrong lookup of %d after removals", i);
+		for (int i = 0; i < 2000; i += 2)
+			ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+					"Failed to insert %d again", i);
+		ck_assert_msg(map_size(map) == 2000, "Wrong size of a filtered map");
+		map_destroy(map);
+	}
+}
+END_TEST;
+
+START_TEST(test_shrink)
+{
+	int flag_sets[] = {
+		MAPF_AUTOEXPAND,
+		MAPF_AUTOEXPAND | MAPF_INCREMENTAL | MAPF_POW2,
+		MAPF_AUTOEXPAND | MAPF_POOL,
+		MAPF_OPEN,
+		MAPF_ROBIN_HOOD | MAPF_BLOOM,
+		MAPF_INLINE,
+	};
+	static int keys[10000];
+	for (int i = 0; i < 10000; i++) keys[i] = i;
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(int); f++) {
+		for (int autoshrink = 0; autoshrink < 2; autoshrink++) {
+			int flags = flag_sets[f] | (autoshrink ? MAPF_AUTOSHRINK : 0);
+			struct map *map = map_create_fs(10, sizeof(int), flags);
+			for (int i = 0; i < 10000; i++)
+				map_insert(map, keys + i, keys + i, &int_eq);
+			size_t num_buckets = map_num_buckets(map);
+
+			struct map_pair removed;
+			for (int i = 100; i < 10000; i++)
+				ck_assert_msg(map_remove_copy(map, keys + i, &int_eq, &removed) != NULL,
+						"Failed to remove %d with flags %d", i, flags);
+			if (!autoshrink) {
+				ck_assert_msg(map_num_buckets(map) == num_buckets,
+						"Shrank without MAPF_AUTOSHRINK");
+				ck_assert_msg(map_shrink_to_fit(map), "Failed to shrink a map");
+			} else {
+				while (map_rehash_step(map, 100));
+			}
+			/* An incremental rehash may still be shrinking the map when a
+			 * removal would start another one. */
+			size_t max_buckets = autoshrink && (flags & MAPF_INCREMENTAL)
+				? num_buckets / 2
+				: 512;
+			ck_assert_msg(map_num_buckets(map) <= max_buckets,
+					"%zu buckets left for 100 pairs with flags %d",
+					map_num_buckets(map), flags);
+
+			ck_assert_msg(map_size(map) == 100, "Wrong size after shrinking");
+			for (int i = 0; i < 200; i++) {
+				struct map_pair *pair = map_lookup(map, keys + i, &int_eq);
+				ck_assert_msg((pair != NULL) == (i < 100),
+						"Wrong lookup of %d after shrinking", i);
+				/* Inline maps made by 'map_create_fs' hold no values. */
+				ck_assert_msg(pair == NULL || (flags & MAPF_INLINE)
+						|| *(int *)pair->value == i,
+						"Wrong value of %d after shrinking", i);
+			}
+			/* It grows back as usual. */
+			for (int i = 100; i < 10000; i++)
+				ck_assert_msg(map_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+						"Failed to insert %d again", i);
+			ck_assert_msg(map_lookup(map, keys + 9999, &int_eq) != NULL,
+					"Lost a pair after growing back");
+			map_destroy(map);
+		}
+	}
+}
+END_TEST;
+
+START_TEST(test_reserve)
+{
+	int flag_sets[] = {
+		MAPF_AUTOEXPAND,
+		MAPF_AUTOEXPAND | MAPF_INCREMENTAL | MAPF_POW2,
+		MAPF_AUTOEXPAND | MAPF_POOL,
+		MAPF_OPEN,
+		MAPF_ROBIN_HOOD,
+		MAPF_INLINE,
+	};
+	static int keys[10000];
+	for (int i = 0; i < 10000; i++) keys[i] = i;
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(int); f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flag_sets[f]);
+		ck_assert_msg(map_reserve(map, 10000), "Failed to reserve room");
+		size_t num_buckets = map_num_buckets(map);
+		for (int i = 0; i < 10000; i++)
+			map_insert(map, keys + i, keys + i, &int_eq);
+		ck_assert_msg(map_num_buckets(map) == num_buckets,
+				"Expanded after reserving room with flags %d", flag_sets[f]);
+		ck_assert_msg(map_reserve(map, 10) && map_num_buckets(map) == num_buckets,
+				"Reserving room shrank the map");
+		map_destroy(map);
+	}
+
+	/* Lower load factors keep maps emptier. */
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_OPEN);
+	ck_assert_msg(!map_set_max_load_factor(map, 0) && !map_set_max_load_factor(map, 1)
+			&& !map_set_growth_factor(map, 1) && map->max_load_factor == 0.875,
+			"Accepted an out of range factor");
+	ck_assert_msg(map_set_max_load_factor(map, 0.99) && map->max_load_factor == 0.9375,
+			"An open addressing map's load factor was not lowered");
+	map_set_max_load_factor(map, 0.5);
+	for (int i = 0; i < 10000; i++) {
+		map_insert(map, keys + i, keys + i, &int_eq);
+		ck_assert_msg(map_load_factor(map) <= 0.5, "Load factor over the maximum");
+	}
+	map_destroy(map);
+
+	map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND);
+	map_set_max_load_factor(map, 0.5);
+	map_set_growth_factor(map, 4);
+	size_t num_buckets = map_num_buckets(map);
+	for (int i = 0; i < 10000; i++) {
+		map_insert(map, keys + i, keys + i, &int_eq);
+		/* Chained maps check the load factor before an insertion. */
+		ck_assert_msg(map_occupied(map) <= 0.5 * map_num_buckets(map) + 1,
+				"Load factor over the maximum");
+		if (map_num_buckets(map) != num_buckets) {
+			ck_assert_msg(map_num_buckets(map) >= 4 * num_buckets,
+					"Grew by less than the growth factor");
+			num_buckets = map_num_buckets(map);
+		}
+	}
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_multi)
+{
+	int flag_sets[] = {
+		MAPF_AUTOEXPAND,
+		MAPF_AUTOEXPAND | MAPF_INCREMENTAL | MAPF_POOL | MAPF_BLOOM,
+		MAPF_OPEN,
+		MAPF_ROBIN_HOOD,
+	};
+	static int keys[1000], values[1000];
+	for (int i = 0; i < 1000; i++) keys[i] = values[i] = i;
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(int); f++) {
+		struct map *map = map_create_fs(10, sizeof(int), flag_sets[f] | MAPF_MULTI);
+		/* Key k gets the values below 1000 divisible by k + 1. */
+		for (int v = 0; v < 1000; v++)
+			for (int k = 0; k < 100; k++)
+				if (v % (k + 1) == 0)
+					ck_assert(map_append(map, keys + k, values + v, &int_eq) == MAPE_OK);
+		ck_assert_msg(map_size(map) == 100, "Values of a key not grouped");
+
+		for (int k = 0; k < 100; k++) {
+			size_t n;
+			void **found = map_lookup_all(map, keys + k, &int_eq, &n);
+			ck_assert_msg(found != NULL && n == (size_t)(999 / (k + 1) + 1),
+					"Wrong number of values for key %d", k);
+			for (size_t i = 0; i < n; i++)
+				ck_assert_msg(*(int *)found[i] == (int)i * (k + 1),
+						"Values out of order for key %d", k);
+		}
+		size_t n;
+		ck_assert(map_lookup_all(map, keys + 500, &int_eq, &n) == NULL && n == 0);
+
+		struct map_pair *pair = map_remove(map, keys, &int_eq);
+		ck_assert(pair != NULL && ((struct map_values *)pair->value)->size == 1000);
+		free(pair->value);
+		free(pair);
+		ck_assert(map_lookup_all(map, keys, &int_eq, &n) == NULL);
+
+		/* Pairs not made by appending would have no list of values. */
+		enum map_err result;
+		int inserted;
+		void *key_ptrs[] = { keys + 500 };
+		ck_assert_msg(map_insert(map, keys + 500, values, &int_eq) == MAPE_INVALID
+				&& map_upsert(map, keys + 500, &int_eq, &pair, &inserted)
+					== MAPE_INVALID
+				&& map_insert_batch(map, key_ptrs, key_ptrs, 1, NULL, &result) == 0
+				&& result == MAPE_INVALID && map_size(map) == 99,
+				"Inserted into a multimap");
+		map_destroy(map);
+	}
+
+	/* Values of equal keys in arrays are appended. */
+	void *key_ptrs[6], *value_ptrs[6];
+	for (int i = 0; i < 6; i++) {
+		key_ptrs[i] = keys + i % 2;
+		value_ptrs[i] = values + i;
+	}
+	struct map *map = map_from_arrays_fs(key_ptrs, value_ptrs, 6, sizeof(int), &int_eq,
+			MAPF_MULTI, 0);
+	size_t n;
+	void **found = map_lookup_all(map, keys + 1, &int_eq, &n);
+	ck_assert_msg(map_size(map) == 2 && n == 3 && found[0] == values + 1
+			&& found[2] == values + 5, "Wrong values of a multimap from arrays");
+	map_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_upsert)
+{
+	int flag_sets[] = {
+		MAPF_AUTOEXPAND,
+		MAPF_AUTOEXPAND | MAPF_INCREMENTAL | MAPF_POOL | MAPF_BLOOM,
+		MAPF_OPEN | MAPF_BLOOM,
+		MAPF_ROBIN_HOOD,
+		MAPF_INLINE,
+	};
+	static int keys[1000];
+	static size_t counts[1000];
+	for (int i = 0; i < 1000; i++) keys[i] = i;
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(int); f++) {
+		struct map *map = flag_sets[f] == MAPF_INLINE
+			? map_create_inline(10, sizeof(int), sizeof(size_t), 0)
+			: map_create_fs(10, sizeof(int), flag_sets[f]);
+		memset(counts, 0, sizeof(counts));
+		/* Count the occurences of every key in a skewed sequence. */
+		for (int i = 0; i < 20000; i++) {
+			int k = (i * 7919) % 1000 % (i % 10 + 1) * 100 % 1000 + i % 100;
+			struct map_pair *pair;
+			int inserted;
+			ck_assert(map_upsert(map, keys + k, &int_eq, &pair, &inserted) == MAPE_OK);
+			ck_assert_msg(inserted == (counts[k] == 0), "Wrong insertion flag");
+			ck_assert_msg(*(int *)pair->key == k, "Pair of another key");
+			if (flag_sets[f] == MAPF_INLINE)
+				++*(size_t *)pair->value;
+			else
+				pair->value = counts + k;
+			counts[k]++;
+		}
+		for (int k = 0; k < 1000; k++) {
+			struct map_pair *pair = map_lookup(map, keys + k, &int_eq);
+			ck_assert_msg((pair != NULL) == (counts[k] != 0), "Key %d lost", k);
+			if (pair == NULL) continue;
+			if (flag_sets[f] == MAPF_INLINE)
+				ck_assert(*(size_t *)pair->value == counts[k]);
+			else
+				ck_assert(pair->value == counts + k);
+		}
+		map_destroy(map);
+	}
+}
+END_TEST;
+
 Suite *
 map_suite(void)
 {
@@ -145,6 +983,24 @@ map_suite(void)
 	tcase_add_test(core_tests, test_lookup);
 	tcase_add_test(core_tests, test_expand);
 	tcase_add_test(core_tests, test_remove);
+	tcase_add_test(core_tests, test_open);
+	tcase_add_test(core_tests, test_counters);
+	tcase_add_test(core_tests, test_incremental);
+	tcase_add_test(core_tests, test_hash);
+	tcase_add_test(core_tests, test_pow2);
+	tcase_add_test(core_tests, test_batch);
+	tcase_add_test(core_tests, test_pool);
+	tcase_add_test(core_tests, test_cached_hash);
+	tcase_add_test(core_tests, test_iteration);
+	tcase_add_test(core_tests, test_from_arrays);
+	tcase_add_test(core_tests, test_robin_hood);
+	tcase_add_test(core_tests, test_stats);
+	tcase_add_test(core_tests, test_inline);
+	tcase_add_test(core_tests, test_bloom);
+	tcase_add_test(core_tests, test_shrink);
+	tcase_add_test(core_tests, test_reserve);
+	tcase_add_test(core_tests, test_multi);
+	tcase_add_test(core_tests, test_upsert);
 
 	suite_add_tcase(res, core_tests);
 
@@ -180,3 +1036,17 @@ int_eq(void *i1, void *i2)
 	int *b = i2;
 	return *a == *b;
 }
+
+size_t
+counted_int_size(void *i)
+{
+	num_size_calls++;
+	return sizeof(int);
+}
+
+int
+counted_int_eq(void *i1, void *i2)
+{
+	num_eq_calls++;
+	return int_eq(i1, i2);
+}
@@ -0,0 +1,10 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+int
+int_eq(void *i1, void *i2);
+
+size_t
+int_size(void *i);
+
+#endif /* MAIN_H */
@@ -0,0 +1,154 @@
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "map.h"
+#include "mapfile.h"
+
+#include "main.h"
+
+START_TEST(test_roundtrip)
+{
+	char path[] = "/tmp/mapfile-test-XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert_msg(fd >= 0, "Failed to create a temporary file");
+	close(fd);
+
+	struct map *map = map_create_fs(10, sizeof(int), MAPF_AUTOEXPAND);
+	int keys[1000];
+	double values[1000];
+	for (int i = 0; i < 1000; i++) {
+		keys[i] = i * 3;
+		values[i] = i / 2.0;
+		map_insert(map, keys + i, values + i, &int_eq);
+	}
+	ck_assert_msg(mapfile_write(map, path, sizeof(double)),
+			"Failed to write a map file: %s", strerror(errno));
+	map_destroy(map);
+
+	struct mapfile *file = mapfile_open(path);
+	ck_assert_msg(file != NULL, "Failed to open a map file: %s", strerror(errno));
+	ck_assert_msg(mapfile_size(file) == 1000, "Wrong size of a map file");
+
+	struct map_pair pair;
+	for (int i = 0; i < 1000; i++) {
+		int key = i * 3;
+		ck_assert_msg(mapfile_lookup(file, &key, &pair) == &pair,
+				"%d is not found in a map file", key);
+		ck_assert_msg(*(int *)pair.key == key, "Wrong key found for %d", key);
+		ck_assert_msg(*(double *)pair.value == i / 2.0, "Wrong value found for %d", key);
+		key++;
+		ck_assert_msg(mapfile_lookup(file, &key, &pair) == NULL,
+				"%d is found in a map file it's not in", key);
+	}
+
+	/* Replacing the file with a smaller one leaves the open one intact. */
+	map = map_create_fs(10, sizeof(int), 0);
+	map_insert(map, keys, values, &int_eq);
+	ck_assert_msg(mapfile_write(map, path, sizeof(double)),
+			"Failed to replace a map file: %s", strerror(errno));
+	map_destroy(map);
+	int key = 999 * 3;
+	ck_assert_msg(mapfile_lookup(file, &key, &pair) == &pair,
+			"An open map file changed when it was replaced");
+	mapfile_close(file);
+	file = mapfile_open(path);
+	ck_assert_msg(file != NULL && mapfile_size(file) == 1,
+			"Wrong size of a replaced map file");
+	mapfile_close(file);
+	unlink(path);
+}
+END_TEST;
+
+START_TEST(test_invalid)
+{
+	struct map *map = map_create(10, &int_size, MAPF_AUTOEXPAND);
+	ck_assert_msg(!mapfile_write(map, "/tmp/never-written", 0),
+			"Wrote a map with variable size keys");
+	map_destroy(map);
+
+	map = map_create_fs(10, sizeof(int), 0);
+	ck_assert_msg(!mapfile_write(map, "/nonexistent/dir/map", 0) && errno == ENOENT,
+			"Wrote a map file into a missing directory");
+	map_destroy(map);
+
+	char path[] = "/tmp/mapfile-test-XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert_msg(fd >= 0, "Failed to create a temporary file");
+	const char garbage[] = "this is not a map file, but it's long enough to be one";
+	ck_assert_msg(write(fd, garbage, sizeof(garbage)) == sizeof(garbage),
+			"Failed to write a temporary file");
+	close(fd);
+	ck_assert_msg(mapfile_open(path) == NULL && errno == EINVAL,
+			"Opened an invalid map file");
+
+	/* A single key takes one of two slots of 16 bytes at the end of the
+	 * file. With both of them full of garbage, lookups must still end. */
+	map = map_create_fs(10, sizeof(int), 0);
+	int key = 1;
+	map_insert(map, &key, NULL, &int_eq);
+	ck_assert_msg(mapfile_write(map, path, 0), "Failed to write a map file");
+	map_destroy(map);
+	FILE *file = fopen(path, "r+");
+	ck_assert_msg(file != NULL, "Failed to open a map file for writing");
+	unsigned char full[32];
+	memset(full, 0xff, sizeof(full));
+	fseek(file, -(long)sizeof(full), SEEK_END);
+	fwrite(full, 1, sizeof(full), file);
+	fclose(file);
+	struct mapfile *mapfile = mapfile_open(path);
+	struct map_pair pair;
+	ck_assert_msg(mapfile != NULL && mapfile_lookup(mapfile, &key, &pair) == NULL,
+			"Found a key in a map file without empty slots");
+	mapfile_close(mapfile);
+	unlink(path);
+}
+END_TEST;
+
+Suite *
+mapfile_suite(void)
+{
+	Suite *res = suite_create("Map file");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_roundtrip);
+	tcase_add_test(core_tests, test_invalid);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = mapfile_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
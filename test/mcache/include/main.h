@@ -0,0 +1,16 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+int
+int_eq(void *i1, void *i2);
+
+size_t
+int_size(void *i);
+
+void
+count_eviction(void *pair);
+
+void *
+run_thread(void *cache);
+
+#endif /* MAIN_H */
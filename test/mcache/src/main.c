@@ -0,0 +1,198 @@
+#include <check.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "mcache.h"
+
+#include "main.h"
+
+#define NUM_KEYS 1000
+#define NUM_THREADS 4
+
+static int keys[NUM_KEYS];
+static int num_evicted;
+static int last_evicted;
+
+START_TEST(test_lru)
+{
+	struct mcache *cache = mcache_create_fs(3, sizeof(int), MCACHE_LRU, &count_eviction);
+	for (int i = 0; i < NUM_KEYS; i++) keys[i] = i;
+
+	num_evicted = 0;
+	for (int i = 0; i < 3; i++)
+		mcache_put(cache, keys + i, keys + i, &int_eq);
+	/* 0 becomes the most recently used, so 1 goes first. */
+	ck_assert_msg(mcache_get(cache, keys + 0, &int_eq) != NULL, "0 is not cached");
+	mcache_put(cache, keys + 3, keys + 3, &int_eq);
+	ck_assert_msg(num_evicted == 1 && last_evicted == 1,
+			"Evicted %d instead of 1", last_evicted);
+	ck_assert_msg(mcache_get(cache, keys + 1, &int_eq) == NULL, "1 is still cached");
+	mcache_put(cache, keys + 4, keys + 4, &int_eq);
+	ck_assert_msg(num_evicted == 2 && last_evicted == 2,
+			"Evicted %d instead of 2", last_evicted);
+
+	/* Replacing a pair hands the old one to the callback. */
+	int value = 40;
+	mcache_put(cache, keys + 4, &value, &int_eq);
+	ck_assert_msg(num_evicted == 3 && last_evicted == 4, "The replaced pair is lost");
+	struct map_pair *pair = mcache_get(cache, keys + 4, &int_eq);
+	ck_assert_msg(pair != NULL && pair->value == &value, "Wrong value after replacing");
+	ck_assert_msg(mcache_size(cache) == 3, "Wrong size of a cache");
+
+	struct map_pair removed;
+	ck_assert_msg(mcache_remove(cache, keys + 0, &int_eq, &removed) == &removed
+			&& removed.value == keys + 0, "Failed to remove 0");
+	ck_assert_msg(mcache_size(cache) == 2 && num_evicted == 3,
+			"Removal evicted or kept a pair");
+	mcache_put(cache, keys + 5, keys + 5, &int_eq);
+	ck_assert_msg(num_evicted == 3, "Evicted a pair with room to spare");
+
+	mcache_destroy(cache);
+}
+END_TEST;
+
+START_TEST(test_clock)
+{
+	struct mcache *cache = mcache_create(100, &int_size, MCACHE_CLOCK, &count_eviction);
+	for (int i = 0; i < NUM_KEYS; i++) keys[i] = i;
+
+	num_evicted = 0;
+	for (int i = 0; i < 100; i++)
+		mcache_put(cache, keys + i, NULL, &int_eq);
+	/* Nothing has been hit yet, so the hand evicts 0 right away. Then only
+	 * the keys hit since the hand last passed them stay. */
+	mcache_put(cache, keys + 100, NULL, &int_eq);
+	ck_assert_msg(mcache_get(cache, keys + 0, &int_eq) == NULL, "0 is still cached");
+	for (int round = 0; round < 5; round++) {
+		for (int i = 0; i < 10; i++)
+			mcache_get(cache, keys + i * 10 + 5, &int_eq);
+		for (int i = 0; i < 20; i++)
+			mcache_put(cache, keys + 101 + round * 20 + i, NULL, &int_eq);
+	}
+	for (int i = 0; i < 10; i++)
+		ck_assert_msg(mcache_get(cache, keys + i * 10 + 5, &int_eq) != NULL,
+				"Hot key %d was evicted", i * 10 + 5);
+	ck_assert_msg(mcache_size(cache) == 100, "Wrong size of a full cache");
+	ck_assert_msg(num_evicted == 101, "Evicted %d pairs", num_evicted);
+
+	mcache_destroy(cache);
+}
+END_TEST;
+
+START_TEST(test_sharded)
+{
+	struct cmcache *cache = cmcache_create_fs(4, 256, sizeof(int), MCACHE_LRU, NULL);
+	for (int i = 0; i < NUM_KEYS; i++) keys[i] = i;
+
+	pthread_t threads[NUM_THREADS];
+	for (int i = 0; i < NUM_THREADS; i++)
+		ck_assert_msg(pthread_create(threads + i, NULL, &run_thread, cache) == 0,
+				"Failed to start a thread");
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	ck_assert_msg(cmcache_size(cache) <= 256, "A sharded cache outgrew its capacity");
+	struct map_pair pair;
+	int key = NUM_KEYS - 1;
+	ck_assert_msg(cmcache_get(cache, &key, &int_eq, &pair) == &pair
+			&& pair.value == keys + key, "The last key put is not cached");
+	ck_assert_msg(cmcache_remove(cache, &key, &int_eq, &pair) == &pair,
+			"Failed to remove from a sharded cache");
+	ck_assert_msg(cmcache_get(cache, &key, &int_eq, &pair) == NULL,
+			"A removed key is still cached");
+
+	cmcache_destroy(cache);
+}
+END_TEST;
+
+START_TEST(test_shard_capacity)
+{
+	for (int i = 0; i < NUM_KEYS; i++) keys[i] = i;
+
+	/* Capacities that don't divide evenly, or fall short of a pair per
+	 * shard. */
+	size_t capacities[] = { 10, 3, 1 };
+	size_t expected_shards[] = { 8, 2, 1 };
+	for (int c = 0; c < 3; c++) {
+		struct cmcache *cache = cmcache_create_fs(8, capacities[c], sizeof(int),
+				MCACHE_LRU, NULL);
+		ck_assert_msg(cache->num_shards == expected_shards[c],
+				"%zu shards for capacity %zu", cache->num_shards, capacities[c]);
+		for (int i = 0; i < NUM_KEYS; i++)
+			cmcache_put(cache, keys + i, NULL, &int_eq);
+		ck_assert_msg(cmcache_size(cache) == capacities[c],
+				"A full cache of capacity %zu holds %zu pairs", capacities[c],
+				cmcache_size(cache));
+		cmcache_destroy(cache);
+	}
+	ck_assert_msg(cmcache_create_fs(8, 0, sizeof(int), MCACHE_LRU, NULL) == NULL,
+			"Created a sharded cache of no capacity");
+}
+END_TEST;
+
+Suite *
+mcache_suite(void)
+{
+	Suite *res = suite_create("Cache");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_lru);
+	tcase_add_test(core_tests, test_clock);
+	tcase_add_test(core_tests, test_sharded);
+	tcase_add_test(core_tests, test_shard_capacity);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = mcache_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
+
+void
+count_eviction(void *pair)
+{
+	struct map_pair *p = pair;
+	num_evicted++;
+	last_evicted = *(int *)p->key;
+}
+
+/* Every thread puts all keys in order, looking up the ones put a while ago. */
+void *
+run_thread(void *cache)
+{
+	struct map_pair pair;
+	for (int i = 0; i < NUM_KEYS; i++) {
+		cmcache_put(cache, keys + i, keys + i, &int_eq);
+		if (i >= 10) cmcache_get(cache, keys + i - 10, &int_eq, &pair);
+	}
+	return NULL;
+}
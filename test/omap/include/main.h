@@ -0,0 +1,15 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <stdlib.h>
+
+int
+int_eq(void *i1, void *i2);
+
+size_t
+int_size(void *i);
+
+void
+count_pair(void *pair);
+
+#endif /* MAIN_H */
@@ -0,0 +1,132 @@
+#include <check.h>
+#include <stdlib.h>
+
+#include "omap.h"
+
+#include "main.h"
+
+#define NUM_KEYS 100000
+
+static int keys[2 * NUM_KEYS];
+static int num_pairs;
+
+START_TEST(test_lookup)
+{
+	struct omap *map = omap_create(10, &int_size);
+	for (int i = 0; i < 2 * NUM_KEYS; i++) keys[i] = i;
+
+	/* The map grows a few times on the way, changing the width of its
+	 * indices. */
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg(omap_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d", i);
+	ck_assert_msg(omap_insert(map, keys + 7, keys + 7, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate key");
+	ck_assert_msg(omap_size(map) == NUM_KEYS, "Wrong size of a map");
+
+	for (int i = 0; i < 2 * NUM_KEYS; i++) {
+		struct map_pair *pair = omap_lookup(map, keys + i, &int_eq);
+		if (i < NUM_KEYS)
+			ck_assert_msg(pair != NULL && pair->value == keys + i,
+					"%d is not found", i);
+		else
+			ck_assert_msg(pair == NULL, "%d is found in a map it's not in", i);
+	}
+
+	struct map_pair removed;
+	for (int i = 0; i < NUM_KEYS; i += 2)
+		ck_assert_msg(omap_remove(map, keys + i, &int_eq, &removed) == &removed
+				&& removed.key == keys + i, "Failed to remove %d", i);
+	ck_assert_msg(omap_remove(map, keys, &int_eq, &removed) == NULL,
+			"Removed a key twice");
+	for (int i = 0; i < NUM_KEYS; i++)
+		ck_assert_msg((omap_lookup(map, keys + i, &int_eq) != NULL) == (i % 2 == 1),
+				"Wrong lookup of %d after removals", i);
+	ck_assert_msg(omap_size(map) == NUM_KEYS / 2, "Wrong size after removals");
+
+	num_pairs = 0;
+	omap_destroy_ex(map, &count_pair);
+	ck_assert_msg(num_pairs == NUM_KEYS / 2, "Destroyed %d pairs", num_pairs);
+}
+END_TEST;
+
+START_TEST(test_order)
+{
+	struct omap *map = omap_create_fs(0, sizeof(int));
+	/* Insert keys in a scrambled order, then remove every third one and
+	 * insert them again, which moves them to the end. */
+	for (int i = 0; i < NUM_KEYS; i++) {
+		keys[i] = (int)((i * 7919L) % NUM_KEYS);
+		omap_insert(map, keys + i, NULL, &int_eq);
+	}
+	struct map_pair removed;
+	for (int i = 0; i < NUM_KEYS; i += 3)
+		omap_remove(map, keys + i, &int_eq, &removed);
+	for (int i = 0; i < NUM_KEYS; i += 3)
+		omap_insert(map, keys + i, NULL, &int_eq);
+
+	struct omap_iter iter;
+	omap_iter_init(&iter, map);
+	for (int moved = 0; moved < 2; moved++) {
+		for (int i = 0; i < NUM_KEYS; i++) {
+			if ((i % 3 == 0) != moved) continue;
+			struct map_pair *pair = omap_iter_next(&iter);
+			ck_assert_msg(pair != NULL && pair->key == keys + i,
+					"Pair %d out of order", i);
+		}
+	}
+	ck_assert_msg(omap_iter_next(&iter) == NULL, "Too many pairs");
+	omap_destroy(map);
+}
+END_TEST;
+
+Suite *
+omap_suite(void)
+{
+	Suite *res = suite_create("Ordered map");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_lookup);
+	tcase_add_test(core_tests, test_order);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = omap_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+size_t
+int_size(void *i)
+{
+	return sizeof(int);
+}
+
+void
+count_pair(void *pair)
+{
+	num_pairs++;
+}
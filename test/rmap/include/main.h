@@ -0,0 +1,19 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+int
+int_eq(void *i1, void *i2);
+
+int
+stored_int_eq(void *stored, void *key, void *keys);
+
+void
+count_destroyed(void *pair);
+
+void
+free_value(void *pair);
+
+void *
+read_values(void *arg);
+
+#endif /* MAIN_H */
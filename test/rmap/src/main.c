@@ -0,0 +1,223 @@
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "rmap.h"
+
+#include "main.h"
+
+#define NUM_READERS 4
+#define NUM_KEYS 64
+#define NUM_UPDATES 20000
+
+static int num_destroyed;
+
+static struct rmap *shared_map;
+static int shared_keys[NUM_KEYS];
+static atomic_int stop_reading;
+
+START_TEST(test_basic)
+{
+	struct rmap *map = rmap_create_fs(4, sizeof(int));
+
+	int keys[100];
+	for (int i = 0; i < 100; i++) {
+		keys[i] = i;
+		ck_assert_msg(rmap_insert(map, keys + i, keys + i, &int_eq) == MAPE_OK,
+				"Failed to insert %d into a read-mostly map", i);
+	}
+	ck_assert_msg(rmap_insert(map, keys, NULL, &int_eq) == MAPE_EXIST,
+			"Inserted a duplicate into a read-mostly map");
+	ck_assert_msg(rmap_size(map) == 100, "Wrong size of a read-mostly map");
+
+	for (int i = 0; i < 100; i++) {
+		struct map_pair *pair = rmap_lookup(map, keys + i, &int_eq);
+		ck_assert_msg(pair != NULL, "%d is not found in a read-mostly map", i);
+		ck_assert_msg(pair->value == keys + i, "Wrong value is associated with %d", i);
+	}
+
+	/* Keys in the map are passed first, as everywhere else. */
+	int copy = 42;
+	struct map_pair *found = rmap_lookup_ex(map, &copy, &stored_int_eq, keys);
+	ck_assert_msg(found != NULL && found->key == keys + 42,
+			"The stored key is not the first one compared");
+
+	ck_assert_msg(rmap_replace(map, keys + 7, keys + 8, &int_eq, NULL) == MAPE_OK,
+			"Failed to replace the value of 7");
+	ck_assert_msg(rmap_lookup(map, keys + 7, &int_eq)->value == keys + 8,
+			"Replacing a value didn't change it");
+	ck_assert_msg(rmap_size(map) == 100, "Replacing a value changed the size");
+
+	ck_assert_msg(rmap_remove(map, keys + 5, &int_eq, NULL),
+			"Failed to remove 5 from a read-mostly map");
+	ck_assert_msg(!rmap_remove(map, keys + 5, &int_eq, NULL),
+			"Removed 5 from a read-mostly map twice");
+	ck_assert_msg(rmap_lookup(map, keys + 5, &int_eq) == NULL,
+			"5 is still found in a read-mostly map");
+	ck_assert_msg(rmap_size(map) == 99, "Wrong size after a removal");
+
+	rmap_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_grace_period)
+{
+	struct rmap *map = rmap_create_fs(16, sizeof(int));
+	int keys[3] = { 0, 1, 2 };
+	for (int i = 0; i < 3; i++)
+		rmap_insert(map, keys + i, NULL, &int_eq);
+
+	num_destroyed = 0;
+	struct rmap_reader *reader = rmap_reader_register(map);
+	struct map_pair *pair = rmap_lookup(map, keys + 1, &int_eq);
+	rmap_remove(map, keys + 1, &int_eq, &count_destroyed);
+	ck_assert_msg(num_destroyed == 0,
+			"A pair was destroyed while a reader could still see it");
+	ck_assert_msg(pair->key == keys + 1, "A removed pair was changed");
+
+	rmap_quiescent(reader);
+	rmap_remove(map, keys + 2, &int_eq, &count_destroyed);
+	ck_assert_msg(num_destroyed == 1,
+			"A pair was not destroyed after a quiescent state");
+
+	rmap_reader_offline(reader);
+	rmap_synchronize(map);
+	ck_assert_msg(num_destroyed == 2,
+			"A pair was not destroyed after the reader went offline");
+
+	rmap_reader_online(reader);
+	rmap_replace(map, keys, NULL, &int_eq, &count_destroyed);
+	ck_assert_msg(num_destroyed == 2,
+			"A replaced pair was destroyed while a reader could still see it");
+	rmap_reader_unregister(reader);
+	rmap_synchronize(map);
+	ck_assert_msg(num_destroyed == 3,
+			"A pair was not destroyed after the reader was unregistered");
+
+	rmap_destroy(map);
+}
+END_TEST;
+
+START_TEST(test_threads)
+{
+	shared_map = rmap_create_fs(4, sizeof(int));
+	for (int i = 0; i < NUM_KEYS; i++) {
+		shared_keys[i] = i;
+		int *value = malloc(sizeof(int));
+		*value = i;
+		rmap_insert(shared_map, shared_keys + i, value, &int_eq);
+	}
+
+	atomic_store(&stop_reading, 0);
+	pthread_t threads[NUM_READERS];
+	for (int i = 0; i < NUM_READERS; i++)
+		pthread_create(threads + i, NULL, &read_values, NULL);
+
+	/* Every value is freed as soon as the readers allow it, so a reader
+	 * seeing a freed one would be caught by a sanitizer or by the check. */
+	for (int i = 0; i < NUM_UPDATES; i++) {
+		int key = i % NUM_KEYS;
+		int *value = malloc(sizeof(int));
+		*value = key;
+		if (i % 3 == 0) {
+			rmap_remove(shared_map, shared_keys + key, &int_eq, &free_value);
+			rmap_insert(shared_map, shared_keys + key, value, &int_eq);
+		} else {
+			rmap_replace(shared_map, shared_keys + key, value, &int_eq, &free_value);
+		}
+	}
+
+	atomic_store(&stop_reading, 1);
+	long errors = 0;
+	for (int i = 0; i < NUM_READERS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		errors += (long)res;
+	}
+	ck_assert_msg(errors == 0, "Readers have seen %ld wrong values", errors);
+	ck_assert_msg(rmap_size(shared_map) == NUM_KEYS, "Wrong size of a read-mostly map");
+
+	rmap_destroy_ex(shared_map, &free_value);
+}
+END_TEST;
+
+Suite *
+rmap_suite(void)
+{
+	Suite *res = suite_create("Read-mostly map");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_basic);
+	tcase_add_test(core_tests, test_grace_period);
+	tcase_add_test(core_tests, test_threads);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = rmap_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/* ---------- helper things ---------- */
+
+int
+int_eq(void *i1, void *i2)
+{
+	int *a = i1;
+	int *b = i2;
+	return *a == *b;
+}
+
+/* Equal only if 'stored' is one of the keys at 'keys'. */
+int
+stored_int_eq(void *stored, void *key, void *keys)
+{
+	int *base = keys;
+	int *a = stored;
+	return a >= base && a < base + 100 && int_eq(stored, key);
+}
+
+void
+count_destroyed(void *pair)
+{
+	num_destroyed++;
+}
+
+void
+free_value(void *pair)
+{
+	free(((struct map_pair *)pair)->value);
+}
+
+void *
+read_values(void *arg)
+{
+	long errors = 0;
+	struct rmap_reader *reader = rmap_reader_register(shared_map);
+	while (!atomic_load(&stop_reading)) {
+		for (int i = 0; i < NUM_KEYS; i++) {
+			/* The key may be missing for a moment between a removal
+			 * and an insertion. */
+			struct map_pair *pair = rmap_lookup(shared_map, shared_keys + i, &int_eq);
+			if (pair != NULL && *(int *)pair->value != i) errors++;
+		}
+		rmap_quiescent(reader);
+	}
+	rmap_reader_offline(reader);
+	rmap_reader_unregister(reader);
+	return (void *)errors;
+}
@@ -0,0 +1,4 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+#endif /* MAIN_H */
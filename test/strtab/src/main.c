@@ -0,0 +1,114 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "strtab.h"
+
+#include "main.h"
+
+#define NUM_STRINGS 100000
+
+static char strings[NUM_STRINGS][16];
+
+START_TEST(test_intern)
+{
+	struct strtab *tab = strtab_create(0);
+	static const char *interned[NUM_STRINGS];
+	for (int i = 0; i < NUM_STRINGS; i++) {
+		sprintf(strings[i], "string %d", i);
+		interned[i] = strtab_intern(tab, strings[i]);
+		ck_assert_msg(interned[i] != NULL && interned[i] != strings[i]
+				&& strcmp(interned[i], strings[i]) == 0,
+				"Failed to intern %s", strings[i]);
+	}
+	ck_assert_msg(strtab_size(tab) == NUM_STRINGS, "Wrong size of a table");
+
+	/* Equal strings get the same pointer, whatever they are terminated
+	 * with. */
+	for (int i = 0; i < NUM_STRINGS; i++) {
+		char buf[32];
+		sprintf(buf, "string %d!", i);
+		ck_assert_msg(strtab_intern(tab, strings[i]) == interned[i]
+				&& strtab_intern_n(tab, buf, strlen(buf) - 1) == interned[i]
+				&& strtab_lookup(tab, strings[i]) == interned[i],
+				"Interned %s twice", strings[i]);
+	}
+	ck_assert_msg(strtab_lookup(tab, "string") == NULL
+			&& strtab_lookup_n(tab, "string 1000000", 13) == NULL,
+			"Found a string not in the table");
+	ck_assert_msg(strtab_size(tab) == NUM_STRINGS, "Strings interned twice");
+
+	/* Strings with NULs inside are compared up to their lengths. */
+	const char *with_nul = strtab_intern_n(tab, "a\0c", 3);
+	ck_assert(with_nul != NULL && memcmp(with_nul, "a\0c", 4) == 0);
+	ck_assert_msg(strtab_lookup_n(tab, "a\0b", 3) == NULL
+			&& strtab_intern_n(tab, "a", 1) != with_nul
+			&& strtab_intern_n(tab, "a\0c", 3) == with_nul,
+			"Strings with NULs mixed up");
+
+	/* Long strings get chunks of their own. */
+	static char long_string[100000];
+	memset(long_string, 'a', sizeof(long_string) - 1);
+	const char *long_interned = strtab_intern(tab, long_string);
+	ck_assert(long_interned != NULL && strcmp(long_interned, long_string) == 0);
+	ck_assert(strtab_intern(tab, "string 0") == interned[0]);
+	ck_assert(strtab_intern(tab, long_string) == long_interned);
+	strtab_destroy(tab);
+}
+END_TEST;
+
+START_TEST(test_ptr_keys)
+{
+	struct strtab *tab = strtab_create(NUM_STRINGS);
+	struct map *map = map_create_fs_h(16, sizeof(char *), &strtab_ptr_hash, MAPF_OPEN);
+	struct map *inline_map = map_create_inline(16, sizeof(char *), sizeof(int), 0);
+	for (int i = 0; i < NUM_STRINGS; i++) {
+		sprintf(strings[i], "%d", i % 1000);
+		const char *s = strtab_intern(tab, strings[i]);
+		ck_assert(map_insert(map, (void *)s, NULL, &strtab_ptr_eq) != MAPE_NOMEM);
+		/* Inline maps copy the pointer itself. */
+		struct map_pair *pair;
+		ck_assert(map_upsert(inline_map, &s, &strtab_ptr_eq, &pair, NULL) == MAPE_OK);
+		++*(int *)pair->value;
+	}
+	ck_assert_msg(map_size(map) == 1000 && map_size(inline_map) == 1000,
+			"Wrong number of distinct keys");
+	const char *s = strtab_lookup(tab, "7");
+	ck_assert(map_lookup(map, (void *)s, &strtab_ptr_eq) != NULL);
+	ck_assert(*(int *)map_lookup(inline_map, &s, &strtab_ptr_eq)->value == NUM_STRINGS / 1000);
+	map_destroy(inline_map);
+	map_destroy(map);
+	strtab_destroy(tab);
+}
+END_TEST;
+
+Suite *
+strtab_suite(void)
+{
+	Suite *res = suite_create("String table");
+
+	/* Core tests. */
+	TCase *core_tests = tcase_create("Core");
+	tcase_add_test(core_tests, test_intern);
+	tcase_add_test(core_tests, test_ptr_keys);
+
+	suite_add_tcase(res, core_tests);
+
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	int failed = 0;
+	Suite *suite = strtab_suite();
+	SRunner *runner = srunner_create(suite);
+
+	srunner_run_all(runner, CK_NORMAL);
+	failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (failed == 0) ? 0 : 1;
+}